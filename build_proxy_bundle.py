@@ -0,0 +1,220 @@
+#!/usr/bin/env python
+"""
+<Program Name>
+  build_proxy_bundle.py
+
+<Purpose>
+  Deploys the AFFIX proxy with a proxy bundle. The repy modules that
+  the configured shim stacks use are resolved, preprocessed and compiled
+  here once, and stored together with the compiled lind calls in
+  proxy_bundle.bin. The proxy then loads them from the bundle when it
+  starts, instead of reading, preprocessing and compiling every module.
+  Only the .repy files of the bundled modules are deployed.
+
+<Usage>
+  python build_proxy_bundle.py DEPLOY_DIR [--shim-string SHIM_STRING]...
+      [--policy SHIM_POLICY_FILE] [--module MODULE]...
+
+  The stacks of the default shim string of posix_call_definition.py,
+  of every --shim-string and of every rule of the shim policy (see
+  LIBNIT_PROXY_SHIM_POLICY) are bundled. --module bundles a repy module
+  that is only imported later on.
+"""
+
+import os
+import sys
+import imp
+import glob
+import shutil
+import marshal
+import tempfile
+import py_compile
+
+
+# The files of the repo the proxy runs from, besides the repy modules.
+LIND_DIR = 'lind'
+REPYLIB_DIR = 'repylib'
+PROXY_FILES = ['smart_shim_proxy.py', 'posix_call_definition.py']
+OPTIONAL_FILES = ['libnit_codec.so']
+DYLINK_FILE = 'dylink.repy'
+BUNDLE_FILE = 'proxy_bundle.bin'
+BUNDLE_MAGIC = 'LIBNITB1'
+
+# The lind calls that posix_call_definition.py runs.
+LIND_FILES = ['lind_fs_calls.py', 'lind_net_calls.py']
+
+
+
+def usage():
+  print "Usage:\n$ python build_proxy_bundle.py DEPLOY_DIR [--shim-string SHIM_STRING]... [--policy SHIM_POLICY_FILE] [--module MODULE]..."
+  sys.exit(1)
+
+
+
+def parse_args(args):
+  if not args or args[0].startswith('--'):
+    usage()
+
+  deploy_dir = args[0]
+  shim_strings = []
+  modules = []
+  policy_file = None
+
+  index = 1
+  while index < len(args):
+    if index + 1 == len(args):
+      usage()
+
+    if args[index] == '--shim-string':
+      shim_strings.append(args[index + 1])
+    elif args[index] == '--policy':
+      policy_file = os.path.abspath(args[index + 1])
+    elif args[index] == '--module':
+      modules.append(args[index + 1])
+    else:
+      usage()
+
+    index += 2
+
+  return deploy_dir, shim_strings, policy_file, modules
+
+
+
+def copy_runtime_files(repo_dir, target_dir):
+  # Everything the proxy needs but the .repy modules.
+  for filename in glob.glob(os.path.join(repo_dir, LIND_DIR, '*')):
+    shutil.copy2(filename, target_dir)
+
+  for filename in glob.glob(os.path.join(repo_dir, REPYLIB_DIR, '*.py')):
+    shutil.copy2(filename, target_dir)
+
+  shutil.copy2(os.path.join(repo_dir, REPYLIB_DIR, DYLINK_FILE), target_dir)
+
+  for filename in PROXY_FILES:
+    shutil.copy2(os.path.join(repo_dir, filename), target_dir)
+
+  for filename in OPTIONAL_FILES:
+    if os.path.isfile(os.path.join(repo_dir, filename)):
+      shutil.copy2(os.path.join(repo_dir, filename), target_dir)
+
+
+
+def resolve_modules(shim_strings, policy_file, modules):
+  """
+  <Purpose>
+    Imports the proxy in the current directory (a full deployment) and
+    builds every shim stack it may use, so that dylink loads all the
+    modules they need.
+
+  <Return>
+    A dict that maps the module name to the code object of every repy
+    module that was loaded.
+  """
+
+  sys.path.insert(0, os.getcwd())
+
+  import posix_call_definition
+  import dylink_repy
+
+  if policy_file:
+    posix_call_definition.load_shim_policy(policy_file)
+
+  shim_strings = shim_strings + posix_call_definition.shim_interface_dict.keys()
+
+  for shim_string in shim_strings:
+    posix_call_definition.get_shim_interface(shim_string)
+    posix_call_definition.ShimStack(shim_string, '127.0.0.1')
+
+  for module in modules:
+    posix_call_definition.dy_import_module(module)
+
+  # The proxy imports these itself.
+  import smart_shim_proxy
+
+  module_code = {}
+  for module, namespace in dylink_repy.MODULE_CACHE.items():
+    module_code[module] = namespace._virt.code
+
+  return module_code
+
+
+
+def write_bundle(deploy_dir, module_code):
+  # The entries name the source they were built from, so that the proxy
+  # can tell a module that was changed after the build.
+  entries = []
+
+  for filename in LIND_FILES:
+    source_file = open(os.path.join(deploy_dir, filename))
+    code = compile(source_file.read(), filename, 'exec')
+    source_file.close()
+    entries.append(('lind', filename, filename) + source_stat(deploy_dir, filename) + (code,))
+
+  for module, code in module_code.items():
+    source = module + '.repy'
+    entries.append(('repy', module, source) + source_stat(deploy_dir, source) + (code,))
+
+  bundle_file = open(os.path.join(deploy_dir, BUNDLE_FILE), 'wb')
+  bundle_file.write(BUNDLE_MAGIC + imp.get_magic())
+  marshal.dump(entries, bundle_file)
+  bundle_file.close()
+
+
+
+def source_stat(deploy_dir, source):
+  source_stat = os.stat(os.path.join(deploy_dir, source))
+  return (int(source_stat.st_mtime), source_stat.st_size)
+
+
+
+def main():
+  deploy_dir, shim_strings, policy_file, modules = parse_args(sys.argv[1:])
+
+  repo_dir = os.path.dirname(os.path.abspath(__file__))
+  deploy_dir = os.path.abspath(deploy_dir)
+
+  if not os.path.isdir(deploy_dir):
+    print "Creating directory: " + deploy_dir
+    os.makedirs(deploy_dir)
+
+  # Build the stacks in a complete deployment, to find out which of the
+  # modules they use.
+  staging_dir = tempfile.mkdtemp(prefix='libnit_bundle_')
+
+  try:
+    copy_runtime_files(repo_dir, staging_dir)
+    for filename in glob.glob(os.path.join(repo_dir, REPYLIB_DIR, '*.repy')):
+      shutil.copy2(filename, staging_dir)
+
+    # Do not pick up a bundle of an earlier build.
+    os.environ['LIBNIT_PROXY_BUNDLE'] = os.path.join(staging_dir, BUNDLE_FILE)
+
+    os.chdir(staging_dir)
+    module_code = resolve_modules(shim_strings, policy_file, modules)
+    os.chdir(repo_dir)
+
+    copy_runtime_files(repo_dir, deploy_dir)
+    for module in module_code:
+      shutil.copy2(os.path.join(staging_dir, module + '.repy'), deploy_dir)
+
+  finally:
+    os.chdir(repo_dir)
+    shutil.rmtree(staging_dir)
+
+  write_bundle(deploy_dir, module_code)
+
+  # Some of the libraries are not valid python until repyhelper has
+  # translated them, those are left alone.
+  for filename in glob.glob(os.path.join(deploy_dir, '*.py')):
+    try:
+      py_compile.compile(filename, doraise=True)
+    except py_compile.PyCompileError:
+      pass
+
+  print "Bundled " + str(len(module_code)) + " repy modules in " + os.path.join(deploy_dir, BUNDLE_FILE) + ":"
+  print "  " + ", ".join(sorted(module_code.keys()))
+
+
+
+if __name__ == '__main__':
+  main()
@@ -4,10 +4,17 @@ deploy_dir=$1
 
 # Make sure that the deployment directory is provided.
 if [ -z "$deploy_dir" ]; then
-    echo -e "Usage:\n$ ./deploy_libnit.sh DEPLOY_DIR"
+    echo -e "Usage:\n$ ./deploy_libnit.sh DEPLOY_DIR [--bundle [BUILDER OPTIONS]]"
     exit
 fi
 
+# With --bundle, deploy only the modules the shim stacks use, pre-compiled
+# into a proxy bundle (see build_proxy_bundle.py for the options).
+if [ "$2" == "--bundle" ]; then
+    shift 2
+    exec python build_proxy_bundle.py "$deploy_dir" "$@"
+fi
+
 # Check to see if directory exists. If directory does not exist
 # then create it.
 if [ ! -d "$deploy_dir" ]; then
@@ -24,4 +31,9 @@ cp -r repylib/* $deploy_dir
 cp smart_shim_proxy.py $deploy_dir
 cp posix_call_definition.py $deploy_dir
 
+# The native codec of the CompressionShim, if it was built.
+if [ -f libnit_codec.so ]; then
+    cp libnit_codec.so $deploy_dir
+fi
+
 
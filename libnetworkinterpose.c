@@ -11,19 +11,28 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netdb.h>
+#include <fnmatch.h>
+#include <zlib.h>
+#include "libnit_trace.h"
+#define LIBNIT_IMPLEMENTATION
+#include "libnit.h"
  
 
 /* Define some global variables. */
 int RECV_SIZE = 2048;
 int ERRBADFD = 9;
 
-int DEBUG = 0;
-
 /* A dictionary that keeps track of translation from proxy fd
  * to repy fd. 
  */
@@ -51,38 +60,181 @@ typedef struct proxy_response
 } PROXY_REPLY;
 
 
+/* The configuration of the in-process native shim engine. It is
+ * built once from the LIBNIT_NATIVE_SHIM environment variable, which
+ * holds a shim string in the same format as the shim_string used by
+ * the proxy, e.g. "(LogShim,native_log.txt)(CompressionShim,4096)".
+ */
+typedef struct native_shim_config
+{
+  int enabled;
+  int compress;
+  int block_size;
+  int level;
+  char log_file[256];
+  int log_fd;
+  char shim_string[256];
+} NATIVE_SHIM_CONFIG;
+
+
+/* The state the native shim engine keeps for every kernel socket it
+ * owns. recv_buf holds the raw (compressed) stream that has not been
+ * turned into complete blocks yet, and result_buf holds the
+ * decompressed data that has not been handed to the application.
+ */
+typedef struct native_sock
+{
+  pthread_mutex_t send_lock;
+  pthread_mutex_t recv_lock;
+  char *recv_buf;
+  size_t recv_len;
+  size_t recv_cap;
+  char *result_buf;
+  size_t result_off;
+  size_t result_len;
+  size_t result_cap;
+  int peer_closed;
+  int refs;
+} NATIVE_SOCK;
+
+
+/* One proxy instance that virtual sockets can be sent to. An endpoint
+ * that fails to accept a connection is marked down until down_until.
+ */
+typedef struct proxy_endpoint
+{
+  char ip[64];
+  int port;
+  int failures;
+  int open_channels;
+  struct timeval down_until;
+} PROXY_ENDPOINT;
+
+
+/* A virtual socket that has no proxy connection yet. The application
+ * holds a plain libc socket (identified by ino) until the first call
+ * that needs the proxy replays the socket() call there. With a
+ * destination policy, policy_pending is set until the first connect,
+ * bind or sendto decides where the socket goes, and the int options
+ * set until then are kept in opts to be replayed on the proxy.
+ */
+#define LAZY_SOCK_OPTS 8
+
+typedef struct lazy_sock
+{
+  int pending;
+  int domain;
+  int type;
+  int protocol;
+  ino_t ino;
+  int policy_pending;
+  int opt_count;
+  int opts[LAZY_SOCK_OPTS][3];
+} LAZY_SOCK;
+
+
+/* A rule of the destination policy. The rules that share a destination
+ * prefix hang off the same trie node, linked through next in the order
+ * of the policy file.
+ */
+typedef struct policy_rule
+{
+  int action;
+  int type;
+  int port_lo;
+  int port_hi;
+  int has_dst;
+  int next;
+} POLICY_RULE;
+
+
+typedef struct policy_node
+{
+  int child[2];
+  int rules;
+} POLICY_NODE;
+
+
+/* The per-socket modes an application set through libnit.h. Sends
+ * that are held back by write coalescing wait in send_buf, data that
+ * was read ahead waits in recv_buf from recv_off on.
+ */
+typedef struct sock_tuning
+{
+  pthread_mutex_t send_lock;
+  pthread_mutex_t recv_lock;
+  size_t coalesce;
+  size_t read_ahead;
+  char* send_buf;
+  size_t send_len;
+  size_t send_cap;
+  char* recv_buf;
+  size_t recv_off;
+  size_t recv_len;
+  size_t recv_cap;
+} SOCK_TUNING;
+
+
+/* A cached name lookup. key is the host name, or "@" and the dotted
+ * address for a reverse lookup (whose answer is in host). An entry
+ * without addresses or host is a negative one.
+ */
+#define DNS_NAME_LEN 256
+#define DNS_MAX_ADDRS 8
+
+typedef struct dns_cache_entry
+{
+  char key[DNS_NAME_LEN + 1];
+  char host[DNS_NAME_LEN];
+  struct in_addr addrs[DNS_MAX_ADDRS];
+  int naddrs;
+  time_t expires;
+} DNS_CACHE_ENTRY;
+
+
 
 
-/* List of all the calls we are going to interpose on. */
-int socket(int domain, int type, int protocol);
+/* List of all the calls we are going to interpose on. They are the
+ * only symbols (with the calls of libnit.h) the library exports when
+ * it is built with -fvisibility=hidden (make release, lto or pgo).
+ */
+#define LIBNIT_INTERPOSE __attribute__((visibility("default")))
+
+int socket(int domain, int type, int protocol) LIBNIT_INTERPOSE;
 int bind(int socket, const struct sockaddr *address,
-         socklen_t address_len);
+         socklen_t address_len) LIBNIT_INTERPOSE;
 int accept(int socket, struct sockaddr *address,
-           socklen_t *address_len);
+           socklen_t *address_len) LIBNIT_INTERPOSE;
 int connect(int socket, const struct sockaddr *address,
-            socklen_t address_len);
-int listen(int socket, int backlog);
-int close(int sockfd);
-int shutdown(int socket, int how);
+            socklen_t address_len) LIBNIT_INTERPOSE;
+int listen(int socket, int backlog) LIBNIT_INTERPOSE;
+int close(int sockfd) LIBNIT_INTERPOSE;
+int shutdown(int socket, int how) LIBNIT_INTERPOSE;
 int setsockopt(int socket, int level, int option_name,
-               const void *option_value, socklen_t option_len);
+               const void *option_value, socklen_t option_len) LIBNIT_INTERPOSE;
 int getsockopt(int socket, int level, int option_name,
-	       void *option_value, socklen_t *option_len);
+	       void *option_value, socklen_t *option_len) LIBNIT_INTERPOSE;
 int getpeername(int socket, struct sockaddr *address,
 		socklen_t *address_len);
 int getsockname(int socket, struct sockaddr *address,
 		socklen_t *address_len);
 
-ssize_t send(int socket, const void *message, size_t length, int flags);
+ssize_t send(int socket, const void *message, size_t length, int flags) LIBNIT_INTERPOSE;
 ssize_t sendto(int socket, const void *message, size_t length, int flags,
-             const struct sockaddr *dest_addr, socklen_t dest_len);
-ssize_t recv(int socket, void *buffer, size_t length, int flags);
+             const struct sockaddr *dest_addr, socklen_t dest_len) LIBNIT_INTERPOSE;
+ssize_t recv(int socket, void *buffer, size_t length, int flags) LIBNIT_INTERPOSE;
 ssize_t recvfrom(int socket, void *buffer, size_t length,
-             int flags, struct sockaddr *address, socklen_t *address_len);
+             int flags, struct sockaddr *address, socklen_t *address_len) LIBNIT_INTERPOSE;
 
 
-ssize_t read(int fd, void *buf, size_t count);
-ssize_t write(int fd, const void *buf, size_t count); 
+ssize_t read(int fd, void *buf, size_t count) LIBNIT_INTERPOSE;
+ssize_t write(int fd, const void *buf, size_t count) LIBNIT_INTERPOSE;
+
+int getaddrinfo(const char *node, const char *service,
+                const struct addrinfo *hints, struct addrinfo **res) LIBNIT_INTERPOSE;
+struct hostent *gethostbyname(const char *name) LIBNIT_INTERPOSE;
+int getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host, socklen_t hostlen,
+                char *serv, socklen_t servlen, int flags) LIBNIT_INTERPOSE;
 
 
 int ioctl(int, int, ...);
@@ -108,6 +260,18 @@ int (*libc_close)(int);
 int (*libc_shutdown)(int, int);
 ssize_t (*libc_send)(int, const void*, size_t, int);
 ssize_t (*libc_recv)(int, void*, size_t, int); 
+int (*libc_listen)(int, int);
+int (*libc_getsockopt)(int, int, int, void*, socklen_t*);
+ssize_t (*libc_sendto)(int, const void*, size_t, int, const struct sockaddr*, socklen_t);
+ssize_t (*libc_recvfrom)(int, void*, size_t, int, struct sockaddr*, socklen_t*);
+ssize_t (*libc_read)(int, void*, size_t);
+ssize_t (*libc_write)(int, const void*, size_t);
+int (*libc_select)(int, fd_set*, fd_set*, fd_set*, struct timeval*);
+int (*libc_poll)(struct pollfd*, nfds_t, int);
+int (*libc_fcntl)(int, int, ...);
+int (*libc_getaddrinfo)(const char*, const char*, const struct addrinfo*, struct addrinfo**);
+struct hostent* (*libc_gethostbyname)(const char*);
+int (*libc_getnameinfo)(const struct sockaddr*, socklen_t, char*, socklen_t, char*, socklen_t, int);
 
 
 
@@ -129,10 +293,316 @@ char *proxy_ip = "127.0.0.1";
 int proxy_port = 53678;
 
 
+/* The proxy instances to spread the virtual sockets over. They are
+ * read once from LIBNIT_PROXY_ENDPOINTS ("ip:port,ip:port,...") or
+ * from the file named by LIBNIT_PROXY_CONFIG (one "ip:port" per line).
+ * If neither is set, the only endpoint is proxy_ip:proxy_port.
+ * socket_endpoint_dict remembers which endpoint (plus one) every proxy
+ * connection belongs to, since a repy fd only exists in one proxy.
+ */
+#define MAX_PROXY_ENDPOINTS 32
+PROXY_ENDPOINT proxy_endpoints[MAX_PROXY_ENDPOINTS];
+int proxy_endpoint_count = 0;
+int proxy_max_channels = 0;
+unsigned int proxy_channel_seq = 0;
+pthread_once_t proxy_endpoints_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t proxy_endpoints_lock = PTHREAD_MUTEX_INITIALIZER;
+int socket_endpoint_dict[1024];
+
+void load_proxy_endpoints();
+int add_proxy_endpoint(char* endpoint_str);
+int pick_proxy_endpoint(unsigned int key, int tried_mask);
+int connect_proxy_endpoint(int endpoint);
+int init_master_sock_on(int endpoint);
+void release_proxy_channel(int sockfd);
+int proxy_sock_lookup(int sockfd);
+
+
+/* The circuit breaker for the proxy. After breaker_threshold proxy
+ * failures in a row (LIBNIT_BREAKER_THRESHOLD) the breaker opens and
+ * new sockets become plain libc sockets. A background thread probes
+ * the proxies every breaker_probe_ms (LIBNIT_BREAKER_PROBE_MS) and
+ * closes the breaker again once one of them answers.
+ */
+int breaker_threshold = 3;
+int breaker_probe_ms = 1000;
+int breaker_failures = 0;
+int breaker_open = 0;
+pthread_mutex_t breaker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int proxy_breaker_allows();
+void proxy_breaker_record(int success);
+void* proxy_breaker_probe(void* unused);
+
+
 /* The master socket control that is used to connect to the repy server. */
 int initmastersock = -1;
 
 
+/* The native shim engine. Sockets that are owned by the engine are
+ * kernel sockets that never touch the proxy, they are kept track of
+ * in native_sock_dict (indexed by the application fd). The calls that
+ * use an entry hold a reference on it (see native_sock_get()), so a
+ * close() on another thread only frees it once they are done.
+ */
+NATIVE_SHIM_CONFIG native_shim;
+pthread_once_t native_shim_once = PTHREAD_ONCE_INIT;
+NATIVE_SOCK* native_sock_dict[1024];
+pthread_mutex_t native_sock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void init_libc_calls();
+void native_shim_init();
+int native_shim_parse(char* shim_str, NATIVE_SHIM_CONFIG* config);
+int native_shim_wants(int domain, int type);
+NATIVE_SOCK* native_sock_lookup(int sockfd);
+NATIVE_SOCK* native_sock_get(int sockfd);
+void native_sock_put(NATIVE_SOCK* ns);
+int native_sock_register(int sockfd);
+void native_sock_release(int sockfd);
+ssize_t native_send(int sockfd, NATIVE_SOCK* ns, const void *message, size_t length, int flags);
+ssize_t native_recv(int sockfd, NATIVE_SOCK* ns, void *buffer, size_t length, int flags);
+
+
+/* Sockets that the proxy relays as a raw stream (see request_relay()).
+ * Their data goes straight over the proxy connection with libc calls.
+ */
+int relay_sock_dict[1024];
+
+void request_relay(int sockfd);
+int relay_sock_lookup(int sockfd);
+
+
+/* Virtual sockets whose proxy connection has not been opened yet. */
+LAZY_SOCK lazy_sock_dict[1024];
+pthread_mutex_t lazy_sock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void libnit_init();
+int lazy_sock_open(int sockfd);
+
+
+/* The destination policy, read from the file named by LIBNIT_POLICY
+ * when the library is loaded. Its rules are compiled into a binary
+ * trie over the IPv4 destination, so deciding between the proxy and
+ * libc costs at most 32 steps down the trie.
+ */
+#define POLICY_INTERPOSE 0
+#define POLICY_BYPASS 1
+
+POLICY_RULE* policy_rules = NULL;
+POLICY_NODE* policy_nodes = NULL;
+int policy_rule_count = 0;
+int policy_node_count = 0;
+int policy_default = POLICY_INTERPOSE;
+
+void policy_load();
+int policy_lookup(const struct sockaddr* address, int type);
+void policy_check(int sockfd, const struct sockaddr* address);
+
+
+/* Every virtual socket has two lanes to the proxy. Its own fd is the
+ * write lane and carries every call except recv()/recvfrom(), which go
+ * over a second proxy connection, the read lane, opened on the first
+ * receive (recv_lane_dict holds its fd plus one). The proxy serves the
+ * two lanes in separate threads, so a blocked recv() does not hold up
+ * a send(). channel_lock keeps concurrent callers on the same lane
+ * from interleaving their requests. LIBNIT_DUPLEX=0 keeps a single lane.
+ */
+int recv_lane_dict[1024];
+pthread_mutex_t channel_lock[1024];
+pthread_mutex_t recv_lane_lock = PTHREAD_MUTEX_INITIALIZER;
+int duplex_lanes = 1;
+
+int recv_lane_get(int sockfd);
+void recv_lane_release(int sockfd);
+
+
+/* After fork() the child shares the proxy connections of its parent.
+ * Every inherited virtual socket is flagged in fork_attach_dict and
+ * gets a connection of its own, attached to the same repy fd, when the
+ * child first uses it.
+ */
+int fork_attach_dict[1024];
+pthread_mutex_t fork_attach_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The resolver cache. Lookups that miss it share one connection to
+ * the proxy. dns_max_ttl (LIBNIT_DNS_TTL, 0 turns the cache and the
+ * proxy lookups off) is how long an answer is kept when the proxy does
+ * not know its TTL, and the most it is kept otherwise.
+ * dns_negative_ttl (LIBNIT_DNS_NEGATIVE_TTL) is how long we remember
+ * that a name does not exist.
+ */
+#define DNS_CACHE_SIZE 256
+#define DNS_CACHE_PROBES 4
+#define DNS_NOT_FOUND 1
+#define DNS_TRY_AGAIN 2
+#define DNS_NO_PROXY 3
+
+DNS_CACHE_ENTRY dns_cache[DNS_CACHE_SIZE];
+pthread_rwlock_t dns_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_mutex_t dns_resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+int dns_resolver_sock = -1;
+int dns_max_ttl = 60;
+int dns_negative_ttl = 30;
+
+int dns_cache_lookup(const char* key, DNS_CACHE_ENTRY* entry);
+void dns_cache_store(DNS_CACHE_ENTRY* entry);
+int dns_resolve(const char* name, int reverse, DNS_CACHE_ENTRY* entry);
+
+/* The implementations of the interposed calls. The calls themselves
+ * (see CALL TRACE) only add the optional call trace around them.
+ */
+int libnit_socket(int domain, int type, int protocol);
+int libnit_bind(int sockfd, const struct sockaddr *address, socklen_t address_len);
+int libnit_accept(int sockfd, struct sockaddr *address, socklen_t *address_len);
+int libnit_connect(int sockfd, const struct sockaddr *address, socklen_t address_len);
+int libnit_listen(int sockfd, int backlog);
+ssize_t libnit_send(int sockfd, const void *message, size_t length, int flags);
+ssize_t libnit_sendto(int sockfd, const void *message, size_t length, int flags,
+                      const struct sockaddr *dest_addr, socklen_t dest_len);
+ssize_t libnit_recv(int sockfd, void *buffer, size_t length, int flags);
+ssize_t libnit_recvfrom(int sockfd, void *buffer, size_t length,
+                        int flags, struct sockaddr *address, socklen_t *address_len);
+ssize_t libnit_write(int sockfd, const void *message, size_t length);
+ssize_t libnit_read(int sockfd, void *buffer, size_t length);
+int libnit_getsockopt(int sockfd, int level, int option_name,
+                      void *option_value, socklen_t *option_len);
+int libnit_setsockopt(int sockfd, int level, int option_name,
+                      const void *option_value, socklen_t option_len);
+int libnit_shutdown(int sockfd, int how);
+int libnit_close(int sockfd);
+
+
+/* The call trace of this process, NULL unless LIBNIT_TRACE is set. */
+TRACE_HEADER* trace_ring = NULL;
+TRACE_RECORD* trace_records = NULL;
+size_t trace_ring_size = 0;
+int trace_payload_len = 0;
+
+void trace_open();
+uint64_t trace_now();
+int trace_fd_is_socket(int fd);
+void trace_record(int opcode, int fd, uint64_t start_ns, ssize_t result, size_t length,
+                  int arg1, int arg2, int arg3, const struct sockaddr* address,
+                  const void* payload, size_t payload_len);
+
+
+/* The spans of the sampled calls, see SPANS. span_trace_id is the
+ * trace of the call the thread is in, 0 if it is not sampled.
+ */
+typedef struct span
+{
+  uint64_t trace_id;        /* 0 if the call is not sampled. */
+  uint64_t start_ns;
+} SPAN;
+
+int span_fd = -1;
+unsigned int span_sample = 1;
+unsigned int span_sample_count = 0;
+__thread uint64_t span_trace_id = 0;
+__thread uint64_t span_rand_state = 0;
+
+void span_open();
+uint64_t span_now();
+uint64_t span_new_id();
+SPAN span_begin();
+void span_end(SPAN* span, const char* name, int fd, long result);
+void span_write(const char* name, uint64_t trace_id, uint64_t start_ns, uint64_t end_ns,
+                int fd, long result);
+void span_send_context(int chanfd, uint64_t flow_id, uint64_t sent_ns);
+void span_write_flow(uint64_t flow_id, uint64_t sent_ns);
+
+
+/* The log of the library. Messages at or below log_level
+ * (LIBNIT_LOG_LEVEL, warnings by default) are formatted into log_queue,
+ * which threads add to without taking a lock, and a background thread
+ * writes them to LIBNIT_LOG_FILE (stderr by default). LIBNIT_LOG_SAMPLE
+ * ("call=100,dns=10") keeps only one in every N messages of a category.
+ * LIBNIT_LOG checks the level before anything is formatted, so the
+ * messages that are turned off cost a compare.
+ */
+enum log_level { LIBNIT_LOG_ERROR, LIBNIT_LOG_WARN, LIBNIT_LOG_INFO, LIBNIT_LOG_DEBUG };
+enum log_category { LOG_CAT_PROXY, LOG_CAT_CALL, LOG_CAT_DNS, LOG_CAT_SHIM, LOG_CATEGORIES };
+
+#define LOG_QUEUE_SIZE 1024
+#define LOG_MESSAGE_LEN 256
+
+#define LIBNIT_LOG(level, category, ...) \
+  do { \
+    if ((level) <= log_level && log_sampled(category)) \
+      log_message((level), (category), __VA_ARGS__); \
+  } while (0)
+
+/* A slot of log_queue is free for message i when its seq is twice the
+ * number of times the queue wrapped before i, and holds message i when
+ * it is one more than that.
+ */
+typedef struct log_slot
+{
+  volatile uint64_t seq;
+  int len;
+  char msg[LOG_MESSAGE_LEN];
+} LOG_SLOT;
+
+const char* log_level_names[] = { "error", "warn", "info", "debug" };
+const char* log_category_names[] = { "proxy", "call", "dns", "shim" };
+int log_level = LIBNIT_LOG_WARN;
+unsigned int log_sample[LOG_CATEGORIES];
+unsigned int log_sample_count[LOG_CATEGORIES];
+LOG_SLOT log_queue[LOG_QUEUE_SIZE];
+volatile uint64_t log_tail = 0;
+uint64_t log_head = 0;
+unsigned long log_dropped = 0;
+int log_fd = 2;
+int log_ready = 0;
+int log_writer_running = 0;
+pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void log_open();
+int log_sampled(int category);
+void log_message(int level, int category, const char* fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+int log_drain();
+void* log_writer(void* unused);
+void log_flush();
+
+
+/* What libnit.h offers the applications. Every socket has its
+ * counters in sock_stats_dict, the ones with modes set have their
+ * state in sock_tuning_dict. The calls are only timed if
+ * sock_stats_timing (LIBNIT_STATS_TIMING=1) is set.
+ */
+struct libnit_stats sock_stats_dict[1024];
+int sock_stats_timing = 0;
+SOCK_TUNING* sock_tuning_dict[1024];
+pthread_mutex_t sock_tuning_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void sock_stats_record(int sockfd, int sending, uint64_t start_ns, ssize_t result);
+void sock_stats_reset(int sockfd);
+SOCK_TUNING* sock_tuning_get(int sockfd, int create);
+void sock_tuning_release(int sockfd);
+int sock_tuning_flush(int sockfd, SOCK_TUNING* st);
+ssize_t tuned_send(int sockfd, SOCK_TUNING* st, const void *message, size_t length, int flags);
+ssize_t tuned_recv(int sockfd, SOCK_TUNING* st, void *buffer, size_t length, int flags);
+ssize_t sock_recv(int sockfd, void *buffer, size_t length, int flags);
+
+/* The connections that carry the batches of libnit_submit(), one per
+ * proxy (holding its fd plus one), opened on first use. batch_lock
+ * keeps the exchanges on one connection apart; the batches for
+ * different proxies do not wait for each other.
+ */
+int batch_channel_dict[MAX_PROXY_ENDPOINTS];
+pthread_mutex_t batch_lock[MAX_PROXY_ENDPOINTS];
+
+int batch_exchange(int endpoint, const struct libnit_sqe* sqes, int count,
+                   struct libnit_cqe* cqes, int* batch_endpoint);
+
+
+void libnit_atfork_prepare();
+void libnit_atfork_parent();
+void libnit_atfork_child();
+int fork_sock_attach(int sockfd);
+
+
 
 
 /* For some reason itoa is not available when we preload
@@ -150,6 +620,34 @@ void my_itoa(int value, char* buff, int protocol)
 
 
 
+/* One send or recv on a proxy channel. The channel is the application's
+ * fd, so it is non-blocking if the application made the socket so; the
+ * exchange with the proxy still waits for the channel.
+ */
+ssize_t proxy_channel_io(int sockfd, void* buf, size_t length, int sending)
+{
+  struct pollfd pfd;
+  ssize_t result;
+
+  while (1) {
+    if (sending)
+      result = (*libc_send)(sockfd, buf, length, 0);
+    else
+      result = (*libc_recv)(sockfd, buf, length, 0);
+
+    if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+      return result;
+
+    if (errno != EINTR) {
+      pfd.fd = sockfd;
+      pfd.events = sending ? POLLOUT : POLLIN;
+      poll(&pfd, 1, -1);
+    }
+  }
+}
+
+
+
 /* This is the main function that forwards the serialized api call to the repy
  * proxy and returns the result of the API call back. Any returning result is
  * placed in the result_buffer and any error is placed in error_value
@@ -178,17 +676,50 @@ void forward_api_to_proxy(int sockfd, char* func_call, char* arg_list, char* res
   strcpy(sockstruct.func_name, func_call);
   strcpy(sockstruct.arg_list, arg_list);
 
-  if (DEBUG) {
-    printf("\nCalling function '%s'.\n", func_call);
-    fflush(stdout);
-  }
+  LIBNIT_LOG(LIBNIT_LOG_DEBUG, LOG_CAT_CALL, "calling %s on fd %d", func_call, sockfd);
+
+  /* The request and its reply must not interleave with another
+   * thread's on the same connection.
+   */
+  pthread_mutex_t* lane_lock = sockfd >= 0 && sockfd < MAX_SOCK_FD ? &channel_lock[sockfd] : NULL;
+
+  if (lane_lock)
+    pthread_mutex_lock(lane_lock);
+
+  /* A sampled call tells the proxy its trace first. */
+  uint64_t exchange_ns = span_trace_id ? span_now() : 0;
+
+  if (exchange_ns)
+    span_send_context(sockfd, span_new_id(), exchange_ns);
 
   /* Send the structure over to the Repy proxy server. */
-  int bytes_sent = (*libc_send)(sockfd, &sockstruct, sizeof(sockstruct), 0);
+  int bytes_sent = proxy_channel_io(sockfd, &sockstruct, sizeof(sockstruct), 1);
 
   /* Receive the response back from the Repy proxy server. */
-  char recv_buf[RECV_SIZE];
-  (*libc_recv)(sockfd, recv_buf, RECV_SIZE, 0);
+  char recv_buf[RECV_SIZE + 1];
+  int bytes_recv = bytes_sent < 0 ? -1 : proxy_channel_io(sockfd, recv_buf, RECV_SIZE, 0);
+
+  if (lane_lock)
+    pthread_mutex_unlock(lane_lock);
+
+  if (exchange_ns)
+    span_write("proxy exchange", span_trace_id, exchange_ns, span_now(), sockfd, bytes_recv);
+
+  /* If the proxy went away, fail the call instead of handing back
+   * whatever is in the buffer.
+   */
+  if (bytes_recv <= 0) {
+    proxy_breaker_record(0);
+    result_buffer[0] = '\0';
+    *error_value = ECONNRESET;
+    errno = ECONNRESET;
+    return;
+  }
+
+  /* The response is not terminated, and whatever is left on the stack
+   * behind it would end up in the result.
+   */
+  recv_buf[bytes_recv] = '\0';
 
   /* Build the reply structure from the response. */
   replystruct = (PROXY_REPLY*) recv_buf;
@@ -202,9 +733,8 @@ void forward_api_to_proxy(int sockfd, char* func_call, char* arg_list, char* res
 
 // ######################## CREATE MASTER SOCKET ###############################
 
-int init_master_sock() 
+void init_libc_calls()
 {
-
   if (initmastersock < 0) {
     /* Retrieve the libc networking calls that we need for communication. */
     *(void **)(&libc_socket) = dlsym(RTLD_NEXT, "socket");
@@ -216,14 +746,35 @@ int init_master_sock()
     *(void **)(&libc_shutdown) = dlsym(RTLD_NEXT, "shutdown");
     *(void **)(&libc_send) = dlsym(RTLD_NEXT, "send");
     *(void **)(&libc_recv) = dlsym(RTLD_NEXT, "recv");
-    
+    *(void **)(&libc_listen) = dlsym(RTLD_NEXT, "listen");
+    *(void **)(&libc_getsockopt) = dlsym(RTLD_NEXT, "getsockopt");
+    *(void **)(&libc_sendto) = dlsym(RTLD_NEXT, "sendto");
+    *(void **)(&libc_recvfrom) = dlsym(RTLD_NEXT, "recvfrom");
+    *(void **)(&libc_read) = dlsym(RTLD_NEXT, "read");
+    *(void **)(&libc_write) = dlsym(RTLD_NEXT, "write");
+    *(void **)(&libc_select) = dlsym(RTLD_NEXT, "select");
+    *(void **)(&libc_poll) = dlsym(RTLD_NEXT, "poll");
+    *(void **)(&libc_fcntl) = dlsym(RTLD_NEXT, "fcntl");
+    *(void **)(&libc_getaddrinfo) = dlsym(RTLD_NEXT, "getaddrinfo");
+    *(void **)(&libc_gethostbyname) = dlsym(RTLD_NEXT, "gethostbyname");
+    *(void **)(&libc_getnameinfo) = dlsym(RTLD_NEXT, "getnameinfo");
+
     initmastersock = 1;
   }
+}
 
 
-  /* Declare the variables we will need. */
-  int mastersockfd = -1;
-  struct sockaddr_in serv_addr;
+
+/* Resolve the libc calls and read the configuration once, when the
+ * library is loaded, instead of on every call. The interposed calls
+ * only fall back to init_libc_calls() if they run before this does
+ * (e.g. from the constructor of another library).
+ */
+__attribute__((constructor))
+void libnit_init()
+{
+  dlerror();
+  init_libc_calls();
 
   /* Exit if we are unable to load any of it. */
   if(dlerror()) {
@@ -232,485 +783,2211 @@ int init_master_sock()
     exit(1);
   }
 
+  log_open();
+  policy_load();
 
-  /* Create the master socket that we will use to communicate with the Repy proxy. */
-  if ((mastersockfd = (*libc_socket)(AF_INET, SOCK_STREAM, 0)) < 0) {
-    fprintf(stderr, "Unable to open up a sockobj for local communication to proxy");
-    exit(1);
-  } 
+  pthread_once(&proxy_endpoints_once, load_proxy_endpoints);
+  pthread_once(&native_shim_once, native_shim_init);
 
-  
-  /* Create the server address. */
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = inet_addr(proxy_ip);
-  serv_addr.sin_port = htons(proxy_port);
-  
-  /* Connect to the Repy server. */
-  if ((*libc_connect)(mastersockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) == -1) {
-    perror("Unable to connect to the Repy proxy.");
-  }
+  int i;
+  for (i = 0; i < MAX_SOCK_FD; i++)
+    pthread_mutex_init(&channel_lock[i], NULL);
 
+  for (i = 0; i < MAX_PROXY_ENDPOINTS; i++)
+    pthread_mutex_init(&batch_lock[i], NULL);
 
-  return mastersockfd;
-}
+  if (getenv("LIBNIT_DUPLEX") && strcmp(getenv("LIBNIT_DUPLEX"), "0") == 0)
+    duplex_lanes = 0;
 
+  if (getenv("LIBNIT_DNS_TTL"))
+    dns_max_ttl = atoi(getenv("LIBNIT_DNS_TTL"));
 
+  if (getenv("LIBNIT_DNS_NEGATIVE_TTL"))
+    dns_negative_ttl = atoi(getenv("LIBNIT_DNS_NEGATIVE_TTL"));
 
+  if (getenv("LIBNIT_STATS_TIMING") && strcmp(getenv("LIBNIT_STATS_TIMING"), "1") == 0)
+    sock_stats_timing = 1;
 
-// ######################## SOCKET CONNECTION CALLS ############################
+  trace_open();
+  span_open();
 
+  pthread_atfork(libnit_atfork_prepare, libnit_atfork_parent, libnit_atfork_child);
+}
 
-int socket(int domain, int type, int protocol)
-{
-  /* Initialize everything and create the master socket */
-  int sockfd = init_master_sock();
 
-  char arg_list[30] = "";
-  char buf[20] = "";
 
-  /* Convert all the arguments to string and creat a struct for it. */
-  memset(buf, 0, strlen(buf));
-  my_itoa(domain, buf, 10);
-  
-  memset(arg_list, 0, strlen(arg_list));
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+int init_master_sock()
+{
+  pthread_once(&proxy_endpoints_once, load_proxy_endpoints);
 
-  memset(buf, 0, strlen(buf));
-  my_itoa(type, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+  if (!proxy_breaker_allows())
+    return -1;
 
-  memset(buf, 0, strlen(buf));
-  my_itoa(protocol, buf, 10);
-  strcat(arg_list, buf);
+  /* Hash the new virtual socket onto one of the proxies. If the chosen
+   * proxy does not answer, we move on to the next best one.
+   */
+  pthread_mutex_lock(&proxy_endpoints_lock);
+  unsigned int key = ((unsigned int) getpid() << 16) ^ ++proxy_channel_seq;
+  pthread_mutex_unlock(&proxy_endpoints_lock);
 
-  char recv_buf[RECV_SIZE];
-  int err_val;
+  int tried_mask = 0;
+  int attempt;
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "socket", arg_list, recv_buf, &err_val);
+  for (attempt = 0; attempt < proxy_endpoint_count; attempt++) {
+    int endpoint = pick_proxy_endpoint(key, tried_mask);
+    int mastersockfd = connect_proxy_endpoint(endpoint);
 
-  // NOTE: This seems questionable. Should at least be set to watch for -1.
-  if (err_val < 0) {
-    int repy_sock_fd = atoi(recv_buf);
-    socket_fd_dict[sockfd % MAX_SOCK_FD] = repy_sock_fd;
-    return sockfd;
-  }
-  else
-    return -1;
+    if (mastersockfd >= 0) {
+      proxy_breaker_record(1);
+      return mastersockfd;
+    }
 
-} 
+    tried_mask |= 1 << endpoint;
+  }
 
-    
-int bind(int sockfd, const struct sockaddr *address, socklen_t address_len)
-{
-  char arg_list[50] = "";
-  char buf[50] = "";
+  LIBNIT_LOG(LIBNIT_LOG_WARN, LOG_CAT_PROXY, "unable to connect to the proxy: %s", strerror(errno));
+  proxy_breaker_record(0);
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+  return -1;
+}
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
 
-  memset(buf, 0, strlen(buf));
-  serialize_sockaddr(address, buf);
-  strcat(arg_list, buf);
-  
-  char recv_buf[RECV_SIZE];
-  int err_val;
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "bind", arg_list, recv_buf, &err_val);
+/* Open a new proxy connection to the same proxy as an existing one.
+ * This is needed for sockets that refer to a repy fd in that proxy,
+ * such as the ones returned by accept(). Returns -1 on failure.
+ */
+int init_master_sock_on(int endpoint)
+{
+  int mastersockfd;
 
-  if (err_val < 0)
-    return atoi(recv_buf); 
-  else
-    return -1;
+  pthread_once(&proxy_endpoints_once, load_proxy_endpoints);
 
-}
+  if (endpoint < 0 || endpoint >= proxy_endpoint_count)
+    return init_master_sock();
 
+  if ((mastersockfd = connect_proxy_endpoint(endpoint)) < 0) {
+    LIBNIT_LOG(LIBNIT_LOG_WARN, LOG_CAT_PROXY, "unable to connect to the proxy: %s", strerror(errno));
+    proxy_breaker_record(0);
+  }
 
-int accept(int sockfd, struct sockaddr *address, socklen_t *address_len)
-{
+  return mastersockfd;
+}
 
-  char arg_list[50] = "";
-  char buf[20] = "";
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-    
-  char recv_buf[RECV_SIZE];
-  char sockfd_buf[10];
-  int err_val;
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "accept", arg_list, recv_buf, &err_val);
+// ######################## PROXY ENDPOINTS ####################################
 
-  if (err_val < 0) {
-    /* If we were successful, then we create a new connection to the
-     * repy proxy in order to handle this new socket connection. We
-     * then register the new proxy socket fd with the new repy socket fd
-     * that was returned.
-     */
-    deserialize_sockaddr(address, recv_buf, sockfd_buf);
+void load_proxy_endpoints()
+{
+  char* endpoints_env = getenv("LIBNIT_PROXY_ENDPOINTS");
+  char* config_file = getenv("LIBNIT_PROXY_CONFIG");
+  char* max_channels_env = getenv("LIBNIT_PROXY_MAX_CHANNELS");
+  char line[256];
+  char* endpoint_str;
+  char* saveptr;
+  FILE* config;
+
+  if (endpoints_env && endpoints_env[0]) {
+    char endpoints_buf[strlen(endpoints_env) + 1];
+    strcpy(endpoints_buf, endpoints_env);
+
+    for (endpoint_str = strtok_r(endpoints_buf, ", ", &saveptr); endpoint_str;
+         endpoint_str = strtok_r(NULL, ", ", &saveptr))
+      add_proxy_endpoint(endpoint_str);
+  }
+  else if (config_file && (config = fopen(config_file, "r"))) {
+    while (fgets(line, sizeof(line), config)) {
+      endpoint_str = strtok_r(line, " \t\r\n", &saveptr);
 
-    int new_sock_fd = init_master_sock();
-    int new_repy_sock_fd = atoi(sockfd_buf);
-    socket_fd_dict[new_sock_fd % MAX_SOCK_FD] = new_repy_sock_fd;
+      if (endpoint_str && endpoint_str[0] != '#')
+        add_proxy_endpoint(endpoint_str);
+    }
+    fclose(config);
+  }
 
-    return new_sock_fd; 
+  if (proxy_endpoint_count == 0) {
+    char default_endpoint[80];
+    sprintf(default_endpoint, "%s:%d", proxy_ip, proxy_port);
+    add_proxy_endpoint(default_endpoint);
   }
-  else
-    return -1;
 
-}  
+  /* Optionally an endpoint with too many open proxy connections is
+   * treated as overloaded and only used if everything else is.
+   */
+  if (max_channels_env)
+    proxy_max_channels = atoi(max_channels_env);
 
+  if (getenv("LIBNIT_BREAKER_THRESHOLD"))
+    breaker_threshold = atoi(getenv("LIBNIT_BREAKER_THRESHOLD"));
 
+  if (getenv("LIBNIT_BREAKER_PROBE_MS"))
+    breaker_probe_ms = atoi(getenv("LIBNIT_BREAKER_PROBE_MS"));
 
-int connect(int sockfd, const struct sockaddr *address, socklen_t address_len)
-{
-  fflush(stdout);
+  if (breaker_probe_ms <= 0)
+    breaker_probe_ms = 1000;
+}
 
-  char arg_list[50] = "";
-  char buf[20] = "";
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+/* Add an endpoint of the form "ip:port" or just "ip". */
+int add_proxy_endpoint(char* endpoint_str)
+{
+  PROXY_ENDPOINT* endpoint;
+  char* port_str = strrchr(endpoint_str, ':');
+  size_t ip_len = port_str ? (size_t) (port_str - endpoint_str) : strlen(endpoint_str);
 
-  memset(buf, 0, strlen(buf));
-  serialize_sockaddr(address, buf);
-  strcat(arg_list, buf);
+  if (proxy_endpoint_count >= MAX_PROXY_ENDPOINTS || ip_len == 0 || ip_len >= sizeof(endpoint->ip))
+    return -1;
 
-  char recv_buf[RECV_SIZE];
-  int err_val;
-  
-  if (DEBUG) {
-    printf("Arg list for connect: %s", arg_list);
-    fflush(stdout);
-  }
+  endpoint = &proxy_endpoints[proxy_endpoint_count];
+  memset(endpoint, 0, sizeof(PROXY_ENDPOINT));
+  strncpy(endpoint->ip, endpoint_str, ip_len);
+  endpoint->port = port_str ? atoi(port_str + 1) : proxy_port;
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "connect", arg_list, recv_buf, &err_val);
-  
-  if (err_val < 0){
-    return atoi(recv_buf);
-  }
-  else
+  if (endpoint->port <= 0 || inet_addr(endpoint->ip) == INADDR_NONE)
     return -1;
-}
 
+  proxy_endpoint_count++;
+  return 0;
+}
 
 
 
-int listen(int sockfd, int backlog)
+unsigned int endpoint_score(unsigned int key, int endpoint)
 {
-  char arg_list[20] = "";
-  char buf[20] = "";
+  unsigned int hash = key * 2654435761u ^ (unsigned int) (endpoint + 1) * 0x9e3779b9u;
+
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
 
-  memset(buf, 0, strlen(buf));
-  my_itoa(backlog, buf, 10);
-  strcat(arg_list, buf);
+/* Choose an endpoint for key with rendezvous hashing: every endpoint
+ * scores the key and the highest healthy score wins, so an endpoint
+ * going down only moves the sockets that were mapped to it. Endpoints
+ * in tried_mask are skipped. If no endpoint is healthy we pick the one
+ * that has been down the longest.
+ */
+int pick_proxy_endpoint(unsigned int key, int tried_mask)
+{
+  struct timeval now;
+  int best = -1;
+  int fallback = -1;
+  unsigned int best_score = 0;
+  unsigned int score;
+  int endpoint;
 
-  char recv_buf[RECV_SIZE];
-  int err_val;
+  gettimeofday(&now, NULL);
+  pthread_mutex_lock(&proxy_endpoints_lock);
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "listen", arg_list, recv_buf, &err_val);
+  for (endpoint = 0; endpoint < proxy_endpoint_count; endpoint++) {
+    PROXY_ENDPOINT* cur = &proxy_endpoints[endpoint];
 
-  if (err_val < 0)
-    return atoi(recv_buf); 
-  else
-    return -1;
+    if (tried_mask & (1 << endpoint))
+      continue;
 
-}
+    if (fallback < 0 || timercmp(&cur->down_until, &proxy_endpoints[fallback].down_until, <))
+      fallback = endpoint;
 
+    if (timercmp(&cur->down_until, &now, >))
+      continue;
 
+    if (proxy_max_channels > 0 && cur->open_channels >= proxy_max_channels)
+      continue;
 
-// ################ SEND AND RECEIVE CALLS ################################
+    score = endpoint_score(key, endpoint);
+    if (best < 0 || score > best_score) {
+      best = endpoint;
+      best_score = score;
+    }
+  }
 
+  pthread_mutex_unlock(&proxy_endpoints_lock);
 
-ssize_t send(int sockfd, const void *message, size_t length, int flags)
-{
-  char arg_list[(int)length + 20];
-  char buf[20] = "";
-  char recv_buf[RECV_SIZE];
-  int err_val;
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+  return best >= 0 ? best : (fallback >= 0 ? fallback : 0);
+}
 
-  printf("Got into send.\n"); fflush(stdout);
-  printf( "message, length = %s, %d\n", (char*)message, length ); fflush( stdout );
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  printf( "arg_list = '%s'\n", arg_list ); fflush( stdout );
 
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
-  printf( "arg_list = '%s'\n", arg_list ); fflush( stdout );
+/* Open a proxy connection to the given endpoint and keep its health
+ * up to date. Returns the connected fd or -1.
+ */
+int connect_proxy_endpoint(int endpoint)
+{
+  PROXY_ENDPOINT* cur = &proxy_endpoints[endpoint];
+  struct sockaddr_in serv_addr;
+  struct timeval now;
+  int mastersockfd;
+  int backoff;
 
-  my_itoa(flags, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
-  printf( "arg_list = '%s'\n", arg_list ); fflush( stdout );
+  /* Create the master socket that we will use to communicate with the Repy proxy. */
+  if ((mastersockfd = (*libc_socket)(AF_INET, SOCK_STREAM, 0)) < 0) {
+    fprintf(stderr, "Unable to open up a sockobj for local communication to proxy");
+    exit(1);
+  }
 
-  /* We add the message as the last element in the 
-   * arg list because the message might contain any character,
-   * including the delimeter. */
-  strncat(arg_list, (char*)message, length);
-  printf( "arg_list = '%s'\n", arg_list ); fflush( stdout );
+  /* Create the server address. */
+  memset(&serv_addr, 0, sizeof(serv_addr));
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_addr.s_addr = inet_addr(cur->ip);
+  serv_addr.sin_port = htons(cur->port);
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "send", arg_list, recv_buf, &err_val);
+  /* Connect to the Repy server. */
+  if ((*libc_connect)(mastersockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) == -1) {
+    (*libc_close)(mastersockfd);
+
+    /* Back off exponentially, up to 30 seconds. */
+    pthread_mutex_lock(&proxy_endpoints_lock);
+    cur->failures++;
+    backoff = cur->failures < 5 ? 1 << cur->failures : 30;
+    gettimeofday(&now, NULL);
+    cur->down_until = now;
+    cur->down_until.tv_sec += backoff;
+    pthread_mutex_unlock(&proxy_endpoints_lock);
 
-  if (err_val < 0)
-    return (ssize_t) atoi(recv_buf); 
-  else
     return -1;
+  }
+
+  pthread_mutex_lock(&proxy_endpoints_lock);
+  cur->failures = 0;
+  timerclear(&cur->down_until);
+  cur->open_channels++;
+  pthread_mutex_unlock(&proxy_endpoints_lock);
+
+  if (mastersockfd < MAX_SOCK_FD)
+    socket_endpoint_dict[mastersockfd] = endpoint + 1;
+
+  return mastersockfd;
 }
 
 
 
+/* Forget about the proxy connection behind sockfd once it is closed. */
+void release_proxy_channel(int sockfd)
+{
+  int endpoint;
 
-ssize_t sendto(int sockfd, const void *message, size_t length, int flags,
-             const struct sockaddr *dest_addr, socklen_t dest_len)
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD || !socket_endpoint_dict[sockfd])
+    return;
+
+  endpoint = socket_endpoint_dict[sockfd] - 1;
+  socket_endpoint_dict[sockfd] = 0;
+
+  pthread_mutex_lock(&proxy_endpoints_lock);
+  proxy_endpoints[endpoint].open_channels--;
+  pthread_mutex_unlock(&proxy_endpoints_lock);
+}
+
+
+
+/* Returns 1 if sockfd is a connection to a proxy, i.e. a virtual
+ * socket. Everything else (files, pipes, sockets created while the
+ * breaker was open) is passed straight to libc. A virtual socket
+ * that is used for the first time gets its proxy connection here.
+ */
+int proxy_sock_lookup(int sockfd)
 {
-  char arg_list[(int)length + 50];
-  char buf[20] = "";
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD)
+    return 0;
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+  if (lazy_sock_dict[sockfd].pending)
+    lazy_sock_open(sockfd);
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+  if (fork_attach_dict[sockfd])
+    fork_sock_attach(sockfd);
 
-  memset(buf, 0, strlen(buf));
-  my_itoa(flags, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
-  
-  serialize_sockaddr(dest_addr, arg_list);
-  strcat(arg_list, ",");
+  return socket_endpoint_dict[sockfd] != 0;
+}
 
-  strncat(arg_list, (char*) message, length);
 
 
+/* Open the proxy connection of a virtual socket created by socket()
+ * and replay the socket() call there. The new connection is moved
+ * onto the application's fd with dup2(), which closes the placeholder,
+ * and gets the O_NONBLOCK and FD_CLOEXEC flags the placeholder had.
+ * If there is no proxy, or it refuses the socket, the placeholder
+ * simply stays a plain libc socket. Returns 0 if the socket is now a
+ * proxy socket and -1 otherwise.
+ */
+int lazy_sock_open(int sockfd)
+{
+  LAZY_SOCK* ls = &lazy_sock_dict[sockfd];
+  struct stat st;
+  char arg_list[30] = "";
   char recv_buf[RECV_SIZE];
   int err_val;
+  int chanfd;
+  int fl_flags;
+  int fd_flags;
+  int result = -1;
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "sendto", arg_list, recv_buf, &err_val);
+  pthread_mutex_lock(&lazy_sock_lock);
 
-  if (err_val < 0)
-    return (ssize_t) atoi(recv_buf); 
-  else
+  if (!ls->pending) {
+    pthread_mutex_unlock(&lazy_sock_lock);
+    return socket_endpoint_dict[sockfd] ? 0 : -1;
+  }
+
+  ls->pending = 0;
+
+  /* The fd may have been closed behind our back and reused since. */
+  if (fstat(sockfd, &st) < 0 || !S_ISSOCK(st.st_mode) || st.st_ino != ls->ino) {
+    pthread_mutex_unlock(&lazy_sock_lock);
     return -1;
-}
+  }
 
+  /* SOCK_NONBLOCK and SOCK_CLOEXEC from socket(), or set later with fcntl(). */
+  fl_flags = fcntl(sockfd, F_GETFL);
+  fd_flags = fcntl(sockfd, F_GETFD);
 
+  if ((chanfd = init_master_sock()) >= 0) {
+    sprintf(arg_list, "%d,%d,%d", ls->domain, ls->type, ls->protocol);
 
-ssize_t recv(int sockfd, void *buffer, size_t length, int flags)
-{
-  char arg_list[20] = "";
-  char buf[20] = "";
+    forward_api_to_proxy(chanfd, "socket", arg_list, recv_buf, &err_val);
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+    if (err_val < 0 && chanfd < MAX_SOCK_FD && dup2(chanfd, sockfd) == sockfd) {
+      if (fl_flags >= 0)
+        fcntl(sockfd, F_SETFL, fl_flags);
+      if (fd_flags >= 0)
+        fcntl(sockfd, F_SETFD, fd_flags);
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+      socket_fd_dict[sockfd % MAX_SOCK_FD] = atoi(recv_buf);
+      socket_endpoint_dict[sockfd] = socket_endpoint_dict[chanfd];
+      socket_endpoint_dict[chanfd] = 0;
+      result = 0;
+    }
+    else
+      release_proxy_channel(chanfd);
 
-  memset(buf, 0, strlen(buf));
-  my_itoa((int) length, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+    (*libc_close)(chanfd);
+  }
 
-  memset(buf, 0, strlen(buf));
-  my_itoa(flags, buf, 10);
-  strcat(arg_list, buf);
- 
-  char recv_buf[RECV_SIZE];
-  int err_val;
+  pthread_mutex_unlock(&lazy_sock_lock);
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "recv", arg_list, recv_buf, &err_val);
+  /* The options the placeholder got while the policy had not decided. */
+  if (result == 0) {
+    int i;
 
-  /* Check to make sure there was no error. */
-  if (err_val < 0) {
-    strcpy(buffer, recv_buf);
-    return (ssize_t) strlen(recv_buf);
-  }
-  else {
-    errno = err_val;
-    return (ssize_t) -1;
+    for (i = 0; i < ls->opt_count; i++)
+      libnit_setsockopt(sockfd, ls->opts[i][0], ls->opts[i][1], &ls->opts[i][2], sizeof(int));
   }
 
+  ls->opt_count = 0;
+
+  return result;
 }
 
 
 
-ssize_t recvfrom(int sockfd, void *buffer, size_t length,
-             int flags, struct sockaddr *address, socklen_t *address_len)
+
+// ######################## DESTINATION POLICY #################################
+
+/* Return a new, empty trie node. */
+int policy_node_add()
 {
-  char arg_list[50] = "";
-  char buf[20] = "";
+  POLICY_NODE* new_nodes = realloc(policy_nodes, (policy_node_count + 1) * sizeof(POLICY_NODE));
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+  if (!new_nodes)
+    return -1;
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+  policy_nodes = new_nodes;
+  policy_nodes[policy_node_count].child[0] = -1;
+  policy_nodes[policy_node_count].child[1] = -1;
+  policy_nodes[policy_node_count].rules = -1;
 
-  memset(buf, 0, strlen(buf));
-  my_itoa((int) length, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+  return policy_node_count++;
+}
 
-  memset(buf, 0, strlen(buf));
-  my_itoa(flags, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
-  
 
-  int err_val;
-  char recv_buf[length + 50];
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "recvfrom", arg_list, recv_buf, &err_val);
+/* Add rule under the first prefix_len bits of prefix. */
+int policy_rule_add(POLICY_RULE* rule, uint32_t prefix, int prefix_len)
+{
+  POLICY_RULE* new_rules;
+  int node = 0;
+  int depth;
+  int bit;
+  int* link;
 
+  if (!(new_rules = realloc(policy_rules, (policy_rule_count + 1) * sizeof(POLICY_RULE))))
+    return -1;
+  policy_rules = new_rules;
 
-  /* Check to make sure there was no error. */
-  if (err_val == -1) {
+  for (depth = 0; depth < prefix_len; depth++) {
+    bit = (prefix >> (31 - depth)) & 1;
 
-    char msg_buf[length + 50];
+    if (policy_nodes[node].child[bit] < 0) {
+      int child = policy_node_add();
+      if (child < 0)
+        return -1;
+      policy_nodes[node].child[bit] = child;
+    }
 
-    deserialize_sockaddr(address, recv_buf, msg_buf);
-    strcpy(buffer, msg_buf);
+    node = policy_nodes[node].child[bit];
+  }
 
-    return (ssize_t) strlen(msg_buf);
+  /* Keep the rules of a node in the order of the file. */
+  for (link = &policy_nodes[node].rules; *link >= 0; link = &policy_rules[*link].next)
+    ;
+
+  rule->next = -1;
+  policy_rules[policy_rule_count] = *rule;
+  *link = policy_rule_count++;
+
+  return 0;
+}
+
+
+
+/* Parse one line of the policy file:
+ *
+ *   bypass dst=127.0.0.0/8
+ *   bypass dst=10.1.0.0/16 port=5432 type=stream
+ *   interpose port=8000-8100
+ *   bypass process=prometheus*
+ *   default bypass
+ *
+ * Returns 1 for a rule (in rule, prefix and prefix_len), 0 for a line
+ * without one and -1 for a line that does not parse.
+ */
+int policy_parse_line(char* line, POLICY_RULE* rule, uint32_t* prefix, int* prefix_len)
+{
+  char* saveptr;
+  char* token;
+  char* value;
+  char* slash;
+  struct in_addr dst;
+  int matches_process = 1;
+
+  if ((token = strchr(line, '#')))
+    *token = '\0';
+
+  if (!(token = strtok_r(line, " \t\r\n", &saveptr)))
+    return 0;
+
+  memset(rule, 0, sizeof(POLICY_RULE));
+  rule->port_hi = 65535;
+  *prefix = 0;
+  *prefix_len = 0;
+
+  if (strcmp(token, "default") == 0) {
+    token = strtok_r(NULL, " \t\r\n", &saveptr);
+
+    if (token && strcmp(token, "bypass") == 0)
+      policy_default = POLICY_BYPASS;
+    else if (token && strcmp(token, "interpose") == 0)
+      policy_default = POLICY_INTERPOSE;
+    else
+      return -1;
+
+    return 0;
   }
-  else {
-    errno = err_val;
-    return (ssize_t) -1;
+
+  if (strcmp(token, "bypass") == 0)
+    rule->action = POLICY_BYPASS;
+  else if (strcmp(token, "interpose") == 0)
+    rule->action = POLICY_INTERPOSE;
+  else
+    return -1;
+
+  while ((token = strtok_r(NULL, " \t\r\n", &saveptr))) {
+    if (!(value = strchr(token, '=')))
+      return -1;
+    *value++ = '\0';
+
+    if (strcmp(token, "dst") == 0) {
+      *prefix_len = 32;
+
+      if ((slash = strchr(value, '/'))) {
+        *slash++ = '\0';
+        *prefix_len = atoi(slash);
+      }
+
+      if (inet_pton(AF_INET, value, &dst) != 1 || *prefix_len < 0 || *prefix_len > 32)
+        return -1;
+
+      *prefix = ntohl(dst.s_addr);
+      rule->has_dst = 1;
+    }
+    else if (strcmp(token, "port") == 0) {
+      rule->port_lo = atoi(value);
+      rule->port_hi = strchr(value, '-') ? atoi(strchr(value, '-') + 1) : rule->port_lo;
+    }
+    else if (strcmp(token, "type") == 0) {
+      if (strcmp(value, "stream") == 0)
+        rule->type = SOCK_STREAM;
+      else if (strcmp(value, "dgram") == 0)
+        rule->type = SOCK_DGRAM;
+      else
+        return -1;
+    }
+    else if (strcmp(token, "process") == 0)
+      matches_process = fnmatch(value, program_invocation_short_name, 0) == 0;
+    else
+      return -1;
   }
 
+  /* Rules for other processes are left out altogether. */
+  return matches_process;
 }
 
 
 
-// ################ READ AND WRITE CALLS ###########################
-
-ssize_t write(int sockfd, const void *message, size_t length)
+void policy_load()
 {
-  char arg_list[(int)length + 20];
-  char buf[20] = "";
-
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+  char* path = getenv("LIBNIT_POLICY");
+  char line[512];
+  POLICY_RULE rule;
+  uint32_t prefix;
+  int prefix_len;
+  int line_no = 0;
+  int parsed;
+  FILE* file;
+
+  if (!path || !path[0])
+    return;
+
+  if (!(file = fopen(path, "r"))) {
+    LIBNIT_LOG(LIBNIT_LOG_ERROR, LOG_CAT_PROXY, "unable to read the policy %s: %s", path, strerror(errno));
+    return;
+  }
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+  if (policy_node_add() < 0) {
+    fclose(file);
+    return;
+  }
 
+  while (fgets(line, sizeof(line), file)) {
+    line_no++;
 
-  /* We add the message as the last element in the 
-   * arg list because the message might contain any character,
-   * including the delimeter. */
-  strncat(arg_list, (char*)message, length);
+    if ((parsed = policy_parse_line(line, &rule, &prefix, &prefix_len)) < 0)
+      LIBNIT_LOG(LIBNIT_LOG_WARN, LOG_CAT_PROXY, "%s:%d: not a policy rule, ignored", path, line_no);
+    else if (parsed > 0 && policy_rule_add(&rule, prefix, prefix_len) < 0)
+      break;
+  }
 
+  fclose(file);
 
-  char recv_buf[RECV_SIZE];
-  int err_val;
+  /* A policy without rules still sets the default. */
+  if (!policy_rules && (policy_rules = malloc(sizeof(POLICY_RULE))))
+    policy_rule_count = 0;
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "write", arg_list, recv_buf, &err_val);
- 
-  if (err_val < 0)
-    return (ssize_t) atoi(recv_buf); 
-  else
-    return -1;
-  
+  LIBNIT_LOG(LIBNIT_LOG_INFO, LOG_CAT_PROXY, "policy %s: %d rules, %d trie nodes",
+             path, policy_rule_count, policy_node_count);
 }
 
 
-/*
-ssize_t read(int sockfd, void *buffer, size_t length)
+
+/* Returns POLICY_BYPASS or POLICY_INTERPOSE for a socket of type that
+ * goes to (or is bound to) address. The first rule of the file that
+ * matches wins: we walk down the trie along the address and keep the
+ * earliest matching rule of every node on the way.
+ */
+int policy_lookup(const struct sockaddr* address, int type)
 {
-  printf("In function read. Calling it\n");
-  fflush(stdout);
+  const struct sockaddr_in* address_in = (const struct sockaddr_in*) address;
+  int has_addr = address && address->sa_family == AF_INET;
+  uint32_t addr = has_addr ? ntohl(address_in->sin_addr.s_addr) : 0;
+  int port = has_addr ? ntohs(address_in->sin_port) : 0;
+  int best = -1;
+  int node = 0;
+  int depth = 0;
+  int r;
+
+  type &= ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+  while (node >= 0 && node < policy_node_count) {
+    for (r = policy_nodes[node].rules; r >= 0 && (best < 0 || r < best); r = policy_rules[r].next) {
+      POLICY_RULE* rule = &policy_rules[r];
+
+      if ((rule->has_dst && !has_addr) || (rule->type && rule->type != type))
+        continue;
+      if ((rule->port_lo > 0 || rule->port_hi < 65535) &&
+          (!has_addr || port < rule->port_lo || port > rule->port_hi))
+        continue;
+
+      best = r;
+      break;
+    }
 
-  char arg_list[20] = "";
-  char buf[20] = "";
+    if (!has_addr || depth == 32)
+      break;
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+    node = policy_nodes[node].child[(addr >> (31 - depth)) & 1];
+    depth++;
+  }
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+  return best >= 0 ? policy_rules[best].action : policy_default;
+}
 
-  memset(buf, 0, strlen(buf));
-  my_itoa((int) length, buf, 10);
-  strcat(arg_list, buf);
 
- 
+
+/* Decide where a socket goes, on its first connect, bind or sendto.
+ * A bypassed socket that is still a placeholder simply stays a libc
+ * socket. One that already reached the proxy (e.g. through getsockopt)
+ * gives its repy socket back and gets a fresh libc socket on its fd.
+ */
+void policy_check(int sockfd, const struct sockaddr* address)
+{
+  LAZY_SOCK* ls;
+  char arg_list[20];
   char recv_buf[RECV_SIZE];
   int err_val;
+  int newfd;
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "read", arg_list, recv_buf, &err_val);
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD || !lazy_sock_dict[sockfd].policy_pending)
+    return;
 
-  // Check to make sure there was no error.
-  if (err_val < 0) {
-    strcpy(buffer, recv_buf);
-    return (ssize_t) strlen(recv_buf);
-  }
-  else {
-    errno = err_val;
-    return (ssize_t) -1;
+  ls = &lazy_sock_dict[sockfd];
+  ls->policy_pending = 0;
+
+  if (policy_lookup(address, ls->type) != POLICY_BYPASS)
+    return;
+
+  LIBNIT_LOG(LIBNIT_LOG_DEBUG, LOG_CAT_CALL, "socket %d bypasses the proxy", sockfd);
+
+  pthread_mutex_lock(&lazy_sock_lock);
+
+  if (ls->pending) {
+    ls->pending = 0;
+    pthread_mutex_unlock(&lazy_sock_lock);
+    return;
   }
 
+  pthread_mutex_unlock(&lazy_sock_lock);
+
+  if (!socket_endpoint_dict[sockfd] || relay_sock_dict[sockfd] || fork_attach_dict[sockfd] ||
+      (newfd = (*libc_socket)(ls->domain, ls->type, ls->protocol)) < 0)
+    return;
+
+  sprintf(arg_list, "%d", socket_fd_dict[sockfd]);
+  forward_api_to_proxy(sockfd, "close", arg_list, recv_buf, &err_val);
+
+  recv_lane_release(sockfd);
+  release_proxy_channel(sockfd);
+  dup2(newfd, sockfd);
+  (*libc_close)(newfd);
 }
-*/
 
 
 
-// ################ SOCKET OPTION CALLS ##########################
 
- 
-//int fcntl(int sockfd, int cmd, ...)
-//{
-//  // BUG: If the sockfd is not a network socket (if it is a file socket)
-//  // Then this will segfault and crash.
+// ######################## CIRCUIT BREAKER ####################################
+
+int proxy_breaker_allows()
+{
+  int allows;
+
+  pthread_mutex_lock(&breaker_lock);
+  allows = !breaker_open;
+  pthread_mutex_unlock(&breaker_lock);
+
+  return allows;
+}
+
+
+
+void proxy_breaker_record(int success)
+{
+  pthread_t probe_thread;
+  int start_probe = 0;
+
+  pthread_mutex_lock(&breaker_lock);
+
+  if (success)
+    breaker_failures = 0;
+  else if (++breaker_failures >= breaker_threshold && !breaker_open) {
+    breaker_open = 1;
+    start_probe = 1;
+  }
+
+  pthread_mutex_unlock(&breaker_lock);
+
+  if (start_probe) {
+    LIBNIT_LOG(LIBNIT_LOG_WARN, LOG_CAT_PROXY, "proxy unavailable, new sockets bypass it");
+
+    if (pthread_create(&probe_thread, NULL, proxy_breaker_probe, NULL) == 0)
+      pthread_detach(probe_thread);
+  }
+}
+
+
+
+/* Runs while the breaker is open, until one of the proxies answers. */
+void* proxy_breaker_probe(void* unused)
+{
+  struct timespec probe_interval;
+  int endpoint;
+  int probe_fd;
+
+  probe_interval.tv_sec = breaker_probe_ms / 1000;
+  probe_interval.tv_nsec = (breaker_probe_ms % 1000) * 1000000L;
+
+  while (1) {
+    nanosleep(&probe_interval, NULL);
+
+    for (endpoint = 0; endpoint < proxy_endpoint_count; endpoint++) {
+      if ((probe_fd = connect_proxy_endpoint(endpoint)) < 0)
+        continue;
+
+      release_proxy_channel(probe_fd);
+      (*libc_close)(probe_fd);
+
+      pthread_mutex_lock(&breaker_lock);
+      breaker_failures = 0;
+      breaker_open = 0;
+      pthread_mutex_unlock(&breaker_lock);
+
+      LIBNIT_LOG(LIBNIT_LOG_WARN, LOG_CAT_PROXY, "proxy is back, interposing new sockets");
+      return NULL;
+    }
+  }
+}
+
+
+
+
+// ######################## NATIVE SHIM ENGINE #################################
+
+/* Simple shim stacks do not need the proxy at all. The native shim
+ * engine runs a wire compatible subset of the shims (NoopShim, LogShim
+ * and CompressionShim) directly on the kernel socket. If the shim
+ * string contains anything else, the engine stays disabled and every
+ * socket goes through the proxy as usual.
+ */
+void native_shim_init()
+{
+  char* shim_str = getenv("LIBNIT_NATIVE_SHIM");
+
+  memset(&native_shim, 0, sizeof(native_shim));
+  native_shim.log_fd = -1;
+
+  if (!shim_str || !shim_str[0])
+    return;
+
+  if (native_shim_parse(shim_str, &native_shim) < 0) {
+    LIBNIT_LOG(LIBNIT_LOG_WARN, LOG_CAT_SHIM, "shim string '%s' is not supported "
+               "natively, using the proxy", shim_str);
+    memset(&native_shim, 0, sizeof(native_shim));
+    native_shim.log_fd = -1;
+    return;
+  }
+
+  /* The LogShim log is opened once, and every record goes out in a
+   * single write, so the records of concurrent threads do not mix.
+   */
+  if (native_shim.log_file[0] &&
+      (native_shim.log_fd = open(native_shim.log_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+    LIBNIT_LOG(LIBNIT_LOG_WARN, LOG_CAT_SHIM, "unable to open the shim log %s: %s",
+               native_shim.log_file, strerror(errno));
+
+  native_shim.enabled = 1;
+}
+
+
+
+/* Parse a shim string of the form "(ShimA,arg)(ShimB)" into config.
+ * Returns -1 if any of the shims can not be run natively.
+ */
+int native_shim_parse(char* shim_str, NATIVE_SHIM_CONFIG* config)
+{
+  char shim_name[64];
+  char shim_arg[256];
+  char* cur = shim_str;
+  char* end;
+  char* comma;
+  char* tier;
+  size_t name_len;
+
+  if (strlen(shim_str) >= sizeof(config->shim_string))
+    return -1;
+
+  strcpy(config->shim_string, shim_str);
+  config->block_size = 2048;
+  config->level = Z_DEFAULT_COMPRESSION;
+
+  while (*cur) {
+    if (*cur != '(')
+      return -1;
+
+    end = strchr(cur, ')');
+
+    /* We do not support nested shim arguments natively. */
+    if (!end || memchr(cur + 1, '(', end - cur - 1))
+      return -1;
+
+    comma = memchr(cur + 1, ',', end - cur - 1);
+    name_len = (comma ? comma : end) - cur - 1;
+
+    if (name_len >= sizeof(shim_name))
+      return -1;
+
+    memset(shim_name, 0, sizeof(shim_name));
+    memset(shim_arg, 0, sizeof(shim_arg));
+    strncpy(shim_name, cur + 1, name_len);
+
+    if (comma) {
+      if (end - comma - 1 >= sizeof(shim_arg))
+        return -1;
+      strncpy(shim_arg, comma + 1, end - comma - 1);
+    }
+
+    if (strcmp(shim_name, "NoopShim") == 0) {
+      /* Nothing to do. */
+    }
+    else if (strcmp(shim_name, "LogShim") == 0) {
+      strcpy(config->log_file, shim_arg[0] ? shim_arg : "debug.log");
+    }
+    else if (strcmp(shim_name, "CompressionShim") == 0) {
+      /* Two layers of compression would need two layers of framing. */
+      if (config->compress)
+        return -1;
+
+      config->compress = 1;
+
+      if (shim_arg[0])
+        config->block_size = atoi(shim_arg);
+
+      /* The codec tier after the block size, as in compressionshim.repy. */
+      tier = strchr(shim_arg, ',');
+      if (tier && strcmp(tier + 1, "fast") == 0)
+        config->level = Z_BEST_SPEED;
+      else if (tier && strcmp(tier + 1, "default") != 0)
+        return -1;
+
+      if (config->block_size <= 0)
+        return -1;
+    }
+    else {
+      return -1;
+    }
+
+    cur = end + 1;
+  }
+
+  return 0;
+}
+
+
+
+/* Returns 1 if a new socket with the given domain and type should be
+ * handled by the native shim engine instead of the proxy.
+ */
+int native_shim_wants(int domain, int type)
+{
+  pthread_once(&native_shim_once, native_shim_init);
+
+  if (!native_shim.enabled)
+    return 0;
+
+  return domain == AF_INET && (type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) == SOCK_STREAM;
+}
+
+
+
+/* Only tells whether sockfd is owned by the engine. Calls that use the
+ * entry must take a reference with native_sock_get() instead.
+ */
+NATIVE_SOCK* native_sock_lookup(int sockfd)
+{
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD)
+    return NULL;
+
+  return native_sock_dict[sockfd];
+}
+
+
+
+NATIVE_SOCK* native_sock_get(int sockfd)
+{
+  NATIVE_SOCK* ns;
+
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD || !native_sock_dict[sockfd])
+    return NULL;
+
+  pthread_mutex_lock(&native_sock_lock);
+
+  if ((ns = native_sock_dict[sockfd]))
+    ns->refs++;
+
+  pthread_mutex_unlock(&native_sock_lock);
+
+  return ns;
+}
+
+
+
+void native_sock_put(NATIVE_SOCK* ns)
+{
+  int refs;
+
+  pthread_mutex_lock(&native_sock_lock);
+  refs = --ns->refs;
+  pthread_mutex_unlock(&native_sock_lock);
+
+  if (refs > 0)
+    return;
+
+  pthread_mutex_destroy(&ns->send_lock);
+  pthread_mutex_destroy(&ns->recv_lock);
+  free(ns->recv_buf);
+  free(ns->result_buf);
+  free(ns);
+}
+
+
+
+int native_sock_register(int sockfd)
+{
+  NATIVE_SOCK* ns;
+
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD)
+    return -1;
+
+  ns = (NATIVE_SOCK*) calloc(1, sizeof(NATIVE_SOCK));
+  if (!ns)
+    return -1;
+
+  pthread_mutex_init(&ns->send_lock, NULL);
+  pthread_mutex_init(&ns->recv_lock, NULL);
+
+  /* The reference of native_sock_dict, dropped by native_sock_release(). */
+  ns->refs = 1;
+
+  pthread_mutex_lock(&native_sock_lock);
+  native_sock_dict[sockfd] = ns;
+  pthread_mutex_unlock(&native_sock_lock);
+
+  return 0;
+}
+
+
+
+void native_sock_release(int sockfd)
+{
+  NATIVE_SOCK* ns;
+
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD)
+    return;
+
+  pthread_mutex_lock(&native_sock_lock);
+  ns = native_sock_dict[sockfd];
+  native_sock_dict[sockfd] = NULL;
+  pthread_mutex_unlock(&native_sock_lock);
+
+  if (ns)
+    native_sock_put(ns);
+}
+
+
+
+/* The native equivalent of LogShim._log(). We only record the call,
+ * the socket and the sizes, not the data itself.
+ */
+void native_shim_log(char* call_name, int sockfd, size_t length, ssize_t result)
+{
+  char record[512];
+  struct timeval now;
+  int record_len;
+
+  if (native_shim.log_fd < 0)
+    return;
+
+  gettimeofday(&now, NULL);
+  record_len = snprintf(record, sizeof(record), "t = %ld.%02ld, shim stack = \"%s\"\n%s(%d, %lu)\n > %ld\n\n",
+                        (long) now.tv_sec, (long) now.tv_usec / 10000, native_shim.shim_string,
+                        call_name, sockfd, (unsigned long) length, (long) result);
+  if (record_len > (int) sizeof(record) - 1)
+    record_len = sizeof(record) - 1;
+
+  (*libc_write)(native_shim.log_fd, record, record_len);
+}
+
+
+
+/* Send the whole buffer. A compressed block must never be cut short,
+ * so once the first byte of it is out we wait for the socket to become
+ * writable rather than returning EAGAIN to the application.
+ */
+int native_send_all(int sockfd, const char* buf, size_t length, int flags)
+{
+  size_t total_sent = 0;
+  ssize_t sent;
+  struct pollfd pfd;
+
+  while (total_sent < length) {
+    sent = (*libc_send)(sockfd, buf + total_sent, length - total_sent, flags);
+
+    if (sent >= 0) {
+      total_sent += sent;
+      continue;
+    }
+
+    if (errno == EINTR)
+      continue;
+
+    if ((errno == EAGAIN || errno == EWOULDBLOCK) && total_sent > 0) {
+      pfd.fd = sockfd;
+      pfd.events = POLLOUT;
+      poll(&pfd, 1, -1);
+      continue;
+    }
+
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+/* Equivalent of CompressionShim.socket_send(). The message is broken up
+ * into blocks of block_size bytes, every block is compressed and framed
+ * as "<length>,<compressed data>T".
+ */
+ssize_t native_send(int sockfd, NATIVE_SOCK* ns, const void *message, size_t length, int flags)
+{
+  size_t total_original_bytes_sent = 0;
+  size_t block_len;
+  uLongf body_len;
+  int header_len;
+  char* block_data;
+  ssize_t result;
+
+  if (!native_shim.compress) {
+    result = (*libc_send)(sockfd, message, length, flags);
+    native_shim_log("socket_send", sockfd, length, result);
+    return result;
+  }
+
+  block_data = (char*) malloc(compressBound(native_shim.block_size) + 32);
+  if (!block_data) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  pthread_mutex_lock(&ns->send_lock);
+
+  while (total_original_bytes_sent < length) {
+    block_len = length - total_original_bytes_sent;
+    if (block_len > (size_t) native_shim.block_size)
+      block_len = native_shim.block_size;
+
+    /* Leave room for the header, we move the body in place after. */
+    body_len = compressBound(block_len);
+    if (compress2((Bytef*) block_data + 24, &body_len,
+                  (const Bytef*) message + total_original_bytes_sent,
+                  block_len, native_shim.level) != Z_OK) {
+      errno = ENOBUFS;
+      break;
+    }
+
+    block_data[24 + body_len] = 'T';
+    header_len = sprintf(block_data, "%lu,", (unsigned long) body_len + 1);
+    memmove(block_data + header_len, block_data + 24, body_len + 1);
+
+    if (native_send_all(sockfd, block_data, header_len + body_len + 1, flags) < 0)
+      break;
+
+    total_original_bytes_sent += block_len;
+  }
+
+  pthread_mutex_unlock(&ns->send_lock);
+  free(block_data);
+
+  result = total_original_bytes_sent > 0 || length == 0 ? (ssize_t) total_original_bytes_sent : -1;
+  native_shim_log("socket_send", sockfd, length, result);
+  return result;
+}
+
+
+
+/* Make sure that there is room for extra bytes at the end of buf. */
+int native_buf_reserve(char** buf, size_t* cap, size_t used, size_t extra)
+{
+  size_t new_cap = *cap ? *cap : 4096;
+  char* new_buf;
+
+  if (used + extra <= *cap)
+    return 0;
+
+  while (new_cap < used + extra)
+    new_cap *= 2;
+
+  if (!(new_buf = (char*) realloc(*buf, new_cap)))
+    return -1;
+
+  *buf = new_buf;
+  *cap = new_cap;
+  return 0;
+}
+
+
+
+/* Decompress a single block and append it to the result buffer. */
+int native_inflate_block(NATIVE_SOCK* ns, const char* block, size_t block_len)
+{
+  z_stream stream;
+  int status;
+
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit(&stream) != Z_OK)
+    return -1;
+
+  /* Reclaim the space of the data the application already consumed. */
+  if (ns->result_off > 0) {
+    memmove(ns->result_buf, ns->result_buf + ns->result_off, ns->result_len);
+    ns->result_off = 0;
+  }
+
+  stream.next_in = (Bytef*) block;
+  stream.avail_in = block_len;
+
+  do {
+    if (native_buf_reserve(&ns->result_buf, &ns->result_cap, ns->result_len, native_shim.block_size + 1) < 0) {
+      inflateEnd(&stream);
+      return -1;
+    }
+
+    stream.next_out = (Bytef*) ns->result_buf + ns->result_len;
+    stream.avail_out = ns->result_cap - ns->result_len;
+
+    status = inflate(&stream, Z_NO_FLUSH);
+    ns->result_len = ns->result_cap - stream.avail_out;
+  } while (status == Z_OK);
+
+  inflateEnd(&stream);
+  return status == Z_STREAM_END ? 0 : -1;
+}
+
+
+
+/* Equivalent of CompressionShim._reconstruct_blocks(). Decode every
+ * complete block at the head of recv_buf into result_buf. Blocks (or
+ * headers) tagged with 'F' are discarded. Returns -1 on a corrupt stream.
+ */
+int native_decode_blocks(NATIVE_SOCK* ns)
+{
+  size_t consumed = 0;
+  size_t cur_position;
+  size_t block_length;
+  char* body;
+
+  while (consumed < ns->recv_len) {
+    cur_position = consumed;
+    block_length = 0;
+
+    /* Parse the header. */
+    while (cur_position < ns->recv_len && ns->recv_buf[cur_position] >= '0' &&
+           ns->recv_buf[cur_position] <= '9') {
+      block_length = block_length * 10 + (ns->recv_buf[cur_position] - '0');
+      cur_position++;
+    }
+
+    if (cur_position == ns->recv_len)
+      break;
+
+    if (ns->recv_buf[cur_position] == 'F') {
+      consumed = cur_position + 1;
+      continue;
+    }
+
+    if (ns->recv_buf[cur_position] != ',' || block_length == 0)
+      return -1;
+
+    cur_position++;
+
+    /* Wait for the rest of the block. */
+    if (cur_position + block_length > ns->recv_len)
+      break;
+
+    body = ns->recv_buf + cur_position;
+    consumed = cur_position + block_length;
+
+    if (body[block_length - 1] == 'F')
+      continue;
+    else if (body[block_length - 1] != 'T')
+      return -1;
+
+    if (native_inflate_block(ns, body, block_length - 1) < 0)
+      return -1;
+  }
+
+  if (consumed > 0) {
+    memmove(ns->recv_buf, ns->recv_buf + consumed, ns->recv_len - consumed);
+    ns->recv_len -= consumed;
+  }
+
+  return 0;
+}
+
+
+
+/* Equivalent of CompressionShim.socket_recv(). We read from the kernel
+ * socket until there is at least one complete block to return. The
+ * blocking behaviour follows the socket (and the MSG_DONTWAIT flag).
+ */
+ssize_t native_recv(int sockfd, NATIVE_SOCK* ns, void *buffer, size_t length, int flags)
+{
+  ssize_t result;
+  ssize_t bytes_read;
+
+  if (!native_shim.compress) {
+    result = (*libc_recv)(sockfd, buffer, length, flags);
+    native_shim_log("socket_recv", sockfd, length, result);
+    return result;
+  }
+
+  pthread_mutex_lock(&ns->recv_lock);
+
+  while (ns->result_len == 0) {
+    if (native_decode_blocks(ns) < 0) {
+      errno = EPROTO;
+      result = -1;
+      goto done;
+    }
+
+    if (ns->result_len > 0)
+      break;
+
+    if (ns->peer_closed) {
+      result = 0;
+      goto done;
+    }
+
+    if (native_buf_reserve(&ns->recv_buf, &ns->recv_cap, ns->recv_len, RECV_SIZE) < 0) {
+      errno = ENOBUFS;
+      result = -1;
+      goto done;
+    }
+
+    bytes_read = (*libc_recv)(sockfd, ns->recv_buf + ns->recv_len,
+                              ns->recv_cap - ns->recv_len, flags & ~(MSG_PEEK | MSG_WAITALL));
+
+    if (bytes_read == 0)
+      ns->peer_closed = 1;
+    else if (bytes_read > 0)
+      ns->recv_len += bytes_read;
+    else if (errno != EINTR) {
+      result = -1;
+      goto done;
+    }
+  }
+
+  result = ns->result_len < length ? ns->result_len : length;
+  memcpy(buffer, ns->result_buf + ns->result_off, result);
+
+  if (!(flags & MSG_PEEK)) {
+    ns->result_off += result;
+    ns->result_len -= result;
+    if (ns->result_len == 0)
+      ns->result_off = 0;
+  }
+
+done:
+  pthread_mutex_unlock(&ns->recv_lock);
+  native_shim_log("socket_recv", sockfd, length, result);
+  return result;
+}
+
+
+
+
+// ######################## RELAYED SOCKETS ####################################
+
+/* If the proxy's shim stack does not transform the data, the proxy can
+ * relay a connected socket with splice() instead of handling every
+ * send and recv as a call. Once it agrees, the proxy connection of the
+ * socket carries the raw stream, so no call on it may be forwarded any
+ * more: every call checks relay_sock_lookup() and goes to libc.
+ * Setting LIBNIT_RELAY=0 disables this.
+ */
+void request_relay(int sockfd)
+{
+  char arg_list[20] = "";
+  char recv_buf[RECV_SIZE];
+  char* relay_env = getenv("LIBNIT_RELAY");
+  int err_val;
+
+  if ((relay_env && strcmp(relay_env, "0") == 0) || sockfd < 0 || sockfd >= MAX_SOCK_FD)
+    return;
+
+  my_itoa(socket_fd_dict[sockfd % MAX_SOCK_FD], arg_list, 10);
+
+  forward_api_to_proxy(sockfd, "relay", arg_list, recv_buf, &err_val);
+
+  if (err_val < 0 && atoi(recv_buf) == 1)
+    relay_sock_dict[sockfd] = 1;
+}
+
+
+
+int relay_sock_lookup(int sockfd)
+{
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD)
+    return 0;
+
+  return relay_sock_dict[sockfd];
+}
+
+
+
+
+// ######################## DUPLEX LANES #######################################
+
+/* Returns the proxy connection that receive calls on sockfd should use.
+ * The read lane is opened on the same proxy as sockfd and attached to
+ * its repy fd with a "lane" call. If that is not possible the calls
+ * simply share sockfd with everything else.
+ */
+int recv_lane_get(int sockfd)
+{
+  char arg_list[20] = "";
+  char recv_buf[RECV_SIZE];
+  int err_val;
+  int lanefd;
+
+  if (!duplex_lanes || sockfd < 0 || sockfd >= MAX_SOCK_FD)
+    return sockfd;
+
+  if (recv_lane_dict[sockfd])
+    return recv_lane_dict[sockfd] - 1;
+
+  pthread_mutex_lock(&recv_lane_lock);
+
+  if (!recv_lane_dict[sockfd]) {
+    lanefd = init_master_sock_on(socket_endpoint_dict[sockfd] - 1);
+
+    if (lanefd >= 0 && lanefd < MAX_SOCK_FD) {
+      my_itoa(socket_fd_dict[sockfd % MAX_SOCK_FD], arg_list, 10);
+      forward_api_to_proxy(lanefd, "lane", arg_list, recv_buf, &err_val);
+
+      if (err_val < 0)
+        recv_lane_dict[sockfd] = lanefd + 1;
+    }
+
+    /* Fall back to the write lane from now on. */
+    if (!recv_lane_dict[sockfd]) {
+      if (lanefd >= 0) {
+        release_proxy_channel(lanefd);
+        (*libc_close)(lanefd);
+      }
+      recv_lane_dict[sockfd] = sockfd + 1;
+    }
+  }
+
+  pthread_mutex_unlock(&recv_lane_lock);
+
+  return recv_lane_dict[sockfd] - 1;
+}
+
+
+
+/* Close the read lane of sockfd, if it has one of its own. */
+void recv_lane_release(int sockfd)
+{
+  int lanefd;
+
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD || !recv_lane_dict[sockfd])
+    return;
+
+  lanefd = recv_lane_dict[sockfd] - 1;
+  recv_lane_dict[sockfd] = 0;
+
+  /* Wake up any thread that is still blocked on the lane. */
+  if (lanefd != sockfd) {
+    (*libc_shutdown)(lanefd, SHUT_RDWR);
+    release_proxy_channel(lanefd);
+    (*libc_close)(lanefd);
+  }
+}
+
+
+
+
+// ######################## FORK SUPPORT #######################################
+
+/* Hold on to our locks across fork(), so the child does not inherit
+ * one that another thread of the parent was holding.
+ */
+void libnit_atfork_prepare()
+{
+  int i;
+
+  pthread_mutex_lock(&lazy_sock_lock);
+  pthread_mutex_lock(&recv_lane_lock);
+  pthread_mutex_lock(&fork_attach_lock);
+  pthread_mutex_lock(&dns_resolver_lock);
+  pthread_mutex_lock(&proxy_endpoints_lock);
+  pthread_mutex_lock(&breaker_lock);
+  pthread_rwlock_wrlock(&dns_cache_lock);
+  pthread_mutex_lock(&log_drain_lock);
+  pthread_mutex_lock(&sock_tuning_lock);
+  for (i = 0; i < MAX_PROXY_ENDPOINTS; i++)
+    pthread_mutex_lock(&batch_lock[i]);
+  pthread_mutex_lock(&native_sock_lock);
+}
+
+
+
+void libnit_atfork_parent()
+{
+  int i;
+
+  pthread_mutex_unlock(&native_sock_lock);
+  for (i = 0; i < MAX_PROXY_ENDPOINTS; i++)
+    pthread_mutex_unlock(&batch_lock[i]);
+  pthread_mutex_unlock(&sock_tuning_lock);
+  pthread_mutex_unlock(&log_drain_lock);
+  pthread_rwlock_unlock(&dns_cache_lock);
+  pthread_mutex_unlock(&breaker_lock);
+  pthread_mutex_unlock(&proxy_endpoints_lock);
+  pthread_mutex_unlock(&dns_resolver_lock);
+  pthread_mutex_unlock(&fork_attach_lock);
+  pthread_mutex_unlock(&recv_lane_lock);
+  pthread_mutex_unlock(&lazy_sock_lock);
+}
+
+
+
+/* The child must not talk over the connections of its parent. The read
+ * lanes are simply dropped (without a shutdown, which would cut off the
+ * parent as well) and every other virtual socket is re-attached on its
+ * first use. Relayed sockets carry a raw stream and stay shared, like
+ * any inherited socket.
+ */
+void libnit_atfork_child()
+{
+  int sockfd;
+  int lanefd;
+
+  libnit_atfork_parent();
+
+  /* Threads that were talking to the proxy did not make it over. */
+  for (sockfd = 0; sockfd < MAX_SOCK_FD; sockfd++) {
+    pthread_mutex_init(&channel_lock[sockfd], NULL);
+
+    if (sock_tuning_dict[sockfd]) {
+      pthread_mutex_init(&sock_tuning_dict[sockfd]->send_lock, NULL);
+      pthread_mutex_init(&sock_tuning_dict[sockfd]->recv_lock, NULL);
+    }
+
+    if (native_sock_dict[sockfd]) {
+      pthread_mutex_init(&native_sock_dict[sockfd]->send_lock, NULL);
+      pthread_mutex_init(&native_sock_dict[sockfd]->recv_lock, NULL);
+      native_sock_dict[sockfd]->refs = 1;
+    }
+  }
+
+  for (sockfd = 0; sockfd < MAX_SOCK_FD; sockfd++) {
+    if (!recv_lane_dict[sockfd])
+      continue;
+
+    lanefd = recv_lane_dict[sockfd] - 1;
+    recv_lane_dict[sockfd] = 0;
+
+    if (lanefd != sockfd) {
+      release_proxy_channel(lanefd);
+      (*libc_close)(lanefd);
+    }
+  }
+
+  /* The resolver connection is opened again when it is needed. */
+  if (dns_resolver_sock >= 0) {
+    release_proxy_channel(dns_resolver_sock);
+    (*libc_close)(dns_resolver_sock);
+    dns_resolver_sock = -1;
+  }
+
+  /* So are the batch connections. */
+  for (sockfd = 0; sockfd < MAX_PROXY_ENDPOINTS; sockfd++) {
+    if (!batch_channel_dict[sockfd])
+      continue;
+
+    release_proxy_channel(batch_channel_dict[sockfd] - 1);
+    (*libc_close)(batch_channel_dict[sockfd] - 1);
+    batch_channel_dict[sockfd] = 0;
+  }
+
+  for (sockfd = 0; sockfd < MAX_SOCK_FD; sockfd++) {
+    if (socket_endpoint_dict[sockfd] && !relay_sock_dict[sockfd])
+      fork_attach_dict[sockfd] = 1;
+  }
+
+  /* The child records its calls into a trace of its own. */
+  if (trace_ring) {
+    munmap(trace_ring, trace_ring_size);
+    trace_ring = NULL;
+    trace_records = NULL;
+    trace_open();
+  }
+
+  /* The probe thread of the parent is gone, let the child find out
+   * about the proxy by itself.
+   */
+  breaker_open = 0;
+  breaker_failures = 0;
+
+  /* The parent writes out what is queued, the child starts with an
+   * empty queue and a writer of its own.
+   */
+  memset(log_queue, 0, sizeof(log_queue));
+  log_tail = 0;
+  log_head = 0;
+  log_writer_running = 0;
+}
+
+
+
+/* Give an inherited virtual socket its own proxy connection with an
+ * "attach" call, which also tells the proxy that one more process
+ * refers to the socket. If that fails we keep sharing the parent's
+ * connection. Returns 0 if the socket has its own connection.
+ */
+int fork_sock_attach(int sockfd)
+{
+  char arg_list[20] = "";
+  char recv_buf[RECV_SIZE];
+  int err_val;
+  int chanfd;
+  int result = -1;
+
+  pthread_mutex_lock(&fork_attach_lock);
+
+  if (!fork_attach_dict[sockfd]) {
+    pthread_mutex_unlock(&fork_attach_lock);
+    return 0;
+  }
+
+  fork_attach_dict[sockfd] = 0;
+
+  if ((chanfd = init_master_sock_on(socket_endpoint_dict[sockfd] - 1)) >= 0) {
+    my_itoa(socket_fd_dict[sockfd % MAX_SOCK_FD], arg_list, 10);
+
+    forward_api_to_proxy(chanfd, "attach", arg_list, recv_buf, &err_val);
+
+    if (err_val < 0 && chanfd < MAX_SOCK_FD && dup2(chanfd, sockfd) == sockfd) {
+      release_proxy_channel(sockfd);
+      socket_endpoint_dict[sockfd] = socket_endpoint_dict[chanfd];
+      socket_endpoint_dict[chanfd] = 0;
+      result = 0;
+    }
+    else
+      release_proxy_channel(chanfd);
+
+    (*libc_close)(chanfd);
+  }
+
+  pthread_mutex_unlock(&fork_attach_lock);
+
+  return result;
+}
+
+
+
+
+// ######################## SOCKET CONNECTION CALLS ############################
+
+
+int libnit_socket(int domain, int type, int protocol)
+{
+  /* Sockets the native shim engine can handle never reach the proxy. */
+  if (native_shim_wants(domain, type)) {
+    init_libc_calls();
+
+    int native_fd = (*libc_socket)(domain, type, protocol);
+
+    if (native_fd < 0 || native_sock_register(native_fd) == 0)
+      return native_fd;
+
+    /* We could not keep track of it, so fall back to the proxy. */
+    (*libc_close)(native_fd);
+  }
+
+  /* The application gets a plain socket for now. The proxy connection
+   * is only opened once the socket is used (see lazy_sock_open()), so
+   * sockets that are created and closed again never reach the proxy.
+   * Without a proxy the plain socket is all there is.
+   */
+  init_libc_calls();
+
+  int sockfd = (*libc_socket)(domain, type, protocol);
+  struct stat st;
+
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD || !proxy_breaker_allows())
+    return sockfd;
+
+  if (fstat(sockfd, &st) == 0) {
+    lazy_sock_dict[sockfd].domain = domain;
+    lazy_sock_dict[sockfd].type = type;
+    lazy_sock_dict[sockfd].protocol = protocol;
+    lazy_sock_dict[sockfd].ino = st.st_ino;
+    lazy_sock_dict[sockfd].policy_pending = policy_rules != NULL;
+    lazy_sock_dict[sockfd].opt_count = 0;
+    lazy_sock_dict[sockfd].pending = 1;
+  }
+
+  return sockfd;
+
+} 
+
+    
+int libnit_bind(int sockfd, const struct sockaddr *address, socklen_t address_len)
+{
+  if (native_sock_lookup(sockfd) || relay_sock_lookup(sockfd))
+    return (*libc_bind)(sockfd, address, address_len);
+
+  policy_check(sockfd, address);
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_bind)(sockfd, address, address_len);
+  }
+
+  char arg_list[50] = "";
+  char buf[50] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  serialize_sockaddr(address, buf);
+  strcat(arg_list, buf);
+  
+  char recv_buf[RECV_SIZE];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "bind", arg_list, recv_buf, &err_val);
+
+  if (err_val < 0)
+    return atoi(recv_buf); 
+  else
+    return -1;
+
+}
+
+
+int libnit_accept(int sockfd, struct sockaddr *address, socklen_t *address_len)
+{
+  if (native_sock_lookup(sockfd)) {
+    int native_fd = (*libc_accept)(sockfd, address, address_len);
+
+    if (native_fd >= 0 && native_sock_register(native_fd) < 0) {
+      (*libc_close)(native_fd);
+      errno = ENOBUFS;
+      return -1;
+    }
+    return native_fd;
+  }
+
+  if (relay_sock_lookup(sockfd))
+    return (*libc_accept)(sockfd, address, address_len);
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_accept)(sockfd, address, address_len);
+  }
+
+  char arg_list[50] = "";
+  char buf[20] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+    
+  char recv_buf[RECV_SIZE];
+  char sockfd_buf[10];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "accept", arg_list, recv_buf, &err_val);
+
+  if (err_val < 0) {
+    /* If we were successful, then we create a new connection to the
+     * repy proxy in order to handle this new socket connection. We
+     * then register the new proxy socket fd with the new repy socket fd
+     * that was returned.
+     */
+    deserialize_sockaddr(address, recv_buf, sockfd_buf);
+
+    int endpoint = (sockfd >= 0 && sockfd < MAX_SOCK_FD) ? socket_endpoint_dict[sockfd] - 1 : -1;
+    int new_sock_fd = init_master_sock_on(endpoint);
+    int new_repy_sock_fd = atoi(sockfd_buf);
+
+    if (new_sock_fd < 0) {
+      errno = ECONNABORTED;
+      return -1;
+    }
+
+    socket_fd_dict[new_sock_fd % MAX_SOCK_FD] = new_repy_sock_fd;
+
+    request_relay(new_sock_fd);
+
+    return new_sock_fd; 
+  }
+  else
+    return -1;
+
+}  
+
+
+
+int libnit_connect(int sockfd, const struct sockaddr *address, socklen_t address_len)
+{
+  if (native_sock_lookup(sockfd) || relay_sock_lookup(sockfd))
+    return (*libc_connect)(sockfd, address, address_len);
+
+  policy_check(sockfd, address);
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_connect)(sockfd, address, address_len);
+  }
+
+  char arg_list[50] = "";
+  char buf[20] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  serialize_sockaddr(address, buf);
+  strcat(arg_list, buf);
+
+  char recv_buf[RECV_SIZE];
+  int err_val;
+  
+  LIBNIT_LOG(LIBNIT_LOG_DEBUG, LOG_CAT_CALL, "connect(%d): %s", sockfd, arg_list);
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "connect", arg_list, recv_buf, &err_val);
+  
+  if (err_val < 0){
+    int connect_result = atoi(recv_buf);
+
+    if (connect_result == 0)
+      request_relay(sockfd);
+
+    return connect_result;
+  }
+  else
+    return -1;
+}
+
+
+
+
+int libnit_listen(int sockfd, int backlog)
+{
+  if (native_sock_lookup(sockfd) || relay_sock_lookup(sockfd))
+    return (*libc_listen)(sockfd, backlog);
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_listen)(sockfd, backlog);
+  }
+
+  char arg_list[20] = "";
+  char buf[20] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa(backlog, buf, 10);
+  strcat(arg_list, buf);
+
+  char recv_buf[RECV_SIZE];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "listen", arg_list, recv_buf, &err_val);
+
+  if (err_val < 0)
+    return atoi(recv_buf); 
+  else
+    return -1;
+
+}
+
+
+
+// ################ SEND AND RECEIVE CALLS ################################
+
+
+ssize_t libnit_send(int sockfd, const void *message, size_t length, int flags)
+{
+  NATIVE_SOCK* ns = native_sock_get(sockfd);
+  if (ns) {
+    ssize_t result = native_send(sockfd, ns, message, length, flags);
+    native_sock_put(ns);
+    return result;
+  }
+
+  if (relay_sock_lookup(sockfd))
+    return (*libc_send)(sockfd, message, length, flags);
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_send)(sockfd, message, length, flags);
+  }
+
+  char arg_list[(int)length + 20];
+  char buf[20] = "";
+  char recv_buf[RECV_SIZE];
+  int err_val;
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  LIBNIT_LOG(LIBNIT_LOG_DEBUG, LOG_CAT_CALL, "send(%d): %lu bytes, flags %d",
+             sockfd, (unsigned long) length, flags);
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  my_itoa(flags, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  /* We add the message as the last element in the 
+   * arg list because the message might contain any character,
+   * including the delimeter. */
+  strncat(arg_list, (char*)message, length);
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "send", arg_list, recv_buf, &err_val);
+
+  if (err_val < 0)
+    return (ssize_t) atoi(recv_buf); 
+  else
+    return -1;
+}
+
+
+
+
+ssize_t libnit_sendto(int sockfd, const void *message, size_t length, int flags,
+             const struct sockaddr *dest_addr, socklen_t dest_len)
+{
+  /* Native sockets are always connected streams, so the address is ignored. */
+  NATIVE_SOCK* ns = native_sock_get(sockfd);
+  if (ns) {
+    ssize_t result = native_send(sockfd, ns, message, length, flags);
+    native_sock_put(ns);
+    return result;
+  }
+
+  if (relay_sock_lookup(sockfd))
+    return (*libc_send)(sockfd, message, length, flags);
+
+  if (dest_addr)
+    policy_check(sockfd, dest_addr);
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_sendto)(sockfd, message, length, flags, dest_addr, dest_len);
+  }
+
+  char arg_list[(int)length + 50];
+  char buf[20] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa(flags, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+  
+  serialize_sockaddr(dest_addr, arg_list);
+  strcat(arg_list, ",");
+
+  strncat(arg_list, (char*) message, length);
+
+
+  char recv_buf[RECV_SIZE];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "sendto", arg_list, recv_buf, &err_val);
+
+  if (err_val < 0)
+    return (ssize_t) atoi(recv_buf); 
+  else
+    return -1;
+}
+
+
+
+ssize_t libnit_recv(int sockfd, void *buffer, size_t length, int flags)
+{
+  NATIVE_SOCK* ns = native_sock_get(sockfd);
+  if (ns) {
+    ssize_t result = native_recv(sockfd, ns, buffer, length, flags);
+    native_sock_put(ns);
+    return result;
+  }
+
+  if (relay_sock_lookup(sockfd))
+    return (*libc_recv)(sockfd, buffer, length, flags);
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_recv)(sockfd, buffer, length, flags);
+  }
+
+  char arg_list[20] = "";
+  char buf[20] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa((int) length, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa(flags, buf, 10);
+  strcat(arg_list, buf);
+ 
+  char recv_buf[RECV_SIZE];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(recv_lane_get(sockfd), "recv", arg_list, recv_buf, &err_val);
+
+  /* Check to make sure there was no error. */
+  if (err_val < 0) {
+    strcpy(buffer, recv_buf);
+    return (ssize_t) strlen(recv_buf);
+  }
+  else {
+    errno = err_val;
+    return (ssize_t) -1;
+  }
+
+}
+
+
+
+ssize_t libnit_recvfrom(int sockfd, void *buffer, size_t length,
+             int flags, struct sockaddr *address, socklen_t *address_len)
+{
+  NATIVE_SOCK* ns = native_sock_get(sockfd);
+  if (ns) {
+    ssize_t result = native_recv(sockfd, ns, buffer, length, flags);
+    native_sock_put(ns);
+    return result;
+  }
+
+  if (relay_sock_lookup(sockfd) || !proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_recvfrom)(sockfd, buffer, length, flags, address, address_len);
+  }
+
+  char arg_list[50] = "";
+  char buf[20] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa((int) length, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa(flags, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+  
+
+  int err_val;
+  char recv_buf[length + 50];
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(recv_lane_get(sockfd), "recvfrom", arg_list, recv_buf, &err_val);
+
+
+  /* Check to make sure there was no error. */
+  if (err_val == -1) {
+
+    char msg_buf[length + 50];
+
+    deserialize_sockaddr(address, recv_buf, msg_buf);
+    strcpy(buffer, msg_buf);
+
+    return (ssize_t) strlen(msg_buf);
+  }
+  else {
+    errno = err_val;
+    return (ssize_t) -1;
+  }
+
+}
+
+
+
+// ################ READ AND WRITE CALLS ###########################
+
+ssize_t libnit_write(int sockfd, const void *message, size_t length)
+{
+  NATIVE_SOCK* ns = native_sock_get(sockfd);
+  if (ns) {
+    ssize_t result = native_send(sockfd, ns, message, length, 0);
+    native_sock_put(ns);
+    return result;
+  }
+
+  if (relay_sock_lookup(sockfd))
+    return (*libc_write)(sockfd, message, length);
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_write)(sockfd, message, length);
+  }
+
+  char arg_list[(int)length + 20];
+  char buf[20] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+
+  /* We add the message as the last element in the 
+   * arg list because the message might contain any character,
+   * including the delimeter. */
+  strncat(arg_list, (char*)message, length);
+
+
+  char recv_buf[RECV_SIZE];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "write", arg_list, recv_buf, &err_val);
+ 
+  if (err_val < 0)
+    return (ssize_t) atoi(recv_buf); 
+  else
+    return -1;
+  
+}
+
+
+/* read() on a socket of ours is recv() without flags, so it takes the
+ * same path whatever the socket is. Every other descriptor goes
+ * straight to libc.
+ */
+ssize_t libnit_read(int sockfd, void *buffer, size_t length)
+{
+  if (trace_fd_is_socket(sockfd))
+    return libnit_recv(sockfd, buffer, length, 0);
+
+  init_libc_calls();
+  return (*libc_read)(sockfd, buffer, length);
+}
+
+
+/*
+ssize_t read(int sockfd, void *buffer, size_t length)
+{
+  printf("In function read. Calling it\n");
+  fflush(stdout);
+
+  char arg_list[20] = "";
+  char buf[20] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa((int) length, buf, 10);
+  strcat(arg_list, buf);
+
+ 
+  char recv_buf[RECV_SIZE];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "read", arg_list, recv_buf, &err_val);
+
+  // Check to make sure there was no error.
+  if (err_val < 0) {
+    strcpy(buffer, recv_buf);
+    return (ssize_t) strlen(recv_buf);
+  }
+  else {
+    errno = err_val;
+    return (ssize_t) -1;
+  }
+
+}
+*/
+
+
+
+// ################ SOCKET OPTION CALLS ##########################
+
+ 
+//int fcntl(int sockfd, int cmd, ...)
+//{
+//  // BUG: If the sockfd is not a network socket (if it is a file socket)
+//  // Then this will segfault and crash.
 //
 //  if (DEBUG) {
 //    printf("Got into fcntl\n");
@@ -777,293 +3054,2264 @@ ssize_t read(int sockfd, void *buffer, size_t length)
 
 
 
-int getsockopt(int sockfd, int level, int option_name,
-	       void *option_value, socklen_t *option_len)
+int libnit_getsockopt(int sockfd, int level, int option_name,
+	       void *option_value, socklen_t *option_len)
+{
+  if (native_sock_lookup(sockfd) || relay_sock_lookup(sockfd))
+    return (*libc_getsockopt)(sockfd, level, option_name, option_value, option_len);
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_getsockopt)(sockfd, level, option_name, option_value, option_len);
+  }
+
+  char arg_list[20] = "";
+  char buf[10] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa(level, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa(option_name, buf, 10);
+  strcat(arg_list, buf);
+
+  char recv_buf[RECV_SIZE];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "getsockopt", arg_list, recv_buf, &err_val);
+
+  if (err_val < 0)
+    return atoi(recv_buf); 
+  else
+    return -1;
+
+}
+
+
+
+
+
+int libnit_setsockopt(int sockfd, int level, int option_name, const void *option_value, socklen_t option_len)
+{
+  if (native_sock_lookup(sockfd) || relay_sock_lookup(sockfd))
+    return (*libc_setsockopt)(sockfd, level, option_name, option_value, option_len);
+
+  /* Until the policy has decided, options go to the placeholder and
+   * are replayed on the proxy if the socket ends up there.
+   */
+  if (sockfd >= 0 && sockfd < MAX_SOCK_FD && lazy_sock_dict[sockfd].pending &&
+      lazy_sock_dict[sockfd].policy_pending && option_len == sizeof(int) &&
+      lazy_sock_dict[sockfd].opt_count < LAZY_SOCK_OPTS) {
+    LAZY_SOCK* ls = &lazy_sock_dict[sockfd];
+    int result = (*libc_setsockopt)(sockfd, level, option_name, option_value, option_len);
+
+    if (result == 0) {
+      ls->opts[ls->opt_count][0] = level;
+      ls->opts[ls->opt_count][1] = option_name;
+      ls->opts[ls->opt_count][2] = *(const int*) option_value;
+      ls->opt_count++;
+    }
+
+    return result;
+  }
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_setsockopt)(sockfd, level, option_name, option_value, option_len);
+  }
+
+  char arg_list[30] = "";
+  char buf[10] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa(level, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+  
+  memset(buf, 0, strlen(buf));
+  my_itoa(option_name, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  strcat(arg_list, (char*) option_value);
+  strcat(arg_list, ",");
+
+  char recv_buf[RECV_SIZE];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "setsockopt", arg_list, recv_buf, &err_val);
+
+  if (err_val < 0)
+    return atoi(recv_buf); 
+  else
+    return -1;
+
+}
+
+
+
+// ##################### MISCELLANEOUS CALLS ##############################
+
+//int getpeername(int sockfd, struct sockaddr *address,
+//		socklen_t *address_len)
+//{
+//
+//  char arg_list[8] = "";
+//  char buf[8] = "";
+//
+//  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+//
+//  memset(arg_list, 0, strlen(arg_list));
+//  memset(buf, 0, strlen(buf));
+//  my_itoa(repy_sock_fd, buf, 10);
+//  strcat(arg_list, buf);
+//
+//  char recv_buf[RECV_SIZE];
+//  char return_val[10];
+//  int err_val;
+//
+//  // Send the info to the Repy proxy server
+//  forward_api_to_proxy(sockfd, "getpeername", arg_list, recv_buf, &err_val);
+//
+//  if (err_val < 0) {
+//    deserialize_sockaddr(address, recv_buf, return_val);
+//    return atoi(return_val);
+//  }
+//  else
+//    return -1; 
+//
+//}
+//
+//
+//
+//int getsockname(int sockfd, struct sockaddr *address,
+//		socklen_t *address_len)
+//{
+//  char arg_list[8] = "";
+//  char buf[8] = "";
+//
+//  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+//
+//  memset(arg_list, 0, strlen(arg_list));
+//  memset(buf, 0, strlen(buf));
+//  my_itoa(repy_sock_fd, buf, 10);
+//  strcat(arg_list, buf);
+//
+//  char recv_buf[RECV_SIZE];
+//  char return_val[10];
+//  int err_val;
+//
+//  // Send the info to the Repy proxy server
+//  forward_api_to_proxy(sockfd, "getsockname", arg_list, recv_buf, &err_val);
+//
+//  if (err_val < 0){
+//    deserialize_sockaddr(address, recv_buf, return_val);
+//    return atoi(return_val);
+//  } 
+//  else
+//    return -1;
+//}
+
+
+
+
+/*
+int select(int nfds, fd_set *readfds, fd_set *writefds, 
+	   fd_set *errorfds, struct timeval *timeout)
+{
+  char arg_list[1024] = "";
+  char buf[8] = "";
+
+  // Temporary solution, return everything as being ready.
+  int i;
+  int fd_ready = 0;
+  return nfds;
+
+  for (i=1; i <= nfds; i++)
+  {
+    if (FD_ISSET(i, readfds)){
+      fd_ready += 1;
+    }
+  }
+
+  return fd_ready;
+  
+  
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+
+  my_itoa(nfds, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  // Serialize the readable file descriptors.
+  serialize_fdset(nfds, writefds, arg_list);
+  strcat(arg_list, ",");
+
+  // Serialize the writable file descriptors.
+  serialize_fdset(nfds, readfds, arg_list);
+  strcat(arg_list, ",");
+
+  // Serialize the error file descriptors.
+  serialize_fdset(nfds, errorfds, arg_list);
+  strcat(arg_list, ",");
+
+
+  char recv_buf[RECV_SIZE];
+  char return_val[10];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "select", arg_list, recv_buf, &err_val);
+
+  // If there was no error, then we deserialize everything and return
+  // the appropriate value.
+  if (err_val < 0){
+    deserialize_select(readfds, writefds, errorfds, recv_buf, return_val);
+    return atoi(return_val);
+  } 
+  else
+    return -1;
+ 
+}
+*/
+
+/*
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  char arg_list[1024] = "";
+  char buf[8] = "";
+    
+  for (i=0; i <= nfds; i++)
+  {
+    if (FD_ISSET(i, fds))
+      fd_ready += 1;
+  }
+    
+  //return fd_ready;
+}
+*/
+// ##################### CLOSE CALLS ##############################3
+
+int libnit_shutdown(int sockfd, int how)
+{
+  if (native_sock_lookup(sockfd) || relay_sock_lookup(sockfd))
+    return (*libc_shutdown)(sockfd, how);
+
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_shutdown)(sockfd, how);
+  }
+
+  char arg_list[10] = "";
+  char buf[10] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+  strcat(arg_list, ",");
+
+  memset(buf, 0, strlen(buf));
+  my_itoa(how, buf, 10);
+  strcat(arg_list, buf);
+
+  char recv_buf[RECV_SIZE];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  forward_api_to_proxy(sockfd, "shutdown", arg_list, recv_buf, &err_val);
+
+  if (err_val < 0)
+    return atoi(recv_buf); 
+  else
+    return -1;	
+}
+
+
+
+
+int libnit_close(int sockfd)
+{
+  if (sockfd >= 0 && sockfd < MAX_SOCK_FD)
+    lazy_sock_dict[sockfd].policy_pending = 0;
+
+  if (native_sock_lookup(sockfd)) {
+    native_sock_release(sockfd);
+    return (*libc_close)(sockfd);
+  }
+
+  /* The proxy closes the outbound socket once it sees the end of the relay. */
+  if (relay_sock_lookup(sockfd)) {
+    relay_sock_dict[sockfd] = 0;
+    recv_lane_release(sockfd);
+    release_proxy_channel(sockfd);
+    return (*libc_close)(sockfd);
+  }
+
+  /* An inherited socket the child never used is still open in the
+   * parent, so we only drop our share of the parent's connection.
+   */
+  if (sockfd >= 0 && sockfd < MAX_SOCK_FD && fork_attach_dict[sockfd]) {
+    fork_attach_dict[sockfd] = 0;
+    release_proxy_channel(sockfd);
+    return (*libc_close)(sockfd);
+  }
+
+  /* A virtual socket that was never used has no proxy connection. */
+  if (sockfd >= 0 && sockfd < MAX_SOCK_FD && lazy_sock_dict[sockfd].pending) {
+    lazy_sock_dict[sockfd].pending = 0;
+    return (*libc_close)(sockfd);
+  }
+
+  /* Files, pipes and sockets created while the proxy was unreachable. */
+  if (!proxy_sock_lookup(sockfd)) {
+    init_libc_calls();
+    return (*libc_close)(sockfd);
+  }
+
+  char arg_list[10] = "";
+  char buf[10] = "";
+
+  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+
+  /* The proxy does not close the repy socket when a read lane goes away. */
+  recv_lane_release(sockfd);
+
+  memset(arg_list, 0, strlen(arg_list));
+  memset(buf, 0, strlen(buf));
+  my_itoa(repy_sock_fd, buf, 10);
+  strcat(arg_list, buf);
+
+  char recv_buf[RECV_SIZE];
+  int err_val;
+
+  // Send the info to the Repy proxy server
+  LIBNIT_LOG(LIBNIT_LOG_DEBUG, LOG_CAT_CALL, "close(%d)", sockfd);
+  forward_api_to_proxy(sockfd, "close", arg_list, recv_buf, &err_val);
+
+  if (err_val == ERRBADFD)
+    return (*libc_close)(sockfd);
+  else if (err_val < 0) {
+    /* The repy socket is gone, so is its connection to the proxy. */
+    release_proxy_channel(sockfd);
+    (*libc_close)(sockfd);
+    return atoi(recv_buf);
+  }
+  else
+    return -1;	
+}
+
+
+
+// ##################### LOGGING ##############################
+
+/* Read the log settings and open the log file. LIBNIT_LOG_LEVEL is
+ * one of error, warn, info and debug (or 0 to 3).
+ */
+void log_open()
+{
+  char* level_str = getenv("LIBNIT_LOG_LEVEL");
+  char* sample_str = getenv("LIBNIT_LOG_SAMPLE");
+  char* log_path = getenv("LIBNIT_LOG_FILE");
+  char sample_buf[256];
+  char* saveptr;
+  char* token;
+  char* value;
+  int fd;
+  int i;
+
+  if (level_str && level_str[0]) {
+    if (level_str[0] >= '0' && level_str[0] <= '9')
+      log_level = atoi(level_str);
+
+    for (i = 0; i <= LIBNIT_LOG_DEBUG; i++) {
+      if (strcasecmp(level_str, log_level_names[i]) == 0)
+        log_level = i;
+    }
+  }
+
+  for (i = 0; i < LOG_CATEGORIES; i++)
+    log_sample[i] = 1;
+
+  if (sample_str && strlen(sample_str) < sizeof(sample_buf)) {
+    strcpy(sample_buf, sample_str);
+
+    for (token = strtok_r(sample_buf, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+      if (!(value = strchr(token, '=')))
+        continue;
+      *value++ = '\0';
+
+      for (i = 0; i < LOG_CATEGORIES; i++) {
+        if (strcmp(token, log_category_names[i]) == 0 && atoi(value) > 0)
+          log_sample[i] = atoi(value);
+      }
+    }
+  }
+
+  if (log_path && log_path[0]) {
+    if ((fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) >= 0)
+      log_fd = fd;
+    else
+      fprintf(stderr, "libnetworkinterpose: unable to open the log file %s, using stderr.\n", log_path);
+  }
+
+  log_ready = 1;
+  atexit(log_flush);
+}
+
+
+
+/* Returns 1 if the next message of category should be logged. */
+int log_sampled(int category)
+{
+  if (log_sample[category] <= 1)
+    return 1;
+
+  return __sync_fetch_and_add(&log_sample_count[category], 1) % log_sample[category] == 0;
+}
+
+
+
+/* Format a message into the next free slot of the queue. If the
+ * writer is that far behind, the message is dropped (and counted)
+ * rather than making the caller wait.
+ */
+void log_message(int level, int category, const char* fmt, ...)
+{
+  struct timeval now;
+  LOG_SLOT* slot;
+  uint64_t pos;
+  uint64_t seq;
+  uint64_t lap;
+  pthread_t writer_thread;
+  va_list args;
+  int len;
+
+  gettimeofday(&now, NULL);
+
+  /* Before the constructor ran there is nobody to write the queue out. */
+  if (!log_ready) {
+    va_start(args, fmt);
+    fprintf(stderr, "libnetworkinterpose[%d] %s %s: ", (int) getpid(),
+            log_level_names[level], log_category_names[category]);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    return;
+  }
+
+  pos = log_tail;
+
+  while (1) {
+    slot = &log_queue[pos % LOG_QUEUE_SIZE];
+    lap = pos / LOG_QUEUE_SIZE * 2;
+    seq = slot->seq;
+
+    if (seq == lap) {
+      if (__sync_bool_compare_and_swap(&log_tail, pos, pos + 1))
+        break;
+    }
+    else if (seq < lap) {
+      __sync_fetch_and_add(&log_dropped, 1);
+      return;
+    }
+
+    pos = log_tail;
+  }
+
+  len = snprintf(slot->msg, LOG_MESSAGE_LEN, "%ld.%06ld libnetworkinterpose[%d] %s %s: ",
+                 (long) now.tv_sec, (long) now.tv_usec, (int) getpid(),
+                 log_level_names[level], log_category_names[category]);
+
+  va_start(args, fmt);
+  len += vsnprintf(slot->msg + len, LOG_MESSAGE_LEN - len, fmt, args);
+  va_end(args);
+
+  /* Long messages are cut short, but always end their line. */
+  if (len > LOG_MESSAGE_LEN - 2)
+    len = LOG_MESSAGE_LEN - 2;
+  slot->msg[len++] = '\n';
+  slot->len = len;
+
+  __sync_synchronize();
+  slot->seq = lap + 1;
+
+  if (!log_writer_running && __sync_bool_compare_and_swap(&log_writer_running, 0, 1)) {
+    if (pthread_create(&writer_thread, NULL, log_writer, NULL) == 0)
+      pthread_detach(writer_thread);
+    else
+      log_writer_running = 0;
+  }
+}
+
+
+
+/* Write out the queued messages. Only one thread drains at a time.
+ * Returns the number of messages written.
+ */
+int log_drain()
+{
+  char out_buf[16 * LOG_MESSAGE_LEN];
+  int out_len = 0;
+  int count = 0;
+  unsigned long dropped;
+  LOG_SLOT* slot;
+  uint64_t lap;
+
+  pthread_mutex_lock(&log_drain_lock);
+
+  while (1) {
+    slot = &log_queue[log_head % LOG_QUEUE_SIZE];
+    lap = log_head / LOG_QUEUE_SIZE * 2;
+
+    if (slot->seq != lap + 1)
+      break;
+
+    if (out_len + slot->len > (int) sizeof(out_buf)) {
+      (*libc_write)(log_fd, out_buf, out_len);
+      out_len = 0;
+    }
+
+    memcpy(out_buf + out_len, slot->msg, slot->len);
+    out_len += slot->len;
+
+    __sync_synchronize();
+    slot->seq = lap + 2;
+    log_head++;
+    count++;
+  }
+
+  if ((dropped = __sync_lock_test_and_set(&log_dropped, 0)) > 0 &&
+      out_len + 64 <= (int) sizeof(out_buf))
+    out_len += sprintf(out_buf + out_len, "libnetworkinterpose[%d]: %lu log messages dropped\n",
+                       (int) getpid(), dropped);
+
+  if (out_len > 0)
+    (*libc_write)(log_fd, out_buf, out_len);
+
+  pthread_mutex_unlock(&log_drain_lock);
+
+  return count;
+}
+
+
+
+/* The background writer. It only sleeps when the queue is empty. */
+void* log_writer(void* unused)
+{
+  struct timespec idle;
+
+  idle.tv_sec = 0;
+  idle.tv_nsec = 10000000;
+
+  while (1) {
+    if (log_drain() == 0)
+      nanosleep(&idle, NULL);
+  }
+
+  return NULL;
+}
+
+
+
+/* Write out what is left when the process exits. */
+void log_flush()
+{
+  log_drain();
+}
+
+
+
+
+// ##################### APPLICATION API ##############################
+
+/* Count a finished send (sending = 1) or receive that started at
+ * start_ns in the statistics of sockfd. start_ns is only read if
+ * sock_stats_timing is set.
+ */
+void sock_stats_record(int sockfd, int sending, uint64_t start_ns, ssize_t result)
+{
+  struct libnit_stats* stats;
+  uint64_t elapsed;
+
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD)
+    return;
+
+  stats = &sock_stats_dict[sockfd];
+  elapsed = sock_stats_timing ? trace_now() - start_ns : 0;
+
+  if (result < 0) {
+    __sync_fetch_and_add(&stats->errors, 1);
+    return;
+  }
+
+  /* The maximums are only ever raised, a lost race loses a sample. */
+  if (sending) {
+    __sync_fetch_and_add(&stats->send_calls, 1);
+    __sync_fetch_and_add(&stats->bytes_sent, result);
+    __sync_fetch_and_add(&stats->send_ns, elapsed);
+    if (elapsed > stats->max_send_ns)
+      stats->max_send_ns = elapsed;
+  }
+  else {
+    __sync_fetch_and_add(&stats->recv_calls, 1);
+    __sync_fetch_and_add(&stats->bytes_received, result);
+    __sync_fetch_and_add(&stats->recv_ns, elapsed);
+    if (elapsed > stats->max_recv_ns)
+      stats->max_recv_ns = elapsed;
+  }
+}
+
+
+
+/* A new socket starts with fresh counters. */
+void sock_stats_reset(int sockfd)
+{
+  if (sockfd >= 0 && sockfd < MAX_SOCK_FD)
+    memset(&sock_stats_dict[sockfd], 0, sizeof(struct libnit_stats));
+}
+
+
+
+SOCK_TUNING* sock_tuning_get(int sockfd, int create)
+{
+  SOCK_TUNING* st;
+
+  if (sockfd < 0 || sockfd >= MAX_SOCK_FD)
+    return NULL;
+
+  if (sock_tuning_dict[sockfd] || !create)
+    return sock_tuning_dict[sockfd];
+
+  pthread_mutex_lock(&sock_tuning_lock);
+
+  if (!sock_tuning_dict[sockfd] && (st = calloc(1, sizeof(SOCK_TUNING)))) {
+    pthread_mutex_init(&st->send_lock, NULL);
+    pthread_mutex_init(&st->recv_lock, NULL);
+    sock_tuning_dict[sockfd] = st;
+  }
+
+  pthread_mutex_unlock(&sock_tuning_lock);
+
+  return sock_tuning_dict[sockfd];
+}
+
+
+
+/* Forget the modes of a socket that is being closed, sending what is
+ * still held back first.
+ */
+void sock_tuning_release(int sockfd)
+{
+  SOCK_TUNING* st = sock_tuning_get(sockfd, 0);
+
+  if (!st)
+    return;
+
+  pthread_mutex_lock(&st->send_lock);
+  sock_tuning_flush(sockfd, st);
+  pthread_mutex_unlock(&st->send_lock);
+
+  pthread_mutex_lock(&sock_tuning_lock);
+  sock_tuning_dict[sockfd] = NULL;
+  pthread_mutex_unlock(&sock_tuning_lock);
+
+  free(st->send_buf);
+  free(st->recv_buf);
+  free(st);
+}
+
+
+
+/* The most data a single call on sockfd can carry. Calls that are
+ * forwarded to the proxy are limited by the size of its messages.
+ */
+size_t sock_call_limit(int sockfd)
+{
+  if (native_sock_dict[sockfd] || relay_sock_dict[sockfd] ||
+      (!socket_endpoint_dict[sockfd] && !lazy_sock_dict[sockfd].pending))
+    return (size_t) -1;
+
+  return RECV_SIZE - 48;
+}
+
+
+
+/* Send the data that write coalescing held back. The caller holds
+ * st->send_lock. On failure what was not sent stays pending.
+ */
+int sock_tuning_flush(int sockfd, SOCK_TUNING* st)
+{
+  size_t limit = sock_call_limit(sockfd);
+  size_t sent = 0;
+  ssize_t result;
+
+  while (sent < st->send_len) {
+    result = libnit_send(sockfd, st->send_buf + sent,
+                         st->send_len - sent < limit ? st->send_len - sent : limit, 0);
+
+    if (result < 0 && errno == EINTR)
+      continue;
+
+    if (result <= 0) {
+      memmove(st->send_buf, st->send_buf + sent, st->send_len - sent);
+      st->send_len -= sent;
+      return -1;
+    }
+
+    sent += result;
+  }
+
+  st->send_len = 0;
+  return 0;
+}
+
+
+
+/* send() on a socket with modes set. Small sends are copied into
+ * send_buf until coalesce bytes are pending and go out as one call.
+ * Sends with flags, or that do not fit, push out what is pending and
+ * go straight through.
+ */
+ssize_t tuned_send(int sockfd, SOCK_TUNING* st, const void *message, size_t length, int flags)
+{
+  ssize_t result;
+
+  pthread_mutex_lock(&st->send_lock);
+
+  if (st->coalesce > 0 && !(flags & ~MSG_NOSIGNAL) && length < st->coalesce) {
+    if (st->send_len + length > st->coalesce && sock_tuning_flush(sockfd, st) < 0) {
+      pthread_mutex_unlock(&st->send_lock);
+      return -1;
+    }
+
+    if (st->send_cap < st->coalesce) {
+      char* new_buf = realloc(st->send_buf, st->coalesce);
+
+      if (!new_buf) {
+        pthread_mutex_unlock(&st->send_lock);
+        errno = ENOBUFS;
+        return -1;
+      }
+
+      st->send_buf = new_buf;
+      st->send_cap = st->coalesce;
+    }
+
+    memcpy(st->send_buf + st->send_len, message, length);
+    st->send_len += length;
+
+    /* A full buffer goes out right away, errors show up on the next call. */
+    if (st->send_len >= st->coalesce)
+      sock_tuning_flush(sockfd, st);
+
+    pthread_mutex_unlock(&st->send_lock);
+    return length;
+  }
+
+  if (st->send_len > 0 && sock_tuning_flush(sockfd, st) < 0)
+    result = -1;
+  else
+    result = libnit_send(sockfd, message, length, flags);
+
+  pthread_mutex_unlock(&st->send_lock);
+
+  return result;
+}
+
+
+
+/* recv() on a socket with modes set. Anything that is held back is
+ * sent first, since the peer may be waiting for it. With read-ahead,
+ * small receives ask for read_ahead bytes and keep the rest in
+ * recv_buf for the receives that follow.
+ */
+ssize_t tuned_recv(int sockfd, SOCK_TUNING* st, void *buffer, size_t length, int flags)
+{
+  size_t window;
+  ssize_t result;
+
+  if (st->send_len > 0) {
+    pthread_mutex_lock(&st->send_lock);
+    result = sock_tuning_flush(sockfd, st);
+    pthread_mutex_unlock(&st->send_lock);
+
+    if (result < 0)
+      return -1;
+  }
+
+  pthread_mutex_lock(&st->recv_lock);
+
+  if (st->recv_len > st->recv_off) {
+    result = st->recv_len - st->recv_off < length ? st->recv_len - st->recv_off : length;
+    memcpy(buffer, st->recv_buf + st->recv_off, result);
+
+    if (!(flags & MSG_PEEK))
+      st->recv_off += result;
+
+    pthread_mutex_unlock(&st->recv_lock);
+    return result;
+  }
+
+  window = st->read_ahead < sock_call_limit(sockfd) ? st->read_ahead : sock_call_limit(sockfd);
+
+  if (length >= window || (flags & ~MSG_NOSIGNAL)) {
+    pthread_mutex_unlock(&st->recv_lock);
+    return libnit_recv(sockfd, buffer, length, flags);
+  }
+
+  if (st->recv_cap < window) {
+    char* new_buf = realloc(st->recv_buf, window);
+
+    if (!new_buf) {
+      pthread_mutex_unlock(&st->recv_lock);
+      return libnit_recv(sockfd, buffer, length, flags);
+    }
+
+    st->recv_buf = new_buf;
+    st->recv_cap = window;
+  }
+
+  st->recv_off = 0;
+  st->recv_len = 0;
+
+  if ((result = libnit_recv(sockfd, st->recv_buf, window, flags)) > 0) {
+    st->recv_len = result;
+    result = (size_t) result < length ? (size_t) result : length;
+    memcpy(buffer, st->recv_buf, result);
+    st->recv_off = result;
+  }
+
+  pthread_mutex_unlock(&st->recv_lock);
+
+  return result;
+}
+
+
+
+/* recv() with the modes of the socket, if it has any. */
+ssize_t sock_recv(int sockfd, void *buffer, size_t length, int flags)
+{
+  SOCK_TUNING* st = sock_tuning_get(sockfd, 0);
+
+  if (st)
+    return tuned_recv(sockfd, st, buffer, length, flags);
+
+  return libnit_recv(sockfd, buffer, length, flags);
+}
+
+
+
+int libnit_get_stats(int fd, struct libnit_stats* stats)
+{
+  SOCK_TUNING* st = sock_tuning_get(fd, 0);
+
+  if (fd < 0 || fd >= MAX_SOCK_FD || !stats) {
+    errno = EBADF;
+    return -1;
+  }
+
+  memcpy(stats, &sock_stats_dict[fd], sizeof(struct libnit_stats));
+
+  if (st) {
+    stats->send_pending = st->send_len;
+    stats->recv_buffered = st->recv_len - st->recv_off;
+  }
+
+  return 0;
+}
+
+
+
+int libnit_set_mode(int fd, int mode, long value)
+{
+  SOCK_TUNING* st;
+  int result = 0;
+
+  if (fd < 0 || fd >= MAX_SOCK_FD || value < 0) {
+    errno = fd < 0 || fd >= MAX_SOCK_FD ? EBADF : EINVAL;
+    return -1;
+  }
+
+  switch (mode) {
+  case LIBNIT_MODE_COALESCE:
+    if (!(st = sock_tuning_get(fd, 1)))
+      break;
+
+    pthread_mutex_lock(&st->send_lock);
+    if (st->send_len > 0 && (size_t) value <= st->send_len)
+      result = sock_tuning_flush(fd, st);
+    st->coalesce = value;
+    pthread_mutex_unlock(&st->send_lock);
+    return result;
+
+  case LIBNIT_MODE_READ_AHEAD:
+    if (!(st = sock_tuning_get(fd, 1)))
+      break;
+
+    pthread_mutex_lock(&st->recv_lock);
+    st->read_ahead = value;
+    pthread_mutex_unlock(&st->recv_lock);
+    return 0;
+
+  case LIBNIT_MODE_BYPASS:
+    /* A socket that has not reached the proxy yet is a libc socket
+     * already, it just has to stay one.
+     */
+    pthread_mutex_lock(&lazy_sock_lock);
+
+    if (lazy_sock_dict[fd].pending) {
+      if (value)
+        lazy_sock_dict[fd].pending = 0;
+    }
+    else if (socket_endpoint_dict[fd] || native_sock_dict[fd]) {
+      if (value) {
+        errno = EISCONN;
+        result = -1;
+      }
+    }
+    else if (!value) {
+      /* There is no way back to the proxy. */
+      errno = EINVAL;
+      result = -1;
+    }
+
+    pthread_mutex_unlock(&lazy_sock_lock);
+    return result;
+
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+
+  errno = ENOMEM;
+  return -1;
+}
+
+
+
+int libnit_get_mode(int fd, int mode, long* value)
+{
+  SOCK_TUNING* st = sock_tuning_get(fd, 0);
+
+  if (fd < 0 || fd >= MAX_SOCK_FD || !value) {
+    errno = EBADF;
+    return -1;
+  }
+
+  switch (mode) {
+  case LIBNIT_MODE_COALESCE:
+    *value = st ? (long) st->coalesce : 0;
+    return 0;
+
+  case LIBNIT_MODE_READ_AHEAD:
+    *value = st ? (long) st->read_ahead : 0;
+    return 0;
+
+  case LIBNIT_MODE_BYPASS:
+    *value = !socket_endpoint_dict[fd] && !lazy_sock_dict[fd].pending && !native_sock_dict[fd];
+    return 0;
+  }
+
+  errno = EINVAL;
+  return -1;
+}
+
+
+
+int libnit_flush(int fd)
+{
+  SOCK_TUNING* st = sock_tuning_get(fd, 0);
+  int result;
+
+  if (!st || st->send_len == 0)
+    return 0;
+
+  pthread_mutex_lock(&st->send_lock);
+  result = sock_tuning_flush(fd, st);
+  pthread_mutex_unlock(&st->send_lock);
+
+  return result;
+}
+
+
+
+
+// ##################### BATCHED CALLS ##############################
+
+/* Read exactly length bytes, returns -1 if the connection ends first. */
+int batch_recv_all(int sockfd, char* buffer, size_t length)
+{
+  size_t received = 0;
+  ssize_t result;
+
+  while (received < length) {
+    result = (*libc_recv)(sockfd, buffer + received, length - received, 0);
+
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0)
+      return -1;
+
+    received += result;
+  }
+
+  return 0;
+}
+
+
+
+int batch_send_all(int sockfd, const char* buffer, size_t length)
+{
+  size_t sent = 0;
+  ssize_t result;
+
+  while (sent < length) {
+    result = (*libc_send)(sockfd, buffer + sent, length - sent, MSG_NOSIGNAL);
+
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0)
+      return -1;
+
+    sent += result;
+  }
+
+  return 0;
+}
+
+
+
+/* Serialize the arguments of a batched operation the way the single
+ * call would (see call_send() and friends in the proxy). Returns the
+ * length of the arguments, data included, or -1 if the operation can
+ * not be batched.
+ */
+int batch_args(const struct libnit_sqe* sqe, char* arg_list, char** call)
+{
+  char buf[64] = "";
+  int repy_sock_fd = socket_fd_dict[sqe->fd];
+
+  switch (sqe->opcode) {
+  case LIBNIT_OP_SEND:
+    *call = "send";
+    return sprintf(arg_list, "%d,%d,", repy_sock_fd, sqe->flags) + (int) sqe->len;
+
+  case LIBNIT_OP_RECV:
+    *call = "recv";
+    return sprintf(arg_list, "%d,%lu,%d", repy_sock_fd, (unsigned long) sqe->len, sqe->flags);
+
+  case LIBNIT_OP_CONNECT:
+    if (!sqe->addr || sqe->addr->sa_family != AF_INET)
+      return -1;
+    *call = "connect";
+    serialize_sockaddr((struct sockaddr*) sqe->addr, buf);
+    return sprintf(arg_list, "%d,%s", repy_sock_fd, buf);
+
+  case LIBNIT_OP_SHUTDOWN:
+    *call = "shutdown";
+    return sprintf(arg_list, "%d,%d", repy_sock_fd, sqe->flags);
+  }
+
+  return -1;
+}
+
+
+
+/* Send the operations of sqes that belong to endpoint (batch_endpoint
+ * holds the endpoint of every operation, -1 for the ones that are not
+ * batched) to the proxy as one "batch" call and fill in their
+ * completions. The batch is a FUNCSTRUCT with "<count>,<length>" as its
+ * arg list, followed by length bytes of "<call>,<args length>\n<args>"
+ * records. The reply is the err_val and the length of the answers,
+ * followed by one "<err_val>,<length>\n<result>" record per operation.
+ */
+int batch_exchange(int endpoint, const struct libnit_sqe* sqes, int count,
+                   struct libnit_cqe* cqes, int* batch_endpoint)
+{
+  FUNCSTRUCT header;
+  char arg_list[128];
+  char* payload = NULL;
+  char* reply = NULL;
+  char* pos;
+  char* call;
+  size_t payload_len = 0;
+  size_t payload_cap = 0;
+  uint64_t exchange_ns = 0;
+  int reply_head[2];
+  int ops = 0;
+  int chanfd;
+  int args_len;
+  int err_val;
+  long length;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (batch_endpoint[i] != endpoint)
+      continue;
+
+    args_len = batch_args(&sqes[i], arg_list, &call);
+
+    if (payload_len + args_len + 64 > payload_cap) {
+      char* new_payload = realloc(payload, (payload_len + args_len + 64) * 2);
+
+      if (!new_payload) {
+        free(payload);
+        errno = ENOMEM;
+        return -1;
+      }
+
+      payload = new_payload;
+      payload_cap = (payload_len + args_len + 64) * 2;
+    }
+
+    payload_len += sprintf(payload + payload_len, "%s,%d\n%s", call, args_len, arg_list);
+
+    /* The data of a send follows its arguments. */
+    if (sqes[i].opcode == LIBNIT_OP_SEND) {
+      memcpy(payload + payload_len, sqes[i].buf, sqes[i].len);
+      payload_len += sqes[i].len;
+    }
+
+    ops++;
+  }
+
+  memset(&header, 0, sizeof(header));
+  strcpy(header.func_name, "batch");
+  sprintf(header.arg_list, "%d,%lu", ops, (unsigned long) payload_len);
+
+  pthread_mutex_lock(&batch_lock[endpoint]);
+
+  if (!batch_channel_dict[endpoint] && (chanfd = init_master_sock_on(endpoint)) >= 0)
+    batch_channel_dict[endpoint] = chanfd + 1;
+
+  chanfd = batch_channel_dict[endpoint] - 1;
+
+  LIBNIT_LOG(LIBNIT_LOG_DEBUG, LOG_CAT_CALL, "batch of %d calls (%lu bytes) on fd %d",
+             ops, (unsigned long) payload_len, chanfd);
+
+  if (span_trace_id && chanfd >= 0) {
+    exchange_ns = span_now();
+    span_send_context(chanfd, span_new_id(), exchange_ns);
+  }
+
+  if (chanfd < 0 ||
+      batch_send_all(chanfd, (char*) &header, sizeof(header)) < 0 ||
+      batch_send_all(chanfd, payload, payload_len) < 0 ||
+      batch_recv_all(chanfd, (char*) reply_head, sizeof(reply_head)) < 0 ||
+      reply_head[1] < 0 || !(reply = malloc(reply_head[1] + 1)) ||
+      batch_recv_all(chanfd, reply, reply_head[1]) < 0) {
+    /* Start over with a new connection next time. */
+    if (chanfd >= 0) {
+      release_proxy_channel(chanfd);
+      (*libc_close)(chanfd);
+      batch_channel_dict[endpoint] = 0;
+      proxy_breaker_record(0);
+    }
+
+    pthread_mutex_unlock(&batch_lock[endpoint]);
+    free(payload);
+    free(reply);
+    errno = ECONNRESET;
+    return -1;
+  }
+
+  pthread_mutex_unlock(&batch_lock[endpoint]);
+  free(payload);
+
+  if (exchange_ns)
+    span_write("proxy exchange", span_trace_id, exchange_ns, span_now(), chanfd, ops);
+
+  reply[reply_head[1]] = '\0';
+  pos = reply;
+
+  for (i = 0; i < count; i++) {
+    if (batch_endpoint[i] != endpoint)
+      continue;
+
+    if (pos >= reply + reply_head[1] || sscanf(pos, "%d,%ld", &err_val, &length) != 2 ||
+        !(pos = strchr(pos, '\n')) || ++pos + length > reply + reply_head[1]) {
+      cqes[i].result = -1;
+      cqes[i].err = EPROTO;
+      pos = reply + reply_head[1];
+      continue;
+    }
+
+    if (err_val >= 0) {
+      cqes[i].result = -1;
+      cqes[i].err = err_val;
+    }
+    else if (sqes[i].opcode == LIBNIT_OP_RECV) {
+      cqes[i].result = (size_t) length < sqes[i].len ? (size_t) length : sqes[i].len;
+      memcpy(sqes[i].buf, pos, cqes[i].result);
+    }
+    else
+      cqes[i].result = atol(pos);
+
+    pos += length;
+  }
+
+  free(reply);
+
+  return 0;
+}
+
+
+
+/* Run the operations of a batch. The ones on proxied sockets are
+ * grouped by proxy and sent off in one exchange per proxy, the rest
+ * go through the usual calls right away.
+ */
+int libnit_submit(const struct libnit_sqe* sqes, int count, struct libnit_cqe* cqes)
+{
+  uint64_t start_ns = sock_stats_timing ? trace_now() : 0;
+  SPAN span;
+  int* batch_endpoint;
+  int endpoint;
+  int fd;
+  int i;
+  int j;
+
+  if (count < 0 || (count > 0 && (!sqes || !cqes))) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!(batch_endpoint = malloc((count + 1) * sizeof(int)))) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  span = span_begin();
+
+  for (i = 0; i < count; i++) {
+    const struct libnit_sqe* sqe = &sqes[i];
+    struct libnit_cqe* cqe = &cqes[i];
+
+    fd = sqe->fd;
+    cqe->user_data = sqe->user_data;
+    cqe->result = 0;
+    cqe->err = 0;
+    batch_endpoint[i] = -1;
+
+    if (fd >= 0 && fd < MAX_SOCK_FD && sqe->opcode != LIBNIT_OP_CLOSE &&
+        !native_sock_lookup(fd) && !relay_sock_lookup(fd) && proxy_sock_lookup(fd) &&
+        (sqe->opcode != LIBNIT_OP_CONNECT || (sqe->addr && sqe->addr->sa_family == AF_INET))) {
+      /* Held back data goes first. */
+      libnit_flush(fd);
+      batch_endpoint[i] = socket_endpoint_dict[fd] - 1;
+      continue;
+    }
+
+    if (sqe->opcode == LIBNIT_OP_CLOSE)
+      continue;
+
+    switch (sqe->opcode) {
+    case LIBNIT_OP_SEND:
+      cqe->result = send(fd, sqe->buf, sqe->len, sqe->flags);
+      break;
+    case LIBNIT_OP_RECV:
+      cqe->result = recv(fd, sqe->buf, sqe->len, sqe->flags | MSG_DONTWAIT);
+      break;
+    case LIBNIT_OP_CONNECT:
+      cqe->result = connect(fd, sqe->addr, sqe->addrlen);
+      break;
+    case LIBNIT_OP_SHUTDOWN:
+      cqe->result = shutdown(fd, sqe->flags);
+      break;
+    default:
+      cqe->result = -1;
+      errno = EINVAL;
+    }
+
+    if (cqe->result < 0)
+      cqe->err = errno;
+  }
+
+  /* One exchange for every proxy that has operations in the batch. */
+  for (i = 0; i < count; i++) {
+    if ((endpoint = batch_endpoint[i]) < 0)
+      continue;
+
+    if (batch_exchange(endpoint, sqes, count, cqes, batch_endpoint) < 0) {
+      for (j = i; j < count; j++) {
+        if (batch_endpoint[j] == endpoint) {
+          cqes[j].result = -1;
+          cqes[j].err = errno;
+        }
+      }
+    }
+
+    for (j = i; j < count; j++) {
+      if (batch_endpoint[j] != endpoint)
+        continue;
+
+      batch_endpoint[j] = -1;
+
+      if (sqes[j].opcode == LIBNIT_OP_SEND || sqes[j].opcode == LIBNIT_OP_RECV)
+        sock_stats_record(sqes[j].fd, sqes[j].opcode == LIBNIT_OP_SEND, start_ns, cqes[j].result);
+    }
+  }
+
+  /* The sockets are closed after everything else was done with them. */
+  for (i = 0; i < count; i++) {
+    if (sqes[i].opcode != LIBNIT_OP_CLOSE)
+      continue;
+
+    if ((cqes[i].result = close(sqes[i].fd)) < 0)
+      cqes[i].err = errno;
+  }
+
+  free(batch_endpoint);
+
+  span_end(&span, "libnit_submit", -1, count);
+  return count;
+}
+
+
+
+
+// ##################### SPANS ##############################
+
+/* With LIBNIT_SPANS=<file> set, one in every LIBNIT_SPAN_SAMPLE calls
+ * (every call by default) gets a trace id, and the call and its
+ * exchanges with the proxy are written to the file as spans in the
+ * Trace Event format that chrome://tracing and Perfetto open. Before
+ * the call itself, the proxy is sent a "trace" call with the trace id,
+ * so that it adds its own spans of the call (see LIBNIT_PROXY_SPANS)
+ * and a flow from the exchange to them. Every process appends to the
+ * file, which the proxy may share. The array of events is left open,
+ * which both viewers accept.
+ */
+void span_open()
+{
+  char* path = getenv("LIBNIT_SPANS");
+  char tmp_path[512];
+  int tmp_fd;
+
+  if (!path || !path[0])
+    return;
+
+  if (getenv("LIBNIT_SPAN_SAMPLE") && atoi(getenv("LIBNIT_SPAN_SAMPLE")) > 1)
+    span_sample = atoi(getenv("LIBNIT_SPAN_SAMPLE"));
+
+  /* The first process to get there creates the file with the opening
+   * bracket in it. link() fails if someone was quicker.
+   */
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int) getpid());
+
+  if ((tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0) {
+    if ((*libc_write)(tmp_fd, "[\n", 2) == 2)
+      link(tmp_path, path);
+    (*libc_close)(tmp_fd);
+    unlink(tmp_path);
+  }
+
+  if ((span_fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC)) < 0)
+    LIBNIT_LOG(LIBNIT_LOG_ERROR, LOG_CAT_PROXY, "unable to open the span file %s: %s", path, strerror(errno));
+}
+
+
+
+/* Spans are timed by the wall clock, which the proxy shares. */
+uint64_t span_now()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+
+uint64_t span_new_id()
+{
+  uint64_t x = span_rand_state;
+
+  if (!x)
+    x = span_now() ^ ((uint64_t) getpid() << 32) ^ (uint64_t) (uintptr_t) &span_rand_state;
+
+  /* xorshift64* */
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  span_rand_state = x;
+
+  return (x * 0x2545F4914F6CDD1Dull) | 1;
+}
+
+
+
+/* Start the span of an interposed call. Calls made on the way (e.g. a
+ * flush before a receive) are part of the outer call's span.
+ */
+SPAN span_begin()
+{
+  SPAN span = { 0, 0 };
+
+  if (span_fd < 0 || span_trace_id)
+    return span;
+
+  if (span_sample > 1 && __sync_fetch_and_add(&span_sample_count, 1) % span_sample)
+    return span;
+
+  span.trace_id = span_new_id();
+  span.start_ns = span_now();
+  span_trace_id = span.trace_id;
+  return span;
+}
+
+
+
+void span_end(SPAN* span, const char* name, int fd, long result)
+{
+  if (!span->trace_id)
+    return;
+
+  span_trace_id = 0;
+  span_write(name, span->trace_id, span->start_ns, span_now(), fd, result);
+}
+
+
+
+void span_write(const char* name, uint64_t trace_id, uint64_t start_ns, uint64_t end_ns,
+                int fd, long result)
+{
+  int saved_errno = errno;
+  char line[384];
+  int len;
+
+  len = snprintf(line, sizeof(line),
+                 "{\"name\":\"%s\",\"cat\":\"libnit\",\"ph\":\"X\",\"ts\":%llu.%03u,\"dur\":%llu.%03u,"
+                 "\"pid\":%d,\"tid\":%d,\"args\":{\"trace_id\":\"%016llx\",\"fd\":%d,\"result\":%ld}},\n",
+                 name, (unsigned long long) (start_ns / 1000), (unsigned int) (start_ns % 1000),
+                 (unsigned long long) ((end_ns - start_ns) / 1000), (unsigned int) ((end_ns - start_ns) % 1000),
+                 (int) getpid(), (int) syscall(SYS_gettid), (unsigned long long) trace_id, fd, result);
+
+  /* Appends of a line are not interleaved with the other writers. */
+  if (len > 0 && len < (int) sizeof(line))
+    (*libc_write)(span_fd, line, len);
+
+  errno = saved_errno;
+}
+
+
+
+/* The start of the flow from an exchange to the proxy's spans of it. */
+void span_write_flow(uint64_t flow_id, uint64_t sent_ns)
+{
+  int saved_errno = errno;
+  char line[256];
+  int len;
+
+  len = snprintf(line, sizeof(line),
+                 "{\"name\":\"proxy call\",\"cat\":\"libnit\",\"ph\":\"s\",\"id\":\"%016llx\",\"ts\":%llu.%03u,"
+                 "\"pid\":%d,\"tid\":%d},\n",
+                 (unsigned long long) flow_id, (unsigned long long) (sent_ns / 1000), (unsigned int) (sent_ns % 1000),
+                 (int) getpid(), (int) syscall(SYS_gettid));
+
+  if (len > 0 && len < (int) sizeof(line))
+    (*libc_write)(span_fd, line, len);
+
+  errno = saved_errno;
+}
+
+
+
+/* Tell the proxy that the next call on chanfd belongs to the current
+ * trace: a "trace" call with "<trace id>,<flow id>,<sent_ns>" as its
+ * arg list, which the proxy does not answer.
+ */
+void span_send_context(int chanfd, uint64_t flow_id, uint64_t sent_ns)
+{
+  FUNCSTRUCT header;
+
+  memset(&header, 0, sizeof(header));
+  strcpy(header.func_name, "trace");
+  sprintf(header.arg_list, "%016llx,%016llx,%llu", (unsigned long long) span_trace_id,
+          (unsigned long long) flow_id, (unsigned long long) sent_ns);
+
+  /* Held back until the call itself is sent, so that the two do not
+   * wait for each other's ACK.
+   */
+  (*libc_send)(chanfd, &header, sizeof(header), MSG_MORE);
+  span_write_flow(flow_id, sent_ns);
+}
+
+
+
+
+// ##################### CALL TRACE ##############################
+
+/* With LIBNIT_TRACE=<prefix> set, every process records the calls it
+ * makes into <prefix>.<pid>.trace, a ring of LIBNIT_TRACE_RECORDS
+ * records that is mmap'd, so recording a call is a copy into memory.
+ * LIBNIT_TRACE_PAYLOAD optionally keeps the first bytes (at most
+ * TRACE_PAYLOAD_MAX) of the data that is sent and received. The format
+ * is described in libnit_trace.h, libnit_replay plays traces back.
+ */
+void trace_open()
+{
+  char* prefix = getenv("LIBNIT_TRACE");
+  char path[512];
+  uint32_t capacity = TRACE_DEFAULT_RECORDS;
+  size_t trace_size;
+  void* trace_map;
+  int trace_fd;
+
+  if (!prefix || !prefix[0])
+    return;
+
+  if (getenv("LIBNIT_TRACE_RECORDS") && atoi(getenv("LIBNIT_TRACE_RECORDS")) > 0)
+    capacity = atoi(getenv("LIBNIT_TRACE_RECORDS"));
+
+  if (getenv("LIBNIT_TRACE_PAYLOAD"))
+    trace_payload_len = atoi(getenv("LIBNIT_TRACE_PAYLOAD"));
+
+  if (trace_payload_len < 0)
+    trace_payload_len = 0;
+  else if (trace_payload_len > TRACE_PAYLOAD_MAX)
+    trace_payload_len = TRACE_PAYLOAD_MAX;
+
+  snprintf(path, sizeof(path), "%s.%d.trace", prefix, (int) getpid());
+  trace_size = sizeof(TRACE_HEADER) + (size_t) capacity * sizeof(TRACE_RECORD);
+
+  if ((trace_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+    LIBNIT_LOG(LIBNIT_LOG_ERROR, LOG_CAT_PROXY, "unable to open the trace file %s: %s", path, strerror(errno));
+    return;
+  }
+
+  if (ftruncate(trace_fd, trace_size) < 0 ||
+      (trace_map = mmap(NULL, trace_size, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, 0)) == MAP_FAILED) {
+    LIBNIT_LOG(LIBNIT_LOG_ERROR, LOG_CAT_PROXY, "unable to map the trace file %s: %s", path, strerror(errno));
+    (*libc_close)(trace_fd);
+    return;
+  }
+
+  (*libc_close)(trace_fd);
+
+  trace_ring = (TRACE_HEADER*) trace_map;
+  trace_records = (TRACE_RECORD*) (trace_ring + 1);
+  trace_ring_size = trace_size;
+
+  trace_ring->magic = TRACE_MAGIC;
+  trace_ring->version = TRACE_VERSION;
+  trace_ring->record_size = sizeof(TRACE_RECORD);
+  trace_ring->capacity = capacity;
+  trace_ring->pid = getpid();
+  trace_ring->payload_max = trace_payload_len;
+  trace_ring->start_ns = trace_now();
+  trace_ring->head = 0;
+}
+
+
+
+uint64_t trace_now()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+
+/* Returns 1 if read() and write() on fd are worth recording, i.e. fd
+ * is one of our sockets (or has modes set) and not a file.
+ */
+int trace_fd_is_socket(int fd)
+{
+  if (fd < 0 || fd >= MAX_SOCK_FD)
+    return 0;
+
+  return socket_endpoint_dict[fd] || native_sock_dict[fd] || relay_sock_dict[fd] ||
+         lazy_sock_dict[fd].pending || sock_tuning_dict[fd];
+}
+
+
+
+void trace_record(int opcode, int fd, uint64_t start_ns, ssize_t result, size_t length,
+                  int arg1, int arg2, int arg3, const struct sockaddr* address,
+                  const void* payload, size_t payload_len)
+{
+  int saved_errno = errno;
+  uint64_t now = trace_now();
+  uint64_t index = __sync_fetch_and_add(&trace_ring->head, 1);
+  TRACE_RECORD* record = &trace_records[index % trace_ring->capacity];
+
+  memset(record, 0, sizeof(TRACE_RECORD));
+  record->start_ns = start_ns - trace_ring->start_ns;
+  record->duration_ns = now - start_ns;
+  record->length = length;
+  record->result = result;
+  record->opcode = opcode;
+  record->fd = fd;
+  record->err = result < 0 ? saved_errno : 0;
+  record->args[0] = arg1;
+  record->args[1] = arg2;
+  record->args[2] = arg3;
+
+  if (address && address->sa_family == AF_INET) {
+    record->addr = ((struct sockaddr_in*) address)->sin_addr.s_addr;
+    record->port = ((struct sockaddr_in*) address)->sin_port;
+  }
+
+  if (payload && payload_len > 0 && trace_payload_len > 0) {
+    record->payload_len = payload_len < (size_t) trace_payload_len ? payload_len : trace_payload_len;
+    memcpy(record->payload, payload, record->payload_len);
+  }
+
+  errno = saved_errno;
+}
+
+
+
+/* The entry points of the interposed calls. They hand the call to its
+ * libnit_ implementation (or to the per-socket modes of libnit.h),
+ * keep the statistics of the socket and record the call if tracing is
+ * on.
+ */
+int socket(int domain, int type, int protocol)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring ? trace_now() : 0;
+  int result = libnit_socket(domain, type, protocol);
+
+  sock_stats_reset(result);
+
+  if (trace_ring)
+    trace_record(TRACE_SOCKET, result, start_ns, result, 0, domain, type, protocol, NULL, NULL, 0);
+  span_end(&span, "socket", result, result);
+  return result;
+}
+
+
+
+int bind(int sockfd, const struct sockaddr *address, socklen_t address_len)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring ? trace_now() : 0;
+  int result = libnit_bind(sockfd, address, address_len);
+
+  if (trace_ring)
+    trace_record(TRACE_BIND, sockfd, start_ns, result, address_len, 0, 0, 0, address, NULL, 0);
+  span_end(&span, "bind", sockfd, result);
+  return result;
+}
+
+
+
+int accept(int sockfd, struct sockaddr *address, socklen_t *address_len)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring ? trace_now() : 0;
+  int result = libnit_accept(sockfd, address, address_len);
+
+  sock_stats_reset(result);
+
+  if (trace_ring)
+    trace_record(TRACE_ACCEPT, sockfd, start_ns, result, 0, 0, 0, 0,
+                 result >= 0 ? address : NULL, NULL, 0);
+  span_end(&span, "accept", sockfd, result);
+  return result;
+}
+
+
+
+int connect(int sockfd, const struct sockaddr *address, socklen_t address_len)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring ? trace_now() : 0;
+  int result = libnit_connect(sockfd, address, address_len);
+
+  if (trace_ring)
+    trace_record(TRACE_CONNECT, sockfd, start_ns, result, address_len, 0, 0, 0, address, NULL, 0);
+  span_end(&span, "connect", sockfd, result);
+  return result;
+}
+
+
+
+int listen(int sockfd, int backlog)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring ? trace_now() : 0;
+  int result = libnit_listen(sockfd, backlog);
+
+  if (trace_ring)
+    trace_record(TRACE_LISTEN, sockfd, start_ns, result, 0, backlog, 0, 0, NULL, NULL, 0);
+  span_end(&span, "listen", sockfd, result);
+  return result;
+}
+
+
+
+ssize_t send(int sockfd, const void *message, size_t length, int flags)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring || sock_stats_timing ? trace_now() : 0;
+  SOCK_TUNING* st = sock_tuning_get(sockfd, 0);
+  ssize_t result = st ? tuned_send(sockfd, st, message, length, flags) : libnit_send(sockfd, message, length, flags);
+
+  sock_stats_record(sockfd, 1, start_ns, result);
+
+  if (trace_ring)
+    trace_record(TRACE_SEND, sockfd, start_ns, result, length, flags, 0, 0, NULL,
+                 message, result > 0 ? result : 0);
+  span_end(&span, "send", sockfd, result);
+  return result;
+}
+
+
+
+ssize_t sendto(int sockfd, const void *message, size_t length, int flags,
+             const struct sockaddr *dest_addr, socklen_t dest_len)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring || sock_stats_timing ? trace_now() : 0;
+  SOCK_TUNING* st = sock_tuning_get(sockfd, 0);
+  ssize_t result;
+
+  /* Datagrams to an address are never held back. */
+  if (st && !dest_addr)
+    result = tuned_send(sockfd, st, message, length, flags);
+  else {
+    libnit_flush(sockfd);
+    result = libnit_sendto(sockfd, message, length, flags, dest_addr, dest_len);
+  }
+
+  sock_stats_record(sockfd, 1, start_ns, result);
+
+  if (trace_ring)
+    trace_record(TRACE_SENDTO, sockfd, start_ns, result, length, flags, 0, 0, dest_addr,
+                 message, result > 0 ? result : 0);
+  span_end(&span, "sendto", sockfd, result);
+  return result;
+}
+
+
+
+ssize_t recv(int sockfd, void *buffer, size_t length, int flags)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring || sock_stats_timing ? trace_now() : 0;
+  ssize_t result = sock_recv(sockfd, buffer, length, flags);
+
+  sock_stats_record(sockfd, 0, start_ns, result);
+
+  if (trace_ring)
+    trace_record(TRACE_RECV, sockfd, start_ns, result, length, flags, 0, 0, NULL,
+                 buffer, result > 0 ? result : 0);
+  span_end(&span, "recv", sockfd, result);
+  return result;
+}
+
+
+
+ssize_t recvfrom(int sockfd, void *buffer, size_t length,
+             int flags, struct sockaddr *address, socklen_t *address_len)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring || sock_stats_timing ? trace_now() : 0;
+  ssize_t result;
+
+  libnit_flush(sockfd);
+  result = libnit_recvfrom(sockfd, buffer, length, flags, address, address_len);
+
+  sock_stats_record(sockfd, 0, start_ns, result);
+
+  if (trace_ring)
+    trace_record(TRACE_RECVFROM, sockfd, start_ns, result, length, flags, 0, 0,
+                 result >= 0 ? address : NULL, buffer, result > 0 ? result : 0);
+  span_end(&span, "recvfrom", sockfd, result);
+  return result;
+}
+
+
+
+ssize_t write(int sockfd, const void *message, size_t length)
+{
+  SPAN span;
+  uint64_t start_ns;
+  SOCK_TUNING* st;
+  ssize_t result;
+
+  if (!trace_fd_is_socket(sockfd))
+    return libnit_write(sockfd, message, length);
+
+  span = span_begin();
+
+  start_ns = trace_ring || sock_stats_timing ? trace_now() : 0;
+  st = sock_tuning_get(sockfd, 0);
+  result = st ? tuned_send(sockfd, st, message, length, 0) : libnit_write(sockfd, message, length);
+
+  sock_stats_record(sockfd, 1, start_ns, result);
+
+  if (trace_ring)
+    trace_record(TRACE_WRITE, sockfd, start_ns, result, length, 0, 0, 0, NULL,
+                 message, result > 0 ? result : 0);
+  span_end(&span, "write", sockfd, result);
+  return result;
+}
+
+
+
+/* A read() of one of our sockets is a recv() without flags. */
+ssize_t read(int sockfd, void *buffer, size_t length)
+{
+  SPAN span;
+  uint64_t start_ns;
+  ssize_t result;
+
+  if (!trace_fd_is_socket(sockfd))
+    return libnit_read(sockfd, buffer, length);
+
+  span = span_begin();
+
+  start_ns = trace_ring || sock_stats_timing ? trace_now() : 0;
+  result = sock_recv(sockfd, buffer, length, 0);
+
+  sock_stats_record(sockfd, 0, start_ns, result);
+
+  if (trace_ring)
+    trace_record(TRACE_READ, sockfd, start_ns, result, length, 0, 0, 0, NULL,
+                 buffer, result > 0 ? result : 0);
+  span_end(&span, "read", sockfd, result);
+  return result;
+}
+
+
+
+int getsockopt(int sockfd, int level, int option_name,
+	       void *option_value, socklen_t *option_len)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring ? trace_now() : 0;
+  int result = libnit_getsockopt(sockfd, level, option_name, option_value, option_len);
+
+  if (trace_ring)
+    trace_record(TRACE_GETSOCKOPT, sockfd, start_ns, result, 0, level, option_name,
+                 result == 0 && option_len && *option_len == sizeof(int) ? *(int*) option_value : 0,
+                 NULL, NULL, 0);
+  span_end(&span, "getsockopt", sockfd, result);
+  return result;
+}
+
+
+
+int setsockopt(int sockfd, int level, int option_name, const void *option_value, socklen_t option_len)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring ? trace_now() : 0;
+  int result = libnit_setsockopt(sockfd, level, option_name, option_value, option_len);
+
+  if (trace_ring)
+    trace_record(TRACE_SETSOCKOPT, sockfd, start_ns, result, option_len, level, option_name,
+                 option_value && option_len == sizeof(int) ? *(const int*) option_value : 0,
+                 NULL, NULL, 0);
+  span_end(&span, "setsockopt", sockfd, result);
+  return result;
+}
+
+
+
+int shutdown(int sockfd, int how)
+{
+  SPAN span = span_begin();
+  uint64_t start_ns = trace_ring ? trace_now() : 0;
+  int result;
+
+  libnit_flush(sockfd);
+  result = libnit_shutdown(sockfd, how);
+
+  if (trace_ring)
+    trace_record(TRACE_SHUTDOWN, sockfd, start_ns, result, 0, how, 0, 0, NULL, NULL, 0);
+  span_end(&span, "shutdown", sockfd, result);
+  return result;
+}
+
+
+
+int close(int sockfd)
+{
+  SPAN span;
+  uint64_t start_ns;
+  int result;
+
+  if (sockfd >= 0 && sockfd < MAX_SOCK_FD && sock_tuning_dict[sockfd])
+    sock_tuning_release(sockfd);
+
+  if ((!trace_ring && span_fd < 0) || !trace_fd_is_socket(sockfd))
+    return libnit_close(sockfd);
+
+  span = span_begin();
+
+  start_ns = trace_ring ? trace_now() : 0;
+  result = libnit_close(sockfd);
+
+  if (trace_ring)
+    trace_record(TRACE_CLOSE, sockfd, start_ns, result, 0, 0, 0, 0, NULL, NULL, 0);
+  span_end(&span, "close", sockfd, result);
+  return result;
+}
+
+
+
+// ##################### NAME RESOLUTION ##############################
+
+/* Names are resolved by the proxy, so that the shim stack gets to see
+ * them too. The answers (and the names that do not exist) are kept in
+ * dns_cache for dns_max_ttl, or for less if the proxy gives a shorter
+ * TTL. The proxy answers from the system resolver, which does not
+ * tell the TTL of the records, so in practice it is dns_max_ttl.
+ * IPv6 lookups, numeric hosts and lookups made while the proxy is
+ * unreachable go straight to libc.
+ */
+unsigned int dns_cache_slot(const char* key)
+{
+  unsigned int hash = 5381;
+
+  while (*key)
+    hash = hash * 33 ^ (unsigned char) *key++;
+
+  return hash % DNS_CACHE_SIZE;
+}
+
+
+
+int dns_cache_lookup(const char* key, DNS_CACHE_ENTRY* entry)
+{
+  unsigned int slot = dns_cache_slot(key);
+  time_t now = time(NULL);
+  int found = 0;
+  int probe;
+
+  pthread_rwlock_rdlock(&dns_cache_lock);
+
+  for (probe = 0; probe < DNS_CACHE_PROBES; probe++) {
+    DNS_CACHE_ENTRY* cur = &dns_cache[(slot + probe) % DNS_CACHE_SIZE];
+
+    if (cur->expires > now && strcmp(cur->key, key) == 0) {
+      memcpy(entry, cur, sizeof(DNS_CACHE_ENTRY));
+      found = 1;
+      break;
+    }
+  }
+
+  pthread_rwlock_unlock(&dns_cache_lock);
+
+  return found;
+}
+
+
+
+/* Store the entry in the slot that already holds its key, or else in
+ * an expired slot, or else in the one that expires first.
+ */
+void dns_cache_store(DNS_CACHE_ENTRY* entry)
 {
-  char arg_list[20] = "";
-  char buf[10] = "";
-
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+  unsigned int slot = dns_cache_slot(entry->key);
+  DNS_CACHE_ENTRY* victim = NULL;
+  time_t now = time(NULL);
+  int probe;
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+  if (entry->expires <= now)
+    return;
 
-  memset(buf, 0, strlen(buf));
-  my_itoa(level, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+  pthread_rwlock_wrlock(&dns_cache_lock);
 
-  memset(buf, 0, strlen(buf));
-  my_itoa(option_name, buf, 10);
-  strcat(arg_list, buf);
+  for (probe = 0; probe < DNS_CACHE_PROBES; probe++) {
+    DNS_CACHE_ENTRY* cur = &dns_cache[(slot + probe) % DNS_CACHE_SIZE];
 
-  char recv_buf[RECV_SIZE];
-  int err_val;
+    if (strcmp(cur->key, entry->key) == 0) {
+      victim = cur;
+      break;
+    }
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "getsockopt", arg_list, recv_buf, &err_val);
+    if (!victim || cur->expires < victim->expires)
+      victim = cur;
+  }
 
-  if (err_val < 0)
-    return atoi(recv_buf); 
-  else
-    return -1;
+  memcpy(victim, entry, sizeof(DNS_CACHE_ENTRY));
 
+  pthread_rwlock_unlock(&dns_cache_lock);
 }
 
 
 
+/* Forward a lookup over the shared resolver connection. Returns -1 if
+ * there is no proxy to ask.
+ */
+int dns_proxy_call(char* func_call, const char* arg, char* result_buffer, int* err_val)
+{
+  pthread_mutex_lock(&dns_resolver_lock);
+
+  if (dns_resolver_sock < 0)
+    dns_resolver_sock = init_master_sock();
+
+  if (dns_resolver_sock < 0) {
+    pthread_mutex_unlock(&dns_resolver_lock);
+    return -1;
+  }
 
+  forward_api_to_proxy(dns_resolver_sock, func_call, (char*) arg, result_buffer, err_val);
 
-int setsockopt(int sockfd, int level, int option_name, const void *option_value, socklen_t option_len)
-{
-  char arg_list[30] = "";
-  char buf[10] = "";
+  /* The proxy went away, try a new connection next time. */
+  if (*err_val == ECONNRESET && result_buffer[0] == '\0') {
+    release_proxy_channel(dns_resolver_sock);
+    (*libc_close)(dns_resolver_sock);
+    dns_resolver_sock = -1;
+    pthread_mutex_unlock(&dns_resolver_lock);
+    return -1;
+  }
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+  pthread_mutex_unlock(&dns_resolver_lock);
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+  return 0;
+}
 
-  memset(buf, 0, strlen(buf));
-  my_itoa(level, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
-  
-  memset(buf, 0, strlen(buf));
-  my_itoa(option_name, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
 
-  strcat(arg_list, (char*) option_value);
-  strcat(arg_list, ",");
 
+/* Resolve name (or, with reverse set, the dotted address name) into
+ * entry. Returns 0 if it was found, DNS_NOT_FOUND or DNS_TRY_AGAIN if
+ * it was not and DNS_NO_PROXY if libc has to do it.
+ */
+int dns_resolve(const char* name, int reverse, DNS_CACHE_ENTRY* entry)
+{
+  char key[DNS_NAME_LEN + 1];
   char recv_buf[RECV_SIZE];
+  char* saveptr;
+  char* token;
   int err_val;
+  int ttl;
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "setsockopt", arg_list, recv_buf, &err_val);
+  if (strlen(name) >= DNS_NAME_LEN || dns_max_ttl <= 0)
+    return DNS_NO_PROXY;
 
-  if (err_val < 0)
-    return atoi(recv_buf); 
-  else
-    return -1;
+  /* Reverse lookups share the cache under their own keys. */
+  sprintf(key, "%s%s", reverse ? "@" : "", name);
 
-}
+  if (dns_cache_lookup(key, entry)) {
+    LIBNIT_LOG(LIBNIT_LOG_DEBUG, LOG_CAT_DNS, "%s: cached", key);
+    return entry->naddrs > 0 || entry->host[0] ? 0 : DNS_NOT_FOUND;
+  }
 
+  LIBNIT_LOG(LIBNIT_LOG_DEBUG, LOG_CAT_DNS, "%s: asking the proxy", key);
 
+  if (dns_proxy_call(reverse ? "gethostbyaddr" : "gethostbyname", name, recv_buf, &err_val) < 0)
+    return DNS_NO_PROXY;
 
-// ##################### MISCELLANEOUS CALLS ##############################
+  memset(entry, 0, sizeof(DNS_CACHE_ENTRY));
+  strcpy(entry->key, key);
 
-//int getpeername(int sockfd, struct sockaddr *address,
-//		socklen_t *address_len)
-//{
-//
-//  char arg_list[8] = "";
-//  char buf[8] = "";
-//
-//  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
-//
-//  memset(arg_list, 0, strlen(arg_list));
-//  memset(buf, 0, strlen(buf));
-//  my_itoa(repy_sock_fd, buf, 10);
-//  strcat(arg_list, buf);
-//
-//  char recv_buf[RECV_SIZE];
-//  char return_val[10];
-//  int err_val;
-//
-//  // Send the info to the Repy proxy server
-//  forward_api_to_proxy(sockfd, "getpeername", arg_list, recv_buf, &err_val);
-//
-//  if (err_val < 0) {
-//    deserialize_sockaddr(address, recv_buf, return_val);
-//    return atoi(return_val);
-//  }
-//  else
-//    return -1; 
-//
-//}
-//
-//
-//
-//int getsockname(int sockfd, struct sockaddr *address,
-//		socklen_t *address_len)
-//{
-//  char arg_list[8] = "";
-//  char buf[8] = "";
-//
-//  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
-//
-//  memset(arg_list, 0, strlen(arg_list));
-//  memset(buf, 0, strlen(buf));
-//  my_itoa(repy_sock_fd, buf, 10);
-//  strcat(arg_list, buf);
-//
-//  char recv_buf[RECV_SIZE];
-//  char return_val[10];
-//  int err_val;
-//
-//  // Send the info to the Repy proxy server
-//  forward_api_to_proxy(sockfd, "getsockname", arg_list, recv_buf, &err_val);
-//
-//  if (err_val < 0){
-//    deserialize_sockaddr(address, recv_buf, return_val);
-//    return atoi(return_val);
-//  } 
-//  else
-//    return -1;
-//}
+  if (err_val >= 0) {
+    if (err_val != ENOENT)
+      return DNS_TRY_AGAIN;
 
+    entry->expires = time(NULL) + dns_negative_ttl;
+    dns_cache_store(entry);
+    return DNS_NOT_FOUND;
+  }
 
+  /* The reply is "ttl,ip,ip,..." or "ttl,hostname", a ttl of 0 is unknown. */
+  token = strtok_r(recv_buf, ",", &saveptr);
+  ttl = token ? atoi(token) : 0;
+  if (ttl <= 0 || ttl > dns_max_ttl)
+    ttl = dns_max_ttl;
 
+  while ((token = strtok_r(NULL, ",", &saveptr))) {
+    if (reverse) {
+      strncpy(entry->host, token, DNS_NAME_LEN - 1);
+      break;
+    }
 
-/*
-int select(int nfds, fd_set *readfds, fd_set *writefds, 
-	   fd_set *errorfds, struct timeval *timeout)
-{
-  char arg_list[1024] = "";
-  char buf[8] = "";
+    if (entry->naddrs < DNS_MAX_ADDRS && inet_pton(AF_INET, token, &entry->addrs[entry->naddrs]) == 1)
+      entry->naddrs++;
+  }
 
-  // Temporary solution, return everything as being ready.
-  int i;
-  int fd_ready = 0;
-  return nfds;
+  if (entry->naddrs == 0 && !entry->host[0])
+    return DNS_TRY_AGAIN;
 
-  for (i=1; i <= nfds; i++)
-  {
-    if (FD_ISSET(i, readfds)){
-      fd_ready += 1;
-    }
-  }
+  entry->expires = time(NULL) + ttl;
+  dns_cache_store(entry);
 
-  return fd_ready;
-  
-  
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
+  return 0;
+}
 
-  my_itoa(nfds, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
 
-  // Serialize the readable file descriptors.
-  serialize_fdset(nfds, writefds, arg_list);
-  strcat(arg_list, ",");
 
-  // Serialize the writable file descriptors.
-  serialize_fdset(nfds, readfds, arg_list);
-  strcat(arg_list, ",");
+int getaddrinfo(const char *node, const char *service,
+                const struct addrinfo *hints, struct addrinfo **res)
+{
+  DNS_CACHE_ENTRY entry;
+  struct addrinfo numeric_hints;
+  struct addrinfo *head = NULL;
+  struct addrinfo *tail = NULL;
+  struct addrinfo *cur;
+  struct in_addr numeric_addr;
+  char ip_str[INET_ADDRSTRLEN];
+  int status;
+  int i;
 
-  // Serialize the error file descriptors.
-  serialize_fdset(nfds, errorfds, arg_list);
-  strcat(arg_list, ",");
+  init_libc_calls();
 
+  /* Only IPv4 names are ours. We can not fill in a canonical name. */
+  if (!node || inet_pton(AF_INET, node, &numeric_addr) == 1 ||
+      (hints && hints->ai_family != AF_UNSPEC && hints->ai_family != AF_INET) ||
+      (hints && (hints->ai_flags & (AI_NUMERICHOST | AI_CANONNAME))))
+    return (*libc_getaddrinfo)(node, service, hints, res);
 
-  char recv_buf[RECV_SIZE];
-  char return_val[10];
-  int err_val;
+  status = dns_resolve(node, 0, &entry);
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "select", arg_list, recv_buf, &err_val);
+  if (status == DNS_NO_PROXY)
+    return (*libc_getaddrinfo)(node, service, hints, res);
+  else if (status == DNS_NOT_FOUND)
+    return EAI_NONAME;
+  else if (status == DNS_TRY_AGAIN)
+    return EAI_AGAIN;
 
-  // If there was no error, then we deserialize everything and return
-  // the appropriate value.
-  if (err_val < 0){
-    deserialize_select(readfds, writefds, errorfds, recv_buf, return_val);
-    return atoi(return_val);
-  } 
-  else
-    return -1;
- 
-}
-*/
+  /* Let libc build the list from the addresses, so that the service
+   * and the hints are handled as usual and freeaddrinfo() works.
+   */
+  memset(&numeric_hints, 0, sizeof(numeric_hints));
+  if (hints)
+    memcpy(&numeric_hints, hints, sizeof(numeric_hints));
+  numeric_hints.ai_family = AF_INET;
+  numeric_hints.ai_flags |= AI_NUMERICHOST;
+
+  for (i = 0; i < entry.naddrs; i++) {
+    inet_ntop(AF_INET, &entry.addrs[i], ip_str, sizeof(ip_str));
+
+    if ((status = (*libc_getaddrinfo)(ip_str, service, &numeric_hints, &cur)) != 0) {
+      if (head)
+        freeaddrinfo(head);
+      return status;
+    }
 
-/*
-int poll(struct pollfd *fds, nfds_t nfds, int timeout)
-{
-  char arg_list[1024] = "";
-  char buf[8] = "";
-    
-  for (i=0; i <= nfds; i++)
-  {
-    if (FD_ISSET(i, fds))
-      fd_ready += 1;
+    if (tail)
+      tail->ai_next = cur;
+    else
+      head = cur;
+
+    for (tail = cur; tail->ai_next; tail = tail->ai_next);
   }
-    
-  //return fd_ready;
+
+  *res = head;
+  return 0;
 }
-*/
-// ##################### CLOSE CALLS ##############################3
 
-int shutdown(int sockfd, int how)
+
+
+struct hostent *gethostbyname(const char *name)
 {
-  char arg_list[10] = "";
-  char buf[10] = "";
+  /* Like libc, the result is only valid until the next call (in the
+   * same thread).
+   */
+  static __thread struct hostent host;
+  static __thread char host_name[DNS_NAME_LEN];
+  static __thread struct in_addr host_addrs[DNS_MAX_ADDRS];
+  static __thread char* host_addr_list[DNS_MAX_ADDRS + 1];
+  static __thread char* host_aliases[1];
+
+  DNS_CACHE_ENTRY entry;
+  struct in_addr numeric_addr;
+  int status;
+  int i;
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+  init_libc_calls();
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
-  strcat(arg_list, ",");
+  if (!name || inet_pton(AF_INET, name, &numeric_addr) == 1)
+    return (*libc_gethostbyname)(name);
 
-  memset(buf, 0, strlen(buf));
-  my_itoa(how, buf, 10);
-  strcat(arg_list, buf);
+  status = dns_resolve(name, 0, &entry);
 
-  char recv_buf[RECV_SIZE];
-  int err_val;
+  if (status == DNS_NO_PROXY)
+    return (*libc_gethostbyname)(name);
+  else if (status != 0) {
+    h_errno = status == DNS_NOT_FOUND ? HOST_NOT_FOUND : TRY_AGAIN;
+    return NULL;
+  }
 
-  // Send the info to the Repy proxy server
-  forward_api_to_proxy(sockfd, "shutdown", arg_list, recv_buf, &err_val);
+  strcpy(host_name, name);
+  host_aliases[0] = NULL;
 
-  if (err_val < 0)
-    return atoi(recv_buf); 
-  else
-    return -1;	
-}
+  for (i = 0; i < entry.naddrs; i++) {
+    host_addrs[i] = entry.addrs[i];
+    host_addr_list[i] = (char*) &host_addrs[i];
+  }
+  host_addr_list[i] = NULL;
+
+  host.h_name = host_name;
+  host.h_aliases = host_aliases;
+  host.h_addrtype = AF_INET;
+  host.h_length = sizeof(struct in_addr);
+  host.h_addr_list = host_addr_list;
 
+  return &host;
+}
 
 
 
-int close(int sockfd)
+int getnameinfo(const struct sockaddr *sa, socklen_t salen,
+                char *host, socklen_t hostlen,
+                char *serv, socklen_t servlen, int flags)
 {
+  DNS_CACHE_ENTRY entry;
+  char ip_str[INET_ADDRSTRLEN];
+  int status;
+  int serv_status;
 
-  char arg_list[10] = "";
-  char buf[10] = "";
+  init_libc_calls();
 
-  int repy_sock_fd = socket_fd_dict[sockfd % MAX_SOCK_FD];
+  if (!host || hostlen == 0 || (flags & NI_NUMERICHOST) ||
+      !sa || sa->sa_family != AF_INET || salen < sizeof(struct sockaddr_in))
+    return (*libc_getnameinfo)(sa, salen, host, hostlen, serv, servlen, flags);
 
-  memset(arg_list, 0, strlen(arg_list));
-  memset(buf, 0, strlen(buf));
-  my_itoa(repy_sock_fd, buf, 10);
-  strcat(arg_list, buf);
+  inet_ntop(AF_INET, &((struct sockaddr_in*) sa)->sin_addr, ip_str, sizeof(ip_str));
+  status = dns_resolve(ip_str, 1, &entry);
 
-  char recv_buf[RECV_SIZE];
-  int err_val;
+  if (status == DNS_NO_PROXY)
+    return (*libc_getnameinfo)(sa, salen, host, hostlen, serv, servlen, flags);
 
-  // Send the info to the Repy proxy server
-  printf("close: sockfd = %d\n", sockfd);
-  fflush(stdout);
-  printf("close: before forward_api_to_proxy\n");
-  fflush(stdout);
-  forward_api_to_proxy(sockfd, "close", arg_list, recv_buf, &err_val);
-  printf("close: after forward_api_to_proxy\n");
-  fflush(stdout);
+  /* libc still takes care of the service. */
+  if (serv && servlen > 0 &&
+      (serv_status = (*libc_getnameinfo)(sa, salen, NULL, 0, serv, servlen, flags)) != 0)
+    return serv_status;
 
-  if (err_val == ERRBADFD)
-    return (*libc_close)(sockfd);
-  else if (err_val < 0)
-    return atoi(recv_buf); 
-  else
-    return -1;	
+  if (status != 0) {
+    if (flags & NI_NAMEREQD)
+      return status == DNS_TRY_AGAIN ? EAI_AGAIN : EAI_NONAME;
+    strcpy(entry.host, ip_str);
+  }
+
+  if (strlen(entry.host) >= hostlen)
+    return EAI_OVERFLOW;
+
+  strcpy(host, entry.host);
+  return 0;
 }
 
 
@@ -0,0 +1,127 @@
+/* The interface of libnetworkinterpose.so for applications that know
+ * they may run under it. The calls are weak symbols: when the library
+ * is not preloaded they are NULL, so check libnit_present() (or the
+ * call itself) before using them:
+ *
+ *   #include "libnit.h"
+ *
+ *   if (libnit_present()) {
+ *     libnit_set_mode(fd, LIBNIT_MODE_COALESCE, 16384);
+ *     ...
+ *     libnit_flush(fd);
+ *   }
+ *
+ * All the calls return 0 (libnit_submit() the number of completions)
+ * on success and -1 with errno set on failure.
+ */
+#ifndef LIBNIT_H
+#define LIBNIT_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifdef LIBNIT_IMPLEMENTATION
+#  define LIBNIT_API __attribute__((visibility("default")))
+#else
+#  define LIBNIT_API __attribute__((weak))
+#endif
+
+
+/* The counters libnit keeps for every socket since it was created.
+ * The times are spent inside the calls, including the trip to the
+ * proxy, so send_ns / send_calls is the mean send latency. They are
+ * only measured when LIBNIT_STATS_TIMING=1, and stay 0 otherwise.
+ */
+struct libnit_stats
+{
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t send_calls;
+  uint64_t recv_calls;
+  uint64_t errors;
+  uint64_t send_ns;
+  uint64_t recv_ns;
+  uint64_t max_send_ns;
+  uint64_t max_recv_ns;
+  uint64_t send_pending;    /* Bytes held back by write coalescing. */
+  uint64_t recv_buffered;   /* Bytes read ahead and not received yet. */
+};
+
+
+/* The per-socket modes and what their value means:
+ *   LIBNIT_MODE_COALESCE    hold back small sends until this many bytes
+ *                           are pending (0 sends every call right away).
+ *                           Pending data also goes out when the socket
+ *                           receives, shuts down or closes, and on
+ *                           libnit_flush(). Applications that wait in
+ *                           poll() or select() must flush first.
+ *   LIBNIT_MODE_READ_AHEAD  ask the proxy for at least this many bytes
+ *                           per receive and keep the rest for the next
+ *                           ones (0 turns it off). poll() and select()
+ *                           do not see the data that was read ahead, so
+ *                           this suits blocking readers.
+ *   LIBNIT_MODE_BYPASS      1 makes the socket a plain libc socket that
+ *                           never goes through the proxy. Only sockets
+ *                           that have not been used yet can be bypassed.
+ */
+#define LIBNIT_MODE_COALESCE 1
+#define LIBNIT_MODE_READ_AHEAD 2
+#define LIBNIT_MODE_BYPASS 3
+
+
+/* A batch of socket operations for libnit_submit(). Every entry of
+ * the submission array is completed in the entry of the completion
+ * array with the same index. The operations on sockets of the same
+ * proxy cost a single exchange with it, they run in the order they
+ * were submitted. A receive never waits: if no data
+ * is there yet it completes with -1 and EAGAIN, like a recv() with
+ * MSG_DONTWAIT, and can be submitted again later. Closes run last,
+ * with close(). Sockets that are not proxied (bypassed, relayed or
+ * native ones) are handled right away with the usual calls.
+ * Sockets connected in a batch are not relayed, so their data can be
+ * batched too.
+ */
+#define LIBNIT_OP_SEND 1
+#define LIBNIT_OP_RECV 2
+#define LIBNIT_OP_CONNECT 3
+#define LIBNIT_OP_SHUTDOWN 4
+#define LIBNIT_OP_CLOSE 5
+
+struct libnit_sqe
+{
+  int opcode;
+  int fd;
+  void* buf;                    /* The data to send, or room for the data received. */
+  size_t len;
+  int flags;                    /* send/recv flags, or how for a shutdown. */
+  const struct sockaddr* addr;  /* The address to connect to. */
+  socklen_t addrlen;
+  uint64_t user_data;           /* Passed on to the completion. */
+};
+
+struct libnit_cqe
+{
+  uint64_t user_data;
+  long result;                  /* What the call would have returned. */
+  int err;                      /* errno, if result is -1. */
+};
+
+
+int libnit_get_stats(int fd, struct libnit_stats* stats) LIBNIT_API;
+int libnit_set_mode(int fd, int mode, long value) LIBNIT_API;
+int libnit_get_mode(int fd, int mode, long* value) LIBNIT_API;
+int libnit_flush(int fd) LIBNIT_API;
+int libnit_submit(const struct libnit_sqe* sqes, int count, struct libnit_cqe* cqes) LIBNIT_API;
+
+
+/* Returns 1 if libnetworkinterpose.so is loaded. The address goes
+ * through a volatile pointer, so that the compiler neither folds the
+ * check nor warns about it where the symbol is defined.
+ */
+static inline int libnit_present(void)
+{
+  int (* volatile get_stats)(int, struct libnit_stats*) = libnit_get_stats;
+  return get_stats != 0;
+}
+
+#endif
@@ -0,0 +1,384 @@
+/* libnit_codec.so frames and compresses the TCP streams of the
+ * CompressionShim natively. The proxy loads it with ctypes (see
+ * repylib/compressionshim.repy), which lets go of the interpreter lock
+ * for the length of every call. The blocks are the ones of the shim:
+ *
+ *   <length of body>,<zlib data>T
+ *
+ * so either end may use the codec, the python shim or the native shim
+ * engine of libnetworkinterpose.so. The blocks of a large send are
+ * compressed in parallel by up to LIBNIT_CODEC_THREADS threads
+ * (default: one per core): the calling thread and a pool of workers
+ * that is started on first use and shared by all the callers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define CODEC_MAX_THREADS 16
+
+/* Below this many blocks a send is compressed on the calling thread. */
+#define CODEC_PARALLEL_BLOCKS 4
+
+/* The room the header of a block takes at most. */
+#define CODEC_HEADER_SIZE 24
+
+
+#define CODEC_JOB_QUEUED 0
+#define CODEC_JOB_RUNNING 1
+#define CODEC_JOB_DONE 2
+
+
+/* The part of a send one thread compresses: the blocks from first to
+ * last (excluded), each into its own slot of the scratch buffer.
+ * Queued jobs wait for a worker in codec_queue, linked through next.
+ */
+typedef struct codec_job
+{
+  const char* data;
+  long len;
+  long block_size;
+  int level;
+  long first;
+  long last;
+  char* scratch;
+  long slot_size;
+  uLongf* body_lens;
+  int failed;
+  int state;
+  struct codec_job* next;
+} CODEC_JOB;
+
+
+long codec_encode_bound(long len, long block_size);
+long codec_encode(const char* data, long len, long block_size, int level, char* out, long out_cap);
+long codec_decode(const char* in, long len, char* out, long out_cap, long* consumed);
+
+void* codec_compress_blocks(void* arg);
+void* codec_worker(void* unused);
+
+int codec_threads = 0;
+pthread_once_t codec_once = PTHREAD_ONCE_INIT;
+
+/* The jobs waiting for a worker. codec_work wakes the workers up,
+ * codec_done the callers waiting for their jobs to finish.
+ */
+CODEC_JOB* codec_queue = NULL;
+pthread_mutex_t codec_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t codec_work = PTHREAD_COND_INITIALIZER;
+pthread_cond_t codec_done = PTHREAD_COND_INITIALIZER;
+
+
+
+void codec_init()
+{
+  char* threads_str = getenv("LIBNIT_CODEC_THREADS");
+  pthread_attr_t attr;
+  pthread_t thread;
+  int i;
+
+  codec_threads = threads_str ? atoi(threads_str) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (codec_threads < 1)
+    codec_threads = 1;
+  if (codec_threads > CODEC_MAX_THREADS)
+    codec_threads = CODEC_MAX_THREADS;
+
+  /* The callers work too, so one thread less is enough. Should some
+   * of them not start, the callers run their jobs themselves.
+   */
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (i = 1; i < codec_threads; i++)
+    pthread_create(&thread, &attr, codec_worker, NULL);
+
+  pthread_attr_destroy(&attr);
+}
+
+
+
+/* Run the jobs of codec_queue, for as long as the process lives. */
+void* codec_worker(void* unused)
+{
+  CODEC_JOB* job;
+
+  pthread_mutex_lock(&codec_lock);
+
+  while (1) {
+    while (!codec_queue)
+      pthread_cond_wait(&codec_work, &codec_lock);
+
+    job = codec_queue;
+    codec_queue = job->next;
+    job->state = CODEC_JOB_RUNNING;
+    pthread_mutex_unlock(&codec_lock);
+
+    codec_compress_blocks(job);
+
+    pthread_mutex_lock(&codec_lock);
+    job->state = CODEC_JOB_DONE;
+    pthread_cond_broadcast(&codec_done);
+  }
+
+  return NULL;
+}
+
+
+
+/* Take job off codec_queue if no worker has picked it up yet. The
+ * caller holds codec_lock. Returns 1 if it did.
+ */
+int codec_dequeue(CODEC_JOB* job)
+{
+  CODEC_JOB** link;
+
+  if (job->state != CODEC_JOB_QUEUED)
+    return 0;
+
+  for (link = &codec_queue; *link != job; link = &(*link)->next)
+    ;
+
+  *link = job->next;
+  job->state = CODEC_JOB_RUNNING;
+  return 1;
+}
+
+
+
+/* The most bytes codec_encode() can write for len bytes of data. */
+long codec_encode_bound(long len, long block_size)
+{
+  long blocks;
+
+  if (len <= 0 || block_size <= 0)
+    return 0;
+
+  blocks = (len + block_size - 1) / block_size;
+  return blocks * (CODEC_HEADER_SIZE + (long) compressBound(block_size) + 1);
+}
+
+
+
+void* codec_compress_blocks(void* arg)
+{
+  CODEC_JOB* job = (CODEC_JOB*) arg;
+  long block;
+  long offset;
+  long block_len;
+
+  for (block = job->first; block < job->last; block++) {
+    offset = block * job->block_size;
+    block_len = job->len - offset < job->block_size ? job->len - offset : job->block_size;
+    job->body_lens[block] = job->slot_size;
+
+    if (compress2((Bytef*) job->scratch + block * job->slot_size, &job->body_lens[block],
+                  (const Bytef*) job->data + offset, block_len, job->level) != Z_OK) {
+      job->failed = 1;
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+
+
+/* Compress len bytes of data into blocks of block_size with the given
+ * zlib level, framed like the CompressionShim does. Returns the number
+ * of bytes written to out, or -1 on failure (e.g. out_cap is smaller
+ * than codec_encode_bound()).
+ */
+long codec_encode(const char* data, long len, long block_size, int level, char* out, long out_cap)
+{
+  CODEC_JOB jobs[CODEC_MAX_THREADS];
+  long blocks;
+  long slot_size;
+  long per_thread;
+  long block;
+  long out_len = 0;
+  char* scratch;
+  uLongf* body_lens;
+  int thread_count;
+  int failed = 0;
+  int i;
+
+  pthread_once(&codec_once, codec_init);
+
+  if (len <= 0)
+    return 0;
+  if (block_size <= 0 || out_cap < codec_encode_bound(len, block_size))
+    return -1;
+
+  blocks = (len + block_size - 1) / block_size;
+  slot_size = compressBound(block_size);
+  scratch = malloc(blocks * slot_size);
+  body_lens = malloc(blocks * sizeof(uLongf));
+
+  if (!scratch || !body_lens) {
+    free(scratch);
+    free(body_lens);
+    return -1;
+  }
+
+  thread_count = blocks >= CODEC_PARALLEL_BLOCKS ? codec_threads : 1;
+  if (thread_count > blocks)
+    thread_count = blocks;
+  per_thread = (blocks + thread_count - 1) / thread_count;
+
+  for (i = 0; i < thread_count; i++) {
+    jobs[i].data = data;
+    jobs[i].len = len;
+    jobs[i].block_size = block_size;
+    jobs[i].level = level;
+    jobs[i].first = i * per_thread;
+    jobs[i].last = (i + 1) * per_thread < blocks ? (i + 1) * per_thread : blocks;
+    jobs[i].scratch = scratch;
+    jobs[i].slot_size = slot_size;
+    jobs[i].body_lens = body_lens;
+    jobs[i].failed = 0;
+    jobs[i].state = CODEC_JOB_QUEUED;
+    jobs[i].next = NULL;
+  }
+
+  /* The workers get every share but the first, which is ours. */
+  if (thread_count > 1) {
+    pthread_mutex_lock(&codec_lock);
+    for (i = thread_count - 1; i >= 1; i--) {
+      jobs[i].next = codec_queue;
+      codec_queue = &jobs[i];
+    }
+    pthread_cond_broadcast(&codec_work);
+    pthread_mutex_unlock(&codec_lock);
+  }
+
+  codec_compress_blocks(&jobs[0]);
+
+  /* Then we take back the shares no worker got to (all of them if the
+   * workers are busy with other sends) and wait for the rest.
+   */
+  pthread_mutex_lock(&codec_lock);
+
+  for (i = 1; i < thread_count; i++) {
+    if (codec_dequeue(&jobs[i])) {
+      pthread_mutex_unlock(&codec_lock);
+      codec_compress_blocks(&jobs[i]);
+      pthread_mutex_lock(&codec_lock);
+      jobs[i].state = CODEC_JOB_DONE;
+    }
+
+    while (jobs[i].state != CODEC_JOB_DONE)
+      pthread_cond_wait(&codec_done, &codec_lock);
+  }
+
+  pthread_mutex_unlock(&codec_lock);
+
+  for (i = 0; i < thread_count; i++)
+    failed |= jobs[i].failed;
+
+  /* Frame the blocks in order. */
+  for (block = 0; block < blocks && !failed; block++) {
+    out_len += sprintf(out + out_len, "%lu,", (unsigned long) body_lens[block] + 1);
+    memcpy(out + out_len, scratch + block * slot_size, body_lens[block]);
+    out_len += body_lens[block];
+    out[out_len++] = 'T';
+  }
+
+  free(scratch);
+  free(body_lens);
+
+  return failed ? -1 : out_len;
+}
+
+
+
+/* Decompress the complete blocks at the start of in into out, the way
+ * CompressionShim._reconstruct_blocks() does: blocks tagged 'F' are
+ * dropped and an incomplete block is left for later. *consumed is set
+ * to the bytes of in that were used up. Returns the number of bytes
+ * written to out, -1 if not even the first block fits in out_cap, or
+ * -2 if in is not a valid stream.
+ */
+long codec_decode(const char* in, long len, char* out, long out_cap, long* consumed)
+{
+  z_stream stream;
+  long pos = 0;
+  long out_len = 0;
+  long body_start;
+  long block_len;
+  int result = 0;
+
+  *consumed = 0;
+
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit(&stream) != Z_OK)
+    return -2;
+
+  while (pos < len) {
+    block_len = 0;
+    body_start = pos;
+
+    /* The header: digits and a comma, or an 'F' if it was cut short. */
+    while (body_start < len && in[body_start] >= '0' && in[body_start] <= '9')
+      block_len = block_len * 10 + in[body_start++] - '0';
+
+    if (body_start == len)
+      break;
+
+    if (in[body_start] == 'F') {
+      pos = body_start + 1;
+      *consumed = pos;
+      continue;
+    }
+
+    if (in[body_start] != ',') {
+      result = -2;
+      break;
+    }
+
+    body_start++;
+
+    if (body_start + block_len > len)
+      break;
+
+    if (block_len < 1 || (in[body_start + block_len - 1] != 'T' && in[body_start + block_len - 1] != 'F') ||
+        (block_len == 1 && in[body_start] == 'T')) {
+      result = -2;
+      break;
+    }
+
+    if (in[body_start + block_len - 1] == 'T') {
+      inflateReset(&stream);
+      stream.next_in = (Bytef*) in + body_start;
+      stream.avail_in = block_len - 1;
+      stream.next_out = (Bytef*) out + out_len;
+      stream.avail_out = out_cap - out_len;
+
+      result = inflate(&stream, Z_FINISH);
+
+      /* Out of room: leave this block for the next call. */
+      if ((result == Z_BUF_ERROR || result == Z_OK) && stream.avail_out == 0) {
+        result = out_len ? 0 : -1;
+        break;
+      }
+
+      if (result != Z_STREAM_END) {
+        result = -2;
+        break;
+      }
+
+      result = 0;
+      out_len = out_cap - stream.avail_out;
+    }
+
+    pos = body_start + block_len;
+    *consumed = pos;
+  }
+
+  inflateEnd(&stream);
+
+  return result < 0 ? result : out_len;
+}
@@ -0,0 +1,357 @@
+/* libnit_replay plays back the call traces that libnetworkinterpose.so
+ * records with LIBNIT_TRACE (see libnit_trace.h). Run it under the
+ * interposer to send the recorded traffic through a proxy:
+ *
+ *   $ LD_PRELOAD=./libnetworkinterpose.so ./libnit_replay -n 10 -c 127.0.0.1:8080 trace.*.trace
+ *
+ * Every trace (times -n copies) is replayed in a thread of its own.
+ * The calls keep their recorded timing, scaled by -s (2 is twice as
+ * fast, 0 is as fast as possible). -c sends all the connections to
+ * another server. The data that is sent is the recorded payload, if
+ * any, padded to the recorded size. Receives only happen where the
+ * original call received data, so replaying a trace against a server
+ * that answers less than the original one may block.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "libnit_trace.h"
+
+#define MAX_REPLAY_FD 1024
+
+
+typedef struct replay_trace
+{
+  char* path;
+  TRACE_HEADER* header;
+  TRACE_RECORD* records;
+  size_t map_size;
+} REPLAY_TRACE;
+
+
+typedef struct replay_job
+{
+  REPLAY_TRACE* trace;
+  int copy;
+  pthread_t thread;
+  long calls;
+  long failures;
+} REPLAY_JOB;
+
+
+double replay_speed = 1.0;
+int redirect_connect = 0;
+struct sockaddr_in redirect_addr;
+
+
+
+uint64_t replay_now()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+
+
+/* Map a trace file and check that we understand it. */
+int load_trace(char* path, REPLAY_TRACE* trace)
+{
+  struct stat st;
+  void* map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    return -1;
+  }
+
+  if ((size_t) st.st_size < sizeof(TRACE_HEADER) ||
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    fprintf(stderr, "%s: not a trace file\n", path);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  trace->path = path;
+  trace->header = (TRACE_HEADER*) map;
+  trace->records = (TRACE_RECORD*) (trace->header + 1);
+  trace->map_size = st.st_size;
+
+  if (trace->header->magic != TRACE_MAGIC || trace->header->version != TRACE_VERSION ||
+      trace->header->record_size != sizeof(TRACE_RECORD) ||
+      sizeof(TRACE_HEADER) + (size_t) trace->header->capacity * sizeof(TRACE_RECORD) > trace->map_size) {
+    fprintf(stderr, "%s: unsupported trace format\n", path);
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+
+void fill_sockaddr(TRACE_RECORD* record, struct sockaddr_in* address, int use_redirect)
+{
+  if (use_redirect && redirect_connect) {
+    memcpy(address, &redirect_addr, sizeof(struct sockaddr_in));
+    return;
+  }
+
+  memset(address, 0, sizeof(struct sockaddr_in));
+  address->sin_family = AF_INET;
+  address->sin_addr.s_addr = record->addr;
+  address->sin_port = record->port;
+}
+
+
+
+/* Replay a single record. fd_map translates the fds of the trace into
+ * ours. Returns the result of the call.
+ */
+long replay_record(TRACE_RECORD* record, int* fd_map, char** buf, size_t* buf_cap)
+{
+  struct sockaddr_in address;
+  socklen_t address_len = sizeof(address);
+  int fd = record->fd >= 0 && record->fd < MAX_REPLAY_FD ? fd_map[record->fd] : -1;
+  size_t length = record->result > 0 ? (size_t) record->result : record->length;
+  long result = 0;
+  int option_value;
+
+  if (record->opcode != TRACE_SOCKET && fd < 0)
+    return 0;
+
+  /* Make room for the data of a send or receive. */
+  if (length > *buf_cap) {
+    char* new_buf = realloc(*buf, length);
+    if (!new_buf)
+      return -1;
+    *buf = new_buf;
+    *buf_cap = length;
+  }
+
+  switch (record->opcode) {
+  case TRACE_SOCKET:
+    if (record->result < 0 || record->result >= MAX_REPLAY_FD)
+      return 0;
+    result = socket(record->args[0], record->args[1], record->args[2]);
+    fd_map[record->result] = result;
+    break;
+
+  case TRACE_BIND:
+    fill_sockaddr(record, &address, 0);
+    result = bind(fd, (struct sockaddr*) &address, sizeof(address));
+    break;
+
+  case TRACE_LISTEN:
+    result = listen(fd, record->args[0]);
+    break;
+
+  case TRACE_ACCEPT:
+    if (record->result < 0 || record->result >= MAX_REPLAY_FD)
+      return 0;
+    result = accept(fd, (struct sockaddr*) &address, &address_len);
+    fd_map[record->result] = result;
+    break;
+
+  case TRACE_CONNECT:
+    fill_sockaddr(record, &address, 1);
+    result = connect(fd, (struct sockaddr*) &address, sizeof(address));
+    break;
+
+  case TRACE_SEND:
+  case TRACE_SENDTO:
+  case TRACE_WRITE:
+    memset(*buf, 'x', length);
+    memcpy(*buf, record->payload, record->payload_len < length ? record->payload_len : length);
+
+    if (record->opcode == TRACE_SENDTO && record->addr) {
+      fill_sockaddr(record, &address, 1);
+      result = sendto(fd, *buf, length, record->args[0] | MSG_NOSIGNAL,
+                      (struct sockaddr*) &address, sizeof(address));
+    }
+    else
+      result = send(fd, *buf, length, (record->opcode == TRACE_WRITE ? 0 : record->args[0]) | MSG_NOSIGNAL);
+    break;
+
+  case TRACE_RECV:
+  case TRACE_RECVFROM:
+  case TRACE_READ:
+    /* Do not wait for data that never came the first time. */
+    if (record->result <= 0)
+      return 0;
+    result = recv(fd, *buf, length, record->opcode == TRACE_READ ? 0 : record->args[0]);
+    break;
+
+  case TRACE_SETSOCKOPT:
+    if (record->length != sizeof(int))
+      return 0;
+    option_value = record->args[2];
+    result = setsockopt(fd, record->args[0], record->args[1], &option_value, sizeof(option_value));
+    break;
+
+  case TRACE_GETSOCKOPT:
+    address_len = sizeof(option_value);
+    result = getsockopt(fd, record->args[0], record->args[1], &option_value, &address_len);
+    break;
+
+  case TRACE_SHUTDOWN:
+    result = shutdown(fd, record->args[0]);
+    break;
+
+  case TRACE_CLOSE:
+    result = close(fd);
+    fd_map[record->fd] = -1;
+    break;
+  }
+
+  return result;
+}
+
+
+
+void* replay_thread(void* arg)
+{
+  REPLAY_JOB* job = (REPLAY_JOB*) arg;
+  TRACE_HEADER* header = job->trace->header;
+  uint64_t head = header->head;
+  uint64_t first = head > header->capacity ? head - header->capacity : 0;
+  uint64_t start = replay_now();
+  uint64_t due;
+  uint64_t now;
+  struct timespec delay;
+  int fd_map[MAX_REPLAY_FD];
+  char* buf = NULL;
+  size_t buf_cap = 0;
+  uint64_t index;
+  int fd;
+
+  for (fd = 0; fd < MAX_REPLAY_FD; fd++)
+    fd_map[fd] = -1;
+
+  for (index = first; index < head; index++) {
+    TRACE_RECORD* record = &job->trace->records[index % header->capacity];
+
+    /* Keep the recorded pace. */
+    if (replay_speed > 0) {
+      due = start + (uint64_t) (record->start_ns / replay_speed);
+      now = replay_now();
+
+      if (due > now) {
+        delay.tv_sec = (due - now) / 1000000000ull;
+        delay.tv_nsec = (due - now) % 1000000000ull;
+        nanosleep(&delay, NULL);
+      }
+    }
+
+    job->calls++;
+    if (replay_record(record, fd_map, &buf, &buf_cap) < 0 && record->result >= 0)
+      job->failures++;
+  }
+
+  /* Close whatever the trace left open. */
+  for (fd = 0; fd < MAX_REPLAY_FD; fd++) {
+    if (fd_map[fd] >= 0)
+      close(fd_map[fd]);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+
+
+void usage(char* prog)
+{
+  fprintf(stderr, "Usage: %s [-s speed] [-n copies] [-c ip:port] trace...\n", prog);
+  exit(1);
+}
+
+
+
+int main(int argc, char** argv)
+{
+  REPLAY_TRACE* traces;
+  REPLAY_JOB* jobs;
+  char* port_str;
+  int copies = 1;
+  int trace_count = 0;
+  int job_count = 0;
+  long total_calls = 0;
+  long total_failures = 0;
+  uint64_t start;
+  int opt;
+  int i;
+  int j;
+
+  while ((opt = getopt(argc, argv, "s:n:c:")) != -1) {
+    switch (opt) {
+    case 's':
+      replay_speed = atof(optarg);
+      break;
+    case 'n':
+      copies = atoi(optarg);
+      break;
+    case 'c':
+      if (!(port_str = strrchr(optarg, ':')))
+        usage(argv[0]);
+      *port_str++ = '\0';
+      memset(&redirect_addr, 0, sizeof(redirect_addr));
+      redirect_addr.sin_family = AF_INET;
+      redirect_addr.sin_port = htons(atoi(port_str));
+      if (inet_pton(AF_INET, optarg, &redirect_addr.sin_addr) != 1)
+        usage(argv[0]);
+      redirect_connect = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc || copies <= 0 || replay_speed < 0)
+    usage(argv[0]);
+
+  traces = calloc(argc - optind, sizeof(REPLAY_TRACE));
+  jobs = calloc((size_t) (argc - optind) * copies, sizeof(REPLAY_JOB));
+
+  for (i = optind; i < argc; i++) {
+    if (load_trace(argv[i], &traces[trace_count]) == 0)
+      trace_count++;
+  }
+
+  start = replay_now();
+
+  for (i = 0; i < trace_count; i++) {
+    for (j = 0; j < copies; j++) {
+      jobs[job_count].trace = &traces[i];
+      jobs[job_count].copy = j;
+
+      if (pthread_create(&jobs[job_count].thread, NULL, replay_thread, &jobs[job_count]) == 0)
+        job_count++;
+    }
+  }
+
+  for (i = 0; i < job_count; i++) {
+    pthread_join(jobs[i].thread, NULL);
+    total_calls += jobs[i].calls;
+    total_failures += jobs[i].failures;
+  }
+
+  printf("Replayed %d traces (%d runs): %ld calls, %ld failed, %.3f seconds.\n",
+         trace_count, job_count, total_calls, total_failures,
+         (replay_now() - start) / 1e9);
+
+  return trace_count > 0 ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+/* The binary call trace that libnetworkinterpose.so writes when
+ * LIBNIT_TRACE is set, and that libnit_replay reads back.
+ *
+ * A trace is a file of one TRACE_HEADER followed by a ring of
+ * capacity TRACE_RECORDs. Records are claimed by incrementing head,
+ * so record i lives in slot i % capacity and, once the ring wrapped,
+ * only the last capacity records are left. All the fields are in the
+ * byte order of the machine that wrote the trace.
+ */
+#ifndef LIBNIT_TRACE_H
+#define LIBNIT_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x4c4e5452  /* "LNTR" */
+#define TRACE_VERSION 1
+#define TRACE_PAYLOAD_MAX 64
+#define TRACE_DEFAULT_RECORDS 65536
+
+
+/* The calls that are recorded. */
+enum trace_opcode
+{
+  TRACE_SOCKET = 1,
+  TRACE_BIND,
+  TRACE_ACCEPT,
+  TRACE_CONNECT,
+  TRACE_LISTEN,
+  TRACE_SEND,
+  TRACE_SENDTO,
+  TRACE_RECV,
+  TRACE_RECVFROM,
+  TRACE_WRITE,
+  TRACE_READ,
+  TRACE_GETSOCKOPT,
+  TRACE_SETSOCKOPT,
+  TRACE_SHUTDOWN,
+  TRACE_CLOSE
+};
+
+
+typedef struct trace_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t capacity;
+  uint32_t pid;
+  uint32_t payload_max;     /* The payload bytes kept per record. */
+  uint64_t start_ns;        /* CLOCK_MONOTONIC when the trace began. */
+  volatile uint64_t head;   /* The number of records ever written. */
+} TRACE_HEADER;
+
+
+/* One call. What the args mean depends on the opcode:
+ *   socket          domain, type, protocol
+ *   listen          backlog
+ *   shutdown        how
+ *   send/recv/...   flags
+ *   get/setsockopt  level, option name, option value (if it is an int)
+ * addr and port hold the IPv4 address passed to (or returned by) bind,
+ * connect, accept, sendto and recvfrom, in network byte order.
+ */
+typedef struct trace_record
+{
+  uint64_t start_ns;        /* Relative to the start of the trace. */
+  uint64_t duration_ns;
+  uint64_t length;
+  int64_t result;
+  int32_t opcode;
+  int32_t fd;
+  int32_t err;              /* errno, if the call failed. */
+  int32_t args[3];
+  uint32_t addr;
+  uint16_t port;
+  uint16_t payload_len;
+  unsigned char payload[TRACE_PAYLOAD_MAX];
+} TRACE_RECORD;
+
+#endif
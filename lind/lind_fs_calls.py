@@ -975,15 +975,112 @@ def _istat_helper(inode):
 ##### OPEN  #####
 
 
-# get the next free file descriptor
-def get_next_fd():
+# The closed fds below the lowest fd never used, kept as a binary min-heap
+# so the lowest one comes first.   An fd stays on the heap until someone 
+# asks for an fd while it is in use (it may be handed out more than once 
+# before it is added to the table, just like the old linear scan did).
+# The set keeps an fd from being on the heap twice.
+_freefdheap = []
+_freefdset = set([])
+fd_context = {'nextunusedfd' : STARTINGFD}
+
+# Guards the heap and the step from picking an fd to putting it in the 
+# table.   Only held for that long, so it is never taken around a call that
+# blocks.
+_fdtablelock = createlock()
+
+
+def _fd_heap_push(fd):
+  _freefdheap.append(fd)
+  pos = len(_freefdheap) - 1
+  while pos > 0 and _freefdheap[(pos - 1) / 2] > fd:
+    _freefdheap[pos] = _freefdheap[(pos - 1) / 2]
+    pos = (pos - 1) / 2
+  _freefdheap[pos] = fd
+
+
+def _fd_heap_pop():
+  last = _freefdheap.pop()
+  if not _freefdheap:
+    return last
+  top = _freefdheap[0]
+  pos = 0
+  while 2 * pos + 1 < len(_freefdheap):
+    child = 2 * pos + 1
+    if child + 1 < len(_freefdheap) and _freefdheap[child + 1] < _freefdheap[child]:
+      child += 1
+    if _freefdheap[child] >= last:
+      break
+    _freefdheap[pos] = _freefdheap[child]
+    pos = child
+  _freefdheap[pos] = last
+  return top
+
+
+# get the next free file descriptor.   The caller must hold _fdtablelock.
+def _lowest_free_fd():
   # let's get the next available fd number.   The standard says we need to 
-  # return the lowest open fd number.
-  for fd in range(STARTINGFD, MAX_FD):
+  # return the lowest open fd number.   The closed ones are all lower than
+  # the ones never used.
+  while _freefdheap:
+    fd = _freefdheap[0]
     if not fd in filedescriptortable:
       return fd
+    _fd_heap_pop()
+    _freefdset.discard(fd)
+
+  fd = fd_context['nextunusedfd']
+  while fd < MAX_FD:
+    if not fd in filedescriptortable:
+      fd_context['nextunusedfd'] = fd
+      return fd
+    fd += 1
 
   raise SyscallError("open_syscall","EMFILE","The maximum number of files are open.")
+
+
+# get the next free file descriptor.   It is not taken until something is 
+# put in the table under it, so use _insert_fd to add a new entry.
+def get_next_fd():
+  _fdtablelock.acquire(True)
+  try:
+    return _lowest_free_fd()
+  finally:
+    _fdtablelock.release()
+
+
+# put an entry in the table under the next free file descriptor and return 
+# it.   Two threads can not be given the same fd this way.
+def _insert_fd(entry):
+  _fdtablelock.acquire(True)
+  try:
+    fd = _lowest_free_fd()
+    filedescriptortable[fd] = entry
+    return fd
+  finally:
+    _fdtablelock.release()
+
+
+# put an entry in the table under a given fd (dup2, or a socket that keeps 
+# its fd when another proxy hands it over).   Nobody is handed out that fd 
+# meanwhile.
+def _store_fd(fd, entry):
+  _fdtablelock.acquire(True)
+  try:
+    filedescriptortable[fd] = entry
+  finally:
+    _fdtablelock.release()
+
+
+# make a closed fd available again
+def _release_fd(fd):
+  _fdtablelock.acquire(True)
+  try:
+    if STARTINGFD <= fd < fd_context['nextunusedfd'] and fd not in _freefdset:
+      _freefdset.add(fd)
+      _fd_heap_push(fd)
+  finally:
+    _fdtablelock.release()
   
 
 def open_syscall(path, flags, mode):
@@ -1089,8 +1186,8 @@ def open_syscall(path, flags, mode):
     inode = fastinodelookuptable[truepath]
 
     
-    # get the next fd so we can use it...
-    thisfd = get_next_fd()
+    # make sure there is an fd left before we open anything...
+    get_next_fd()
   
 
     # Note, directories can be opened (to do getdents, etc.).   We shouldn't
@@ -1115,7 +1212,7 @@ def open_syscall(path, flags, mode):
 
     # Add the entry to the table!
 
-    filedescriptortable[thisfd] = {'position':position, 'inode':inode, 'lock':createlock(), 'flags':flags&O_RDWRFLAGS}
+    thisfd = _insert_fd({'position':position, 'inode':inode, 'lock':createlock(), 'flags':flags&O_RDWRFLAGS})
 
     # Done!   Let's return the file descriptor.
     return thisfd
@@ -1456,29 +1553,40 @@ def close_syscall(fd):
     http://linux.die.net/man/2/close
   """
 
-  # BUG: I probably need a filedescriptortable lock to prevent race conditions
   # check the fd
-  if fd not in filedescriptortable:
+  fdentry = filedescriptortable.get(fd)
+  if fdentry is None:
     raise SyscallError("close_syscall","EBADF","Invalid file descriptor.")
   try:
-    if filedescriptortable[fd]['inode'] in [0,1,2]:
+    if fdentry['inode'] in [0,1,2]:
       return 0
   except KeyError:
     pass
   # Acquire the fd lock, if there is one.
-  if 'lock' in filedescriptortable[fd]:
-    filedescriptortable[fd]['lock'].acquire(True)
+  if 'lock' in fdentry:
+    fdentry['lock'].acquire(True)
 
   # ... but always release it...
   try:
-    return _close_helper(fd)
+    # Someone else closed it while we waited for the lock.
+    if filedescriptortable.get(fd) is not fdentry:
+      raise SyscallError("close_syscall","EBADF","Invalid file descriptor.")
+
+    try:
+      return _close_helper(fd)
+
+    finally:
+      # Closing a socket does not change the metadata, so there is nothing 
+      # to persist.
+      if not IS_SOCK_DESC(fd):
+        persist_metadata(METADATAFILENAME)
+      del filedescriptortable[fd]
+      _release_fd(fd)
 
   finally:
-    # ... release the lock, if there is one
-    persist_metadata(METADATAFILENAME)
-    if 'lock' in filedescriptortable[fd]:
-      filedescriptortable[fd]['lock'].release()
-    del filedescriptortable[fd]
+    # ... release the lock, if there is one.
+    if 'lock' in fdentry:
+      fdentry['lock'].release()
 
 
 
@@ -1514,7 +1622,7 @@ def _dup2_helper(oldfd,newfd):
   # NOTE: I am not making a copy here!!!   They intentionally both
   # refer to the same instance because manipulating the position, etc.
   # impacts both.
-  filedescriptortable[newfd] = filedescriptortable[oldfd]
+  _store_fd(newfd, filedescriptortable[oldfd])
 
   return newfd
 
@@ -1561,19 +1669,16 @@ def dup_syscall(fd):
   filedescriptortable[fd]['lock'].acquire(True)
 
   try: 
-    # get the next available file descriptor
+    # put the same entry in the table under the next available file 
+    # descriptor.   NOTE: As with dup2, both refer to the same instance.
     try:
-      nextfd = get_next_fd()
+      return _insert_fd(filedescriptortable[fd])
     except SyscallError, e:
       # If it's an error getting the fd, return our call name instead.
       assert(e[0]=='open_syscall')
     
       raise SyscallError('dup_syscall',e[1],e[2])
   
-    # this does the work.   It should _never_ raise an exception given the
-    # checks we've made...
-    return _dup2_helper(fd, nextfd)
-  
   finally:
     # ... release the lock
     filedescriptortable[fd]['lock'].release()
@@ -110,7 +110,7 @@ LOCK_NB = 4
 PATH_MAX = 4096
 
 #largest file descriptor
-MAX_FD = 1024
+MAX_FD = 65536
 STARTINGFD = 10
 
 
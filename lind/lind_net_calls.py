@@ -47,6 +47,9 @@
 NOTCONNECTED = 128
 CONNECTED = 256
 LISTEN = 512
+# connect() is waiting for the other end.   It does not hold the fd lock
+# while it waits, so this keeps a second connect() out.
+CONNECTING = 1024
 
 # contains open file descriptor information... (keyed by fd)
 # filedescriptortable = {}
@@ -131,96 +134,231 @@ _usableudpportsset = map(int, getresources()[0]['messport'].copy())
 _usedtcpportsset = set([])
 _usabletcpportsset = map(int, getresources()[0]['connport'].copy())
 
-# collect all the port list operations
+# The free ports of each protocol, as a stack we take the last one from.
+# Reserving a port does not take it off the stack (that would cost a 
+# search), so a port on top that is in use is simply dropped when we 
+# next look.   The queued sets keep a port from being stacked twice.
+_freeudpportstack = list(_usableudpportsset)
+_queuedudpportsset = set(_usableudpportsset)
+_freetcpportstack = list(_usabletcpportsset)
+_queuedtcpportsset = set(_usabletcpportsset)
+
+# collect the last port list operations (only printed if something goes 
+# wrong, so there is no reason to keep them all).
 _port_operations_debug = []
+PORTOPERATIONSDEBUGLENGTH = 100
 
-_port_list_lock = createlock()
-# We need a helper that gets an available port...
-# Get the last unused port and return it...
-def _get_available_udp_port():
-  for port in list(_usableudpportsset)[::-1]:
-    if port not in _usedudpportsset:
-      _port_operations_debug.append("suggesting UDP port " + str(port))
+def _note_port_operation(operation):
+  _port_operations_debug.append(operation)
+  if len(_port_operations_debug) > PORTOPERATIONSDEBUGLENGTH:
+    del _port_operations_debug[0]
+
+# Each protocol has its own lock, so TCP and UDP do not wait on each other.
+_udp_port_lock = createlock()
+_tcp_port_lock = createlock()
+
+def _port_lock(protocol):
+  if protocol == IPPROTO_UDP:
+    return _udp_port_lock
+  return _tcp_port_lock
+
+
+# Return the last free port of the stack, dropping the ones in use...
+# The caller must hold the lock of the protocol.
+def _get_available_port_from_stack(portstack, queuedset, usedset):
+  while portstack:
+    port = portstack[-1]
+    if port not in usedset:
       return port
+    portstack.pop()
+    queuedset.discard(port)
+  return None
+
+
+# We need a helper that gets an available port...
+# Get the last unused port and return it...   The caller must hold 
+# _udp_port_lock.
+def _next_udp_port():
+  port = _get_available_port_from_stack(_freeudpportstack, _queuedudpportsset, _usedudpportsset)
+  if port is not None:
+    _note_port_operation("suggesting UDP port " + str(port))
+    return port
   
   # this is probably the closest syscall.   No buffer space available...
   raise SyscallError("_get_available_udp_port","ENOBUFS","No UDP port available")
 
 
 # A verbatim copy of the above...   It's so simple, I guess it's okay to do so
-def _get_available_tcp_port():
-  for port in list(_usabletcpportsset)[::-1]:
-    if port not in _usedtcpportsset:
-      _port_operations_debug.append("suggesting TCP port " + str(port))
-      return port
+def _next_tcp_port():
+  port = _get_available_port_from_stack(_freetcpportstack, _queuedtcpportsset, _usedtcpportsset)
+  if port is not None:
+    _note_port_operation("suggesting TCP port " + str(port))
+    return port
 
   
   # this is probably the closest syscall.   No buffer space available...
   raise SyscallError("_get_available_tcp_port","ENOBUFS","No TCP port available")
 
 
+# Suggest a port without reserving it.   Someone else may take it before 
+# it is used, so to get a port for ourselves call _reserve_localport with 
+# port 0 instead.
+def _get_available_udp_port():
+  _udp_port_lock.acquire(True)
+  try:
+    return _next_udp_port()
+  finally:
+    _udp_port_lock.release()
+
+
+def _get_available_tcp_port():
+  _tcp_port_lock.acquire(True)
+  try:
+    return _next_tcp_port()
+  finally:
+    _tcp_port_lock.release()
+
+
+# Reserve the port.   If the port is 0, pick a free one and reserve it in 
+# one step.
 def _reserve_localport(port, protocol):
-  global _usedtcpportsset
-  global _usedudpportsset
-  
-  _port_list_lock.acquire(True)
+  portlock = _port_lock(protocol)
+  portlock.acquire(True)
   status = True
-  _port_operations_debug.append("Reserving port " + str(port))
-  if protocol == IPPROTO_UDP:
-    if port == 0:
-      port = _get_available_udp_port()
-    if port not in _usedudpportsset:
-      _usedudpportsset.add(port)
-    else:
-      status = False
-  elif protocol == IPPROTO_TCP:
-    if port == 0:
-      port = _get_available_tcp_port()
+  try:
+    _note_port_operation("Reserving port " + str(port))
+    if protocol == IPPROTO_UDP:
+      if port == 0:
+        port = _next_udp_port()
+      if port not in _usedudpportsset:
+        _usedudpportsset.add(port)
+      else:
+        status = False
+    elif protocol == IPPROTO_TCP:
+      if port == 0:
+        port = _next_tcp_port()
 
-    if port not in _usedtcpportsset:
-      _usedtcpportsset.add(port)
-    else:
-      status = False
-  _port_list_lock.release()
+      if port not in _usedtcpportsset:
+        _usedtcpportsset.add(port)
+      else:
+        status = False
+  finally:
+    portlock.release()
   if not status:
     print _port_operations_debug
   return (status, port)
 
+# is the port of this protocol in use?
+def _is_localport_reserved(port, protocol):
+  if protocol == IPPROTO_UDP:
+    return port in _usedudpportsset
+  elif protocol == IPPROTO_TCP:
+    return port in _usedtcpportsset
+  return True
+
 # give a port and protocol, return the port to that portocol's pool
 def _release_localport(port, protocol):
-  global _usedtcpportsset
-  global _usedudpportsset
-  _port_list_lock.acquire(True)
-  _port_operations_debug.append("Releasing port " + str(port))
+  portlock = _port_lock(protocol)
+  portlock.acquire(True)
+  _note_port_operation("Releasing port " + str(port))
 
   try:
     if protocol == IPPROTO_UDP:
       _usedudpportsset.remove(port)
+      if port not in _queuedudpportsset:
+        _queuedudpportsset.add(port)
+        _freeudpportstack.append(port)
     elif protocol == IPPROTO_TCP:
       _usedtcpportsset.remove(port)
+      if port not in _queuedtcpportsset:
+        _queuedtcpportsset.add(port)
+        _freetcpportstack.append(port)
   except KeyError:
     print "Warning: freeing a port which is already free.  Port is", port
     print _port_operations_debug
   finally:
-    _port_list_lock.release()
+    portlock.release()
 
 STARTINGSOCKOBJID = 0
-MAXSOCKOBJID = 1024
+MAXSOCKOBJID = 65536
+
+# The socket object ids that were freed, and the lowest id never used.
+_freesocketobjids = []
+_socketobjid_context = {'next' : STARTINGSOCKOBJID}
+_socketobjid_lock = createlock()
 
 
 # get an available socket object ID...
 def _get_next_socketobjid():
-  for sockobjid in range(STARTINGSOCKOBJID,MAXSOCKOBJID):
+  while _freesocketobjids:
+    sockobjid = _freesocketobjids.pop()
+    if not sockobjid in socketobjecttable:
+      return sockobjid
+
+  while _socketobjid_context['next'] < MAXSOCKOBJID:
+    sockobjid = _socketobjid_context['next']
+    _socketobjid_context['next'] += 1
     if not sockobjid in socketobjecttable:
       return sockobjid
 
   raise SyscallError("_get_next_socketobjid","ENOBUFS","Insufficient buffer space is available to create a new socketobjid")
 
 def _insert_into_socketobjecttable(socketobj):
-  nextentry = _get_next_socketobjid()
-  socketobjecttable[nextentry] = socketobj
+  _socketobjid_lock.acquire(True)
+  try:
+    nextentry = _get_next_socketobjid()
+    socketobjecttable[nextentry] = socketobj
+  finally:
+    _socketobjid_lock.release()
   return nextentry
 
+def _remove_from_socketobjecttable(sockobjid):
+  _socketobjid_lock.acquire(True)
+  try:
+    del socketobjecttable[sockobjid]
+    _freesocketobjids.append(sockobjid)
+  finally:
+    _socketobjid_lock.release()
+
+
+
+# The calls look up the entry of an fd once and work on it from then on, so 
+# that a close in another thread can not make a later lookup fail with a 
+# KeyError.
+def _get_sock_entry(fd, callname):
+  fdentry = filedescriptortable.get(fd)
+  if fdentry is None:
+    raise SyscallError(callname,"EBADF","The file descriptor is invalid.")
+
+  if not IS_SOCK(fdentry['mode']):
+    raise SyscallError(callname,"ENOTSOCK","The descriptor is not a socket.")
+
+  return fdentry
+
+
+# Same, but with the fd lock held.   The lock is only held while the state 
+# of the socket changes, never while a call waits on the network, so the 
+# caller must release it before doing so.
+def _lock_sock_entry(fd, callname):
+  fdentry = _get_sock_entry(fd, callname)
+  fdentry['lock'].acquire(True)
+
+  # it may have been closed while we waited for the lock...
+  if filedescriptortable.get(fd) is not fdentry:
+    fdentry['lock'].release()
+    raise SyscallError(callname,"EBADF","The file descriptor is invalid.")
+
+  return fdentry
+
+
+# Get the socket object of an entry.   It is gone if the socket was closed
+# or shut down since the caller looked at the state.
+def _get_sock_object(fdentry, callname):
+  sockobj = socketobjecttable.get(fdentry.get('socketobjectid'))
+  if sockobj is None:
+    raise SyscallError(callname,"ENOTCONN","The descriptor is not connected.")
+  return sockobj
+
 
 
 #################### The actual system calls...   #############################
@@ -230,19 +368,17 @@ def _insert_into_socketobjecttable(socketobj):
 ##### SOCKET  #####
 
 
-# A private helper that initializes a socket given validated arguments.
-def _socket_initializer(domain,socktype,protocol, blocking=False, cloexec=False):
-  # get a file descriptor
+# A private helper that makes the entry of a new socket.
+def _new_sock_entry(domain,socktype,protocol, blocking=False, cloexec=False):
   flags = 0
   if blocking:
     flags = flags | O_NONBLOCK
   if cloexec:
     flags = flags | O_CLOEXEC
-  newfd = get_next_fd()
   
   # NOTE: I'm intentionally omitting the 'inode' field.  This will make most
   # of the calls I did not change break.
-  filedescriptortable[newfd] = {
+  return {
       'mode':S_IFSOCK|0666, # set rw-rw-rw- perms too. This is what POSIX does.
       'domain':domain,
       'type':socktype,      # I'm using this name because it's used by POSIX.
@@ -257,7 +393,12 @@ def _socket_initializer(domain,socktype,protocol, blocking=False, cloexec=False)
       'errno':0
 # We don't set the ip / ports or socketobjectid because they are unknown now.
   }
-  return newfd
+
+
+# A private helper that initializes a socket given validated arguments.
+def _socket_initializer(domain,socktype,protocol, blocking=False, cloexec=False):
+  # get a file descriptor
+  return _insert_fd(_new_sock_entry(domain,socktype,protocol, blocking, cloexec))
       
 
 
@@ -325,66 +466,72 @@ def bind_syscall(fd,localip,localport):
   """ 
     http://linux.die.net/man/2/bind
   """
-  if fd not in filedescriptortable:
-    raise SyscallError("bind_syscall","EBADF","The file descriptor is invalid.")
+  fdentry = _lock_sock_entry(fd, "bind_syscall")
 
-  if not IS_SOCK(filedescriptortable[fd]['mode']):
-    raise SyscallError("bind_syscall","ENOTSOCK","The descriptor is not a socket.")
-
-  # Am I already bound?
-  if 'localip' in filedescriptortable[fd]:
-    raise SyscallError('bind_syscall','EINVAL',"The socket is already bound to an address")
-
-  intent_to_rebind = False
-
-  # Is someone else already bound to this address?
-  for otherfd in filedescriptortable:
-    # skip ours
-    if fd == otherfd:
-      continue
+  # ... but always release it...
+  try:
+    # Am I already bound?
+    if 'localip' in fdentry:
+      raise SyscallError('bind_syscall','EINVAL',"The socket is already bound to an address")
+
+    intent_to_rebind = False
+
+    # Is someone else already bound to this address?
+    # Nobody else can be bound to a port that is not reserved, so we only 
+    # need to look at the other fds if it is.   This keeps bind from going 
+    # through every open fd.   (Look at a copy, other threads may open and
+    # close fds meanwhile.)
+    if localport != 0 and _is_localport_reserved(localport, fdentry['protocol']):
+      for otherfd, otherentry in filedescriptortable.items():
+        # skip ours
+        if fd == otherfd:
+          continue
 
-    # if not a socket, skip it...
-    if 'domain' not in filedescriptortable[otherfd]:
-      continue
+        # if not a socket, skip it...
+        if 'domain' not in otherentry:
+          continue
 
-    # if the protocol / domain/ type differ, ignore
-    if filedescriptortable[otherfd]['domain'] != filedescriptortable[fd]['domain'] or filedescriptortable[otherfd]['type'] != filedescriptortable[fd]['type'] or filedescriptortable[otherfd]['protocol'] != filedescriptortable[fd]['protocol']:
-      continue
-    
-    # if they are already bound to this address / port
-    if 'localip' in filedescriptortable[otherfd] and filedescriptortable[otherfd]['localip'] == localip and filedescriptortable[otherfd]['localport'] == localport:
-      # is SO_REUSEPORT in effect on both? I think everyone has to set 
-      # SO_REUSEPORT (at least this is true on some OSes.   It's OS dependent)
-      if filedescriptortable[fd]['options'] & filedescriptortable[otherfd]['options'] & SO_REUSEPORT == SO_REUSEPORT:
-        # all is well, continue...
-        intent_to_rebind = True
+        # if the protocol / domain/ type differ, ignore
+        if otherentry['domain'] != fdentry['domain'] or otherentry['type'] != fdentry['type'] or otherentry['protocol'] != fdentry['protocol']:
+          continue
+      
+        # if they are already bound to this address / port
+        if otherentry.get('localip') == localip and otherentry.get('localport') == localport:
+          # is SO_REUSEPORT in effect on both? I think everyone has to set 
+          # SO_REUSEPORT (at least this is true on some OSes.   It's OS dependent)
+          if fdentry['options'] & otherentry['options'] & SO_REUSEPORT == SO_REUSEPORT:
+            # all is well, continue...
+            intent_to_rebind = True
+          else:
+            raise SyscallError('bind_syscall','EADDRINUSE',"Another socket is already bound to this address")
+
+    # BUG (?): hmm, how should I support multiple interfaces?   I could either 
+    # force them to pick the result of getmyip here or could return a different 
+    # error later....   I think I'll wait.
+    if not intent_to_rebind:
+      (ret, localport) = _reserve_localport(localport, fdentry['protocol'])
+      assert ret
+    # If this is a UDP interface, then we should listen for udp datagrams
+    # (there is no 'listen' so the time to start now)...
+    if fdentry['protocol'] == IPPROTO_UDP:
+      if 'socketobjectid' in fdentry:
+        # BUG: I need to avoid leaking sockets, so I should close the previous...
+        raise UnimplementedError("I should close the previous UDP listener when re-binding")
+      if localip == '0.0.0.0':
+        udpsockobj = CompositeUDPSocket('127.0.0.1', getmyip(), localport)
       else:
-        raise SyscallError('bind_syscall','EADDRINUSE',"Another socket is already bound to this address")
-
-  # BUG (?): hmm, how should I support multiple interfaces?   I could either 
-  # force them to pick the result of getmyip here or could return a different 
-  # error later....   I think I'll wait.
-  if not intent_to_rebind:
-    (ret, localport) = _reserve_localport(localport, filedescriptortable[fd]['protocol'])
-    assert ret
-  # If this is a UDP interface, then we should listen for udp datagrams
-  # (there is no 'listen' so the time to start now)...
-  if filedescriptortable[fd]['protocol'] == IPPROTO_UDP:
-    if 'socketobjectid' in filedescriptortable[fd]:
-      # BUG: I need to avoid leaking sockets, so I should close the previous...
-      raise UnimplementedError("I should close the previous UDP listener when re-binding")
-    if localip == '0.0.0.0':
-      udpsockobj = CompositeUDPSocket('127.0.0.1', getmyip(), localport)
-    else:
-      udpsockobj = listenformessage(localip, localport)
-    filedescriptortable[fd]['socketobjectid'] = _insert_into_socketobjecttable(udpsockobj) 
+        udpsockobj = listenformessage(localip, localport)
+      fdentry['socketobjectid'] = _insert_into_socketobjecttable(udpsockobj) 
 
-  # Done!   Let's set the information and bind later since Repy V2 doesn't 
-  # support a separate call for binding...
-  filedescriptortable[fd]['localip']=localip
-  filedescriptortable[fd]['localport']=localport
+    # Done!   Let's set the information and bind later since Repy V2 doesn't 
+    # support a separate call for binding...
+    fdentry['localip']=localip
+    fdentry['localport']=localport
 
-  return 0
+    return 0
+
+  finally:
+    fdentry['lock'].release()
 
 
 
@@ -397,92 +544,128 @@ def bind_syscall(fd,localip,localport):
 ##### CONNECT  #####
 
 
+# A connect that failed goes back to where it started.   The local port is 
+# only released by whoever still owns it: connect, if it reserved the port 
+# itself, or if the fd was closed meanwhile (close only releases the ports of 
+# sockets with a socket object).   A port the socket was bound to stays with 
+# the open socket.
+def _abandon_connect(fd, fdentry, localport, reserved):
+  fdentry['lock'].acquire(True)
+  try:
+    if reserved or filedescriptortable.get(fd) is not fdentry:
+      _release_localport(localport, fdentry['protocol'])
+    fdentry['state'] = NOTCONNECTED
+  finally:
+    fdentry['lock'].release()
+
+
 def connect_syscall(fd,remoteip,remoteport):
   """ 
     http://linux.die.net/man/2/connect
   """
 
-  if fd not in filedescriptortable:
-    raise SyscallError("connect_syscall","EBADF","The file descriptor is invalid.")
+  # The fd lock is held while we look at and change the state, but not while
+  # we wait for the other end.
+  fdentry = _lock_sock_entry(fd, "connect_syscall")
 
-  if not IS_SOCK(filedescriptortable[fd]['mode']):
-    raise SyscallError("connect_syscall","ENOTSOCK","The descriptor is not a socket.")
+  try:
+    if fdentry['state'] == CONNECTING:
+      raise SyscallError("connect_syscall","EALREADY","The descriptor is already connecting.")
 
-  # includes CONNECTED and LISTEN
-  if filedescriptortable[fd]['state'] != NOTCONNECTED:
-    raise SyscallError("connect_syscall","EISCONN","The descriptor is already connected.")
+    # includes CONNECTED and LISTEN
+    if fdentry['state'] != NOTCONNECTED:
+      raise SyscallError("connect_syscall","EISCONN","The descriptor is already connected.")
 
 
-  filedescriptortable[fd]['last_peek'] = ''
+    fdentry['last_peek'] = ''
 
 
-  # What I do depends on the protocol...
-  # If UDP, set the items and return
-  if filedescriptortable[fd]['protocol'] == IPPROTO_UDP:
-    filedescriptortable[fd]['remoteip'] = remoteip
-    filedescriptortable[fd]['remoteport'] = remoteport
-    rc = 0
-    try:
-      a = filedescriptortable[fd]['localip']
-    except KeyError:
-      # if the local IP is not yet set, allocate it and bind to it.
-      rc = bind_syscall(fd, getmyip(), _get_available_udp_port())
-    return rc
+    # What I do depends on the protocol...
+    # If UDP, set the items and return
+    if fdentry['protocol'] == IPPROTO_UDP:
+      fdentry['remoteip'] = remoteip
+      fdentry['remoteport'] = remoteport
+      # if the local IP is not yet set, allocate it and bind to it (after we
+      # let go of the lock, bind takes it too).
+      needbind = 'localip' not in fdentry
 
 
-  # it's TCP!
-  elif filedescriptortable[fd]['protocol'] == IPPROTO_TCP:
+    # it's TCP!
+    elif fdentry['protocol'] == IPPROTO_TCP:
+
+      # Am I already bound?   If not, we'll need to get an ip / port
+      reserved = 'localip' not in fdentry
+      if reserved:
+        localip = getmyip()
+        localport = _reserve_localport(0, fdentry['protocol'])[1]
+      else:
+        localip = fdentry['localip']
+        localport = fdentry['localport']
+
+      fdentry['state'] = CONNECTING
 
-    # Am I already bound?   If not, we'll need to get an ip / port
-    if 'localip' not in filedescriptortable[fd]:
-      localip = getmyip()
-      
-      localport = _get_available_tcp_port()
-      while not _reserve_localport(localport, filedescriptortable[fd]['protocol'])[0]:
-        localport = _get_available_tcp_port()
     else:
-      localip = filedescriptortable[fd]['localip']
-      localport = filedescriptortable[fd]['localport']
+      raise UnimplementedError("Unknown protocol in connect()")
 
+  finally:
+    fdentry['lock'].release()
 
 
-    try:
-      # BUG: The timeout it configurable, right?
-      newsockobj = openconnection(remoteip, remoteport, localip, localport, 10)
+  if fdentry['protocol'] == IPPROTO_UDP:
+    if needbind:
+      return bind_syscall(fd, getmyip(), 0)
+    return 0
 
-    except AddressBindingError, e:
-      _release_localport(localport, filedescriptortable[fd]['protocol'])
-      raise SyscallError('connect_syscall','ENETUNREACH','Network was unreachable because of inability to access local port / IP')
 
-    except InternetConnectivityError, e:
-      _release_localport(localport, filedescriptortable[fd]['protocol'])
-      raise SyscallError('connect_syscall','ENETUNREACH','Network was unreachable because of inability to access local port / IP')
+  try:
+    # BUG: The timeout it configurable, right?
+    newsockobj = openconnection(remoteip, remoteport, localip, localport, 10)
 
-    except TimeoutError, e:
-      _release_localport(localport, filedescriptortable[fd]['protocol'])
-      raise SyscallError('connect_syscall','ETIMEDOUT','Connection timed out')
+  except AddressBindingError, e:
+    _abandon_connect(fd, fdentry, localport, reserved)
+    raise SyscallError('connect_syscall','ENETUNREACH','Network was unreachable because of inability to access local port / IP')
 
-    except DuplicateTupleError, e:
-      _release_localport(localport, filedescriptortable[fd]['protocol'])
-      raise SyscallError('connect_syscall','EADDRINUSE','Network address in use')
+  except InternetConnectivityError, e:
+    _abandon_connect(fd, fdentry, localport, reserved)
+    raise SyscallError('connect_syscall','ENETUNREACH','Network was unreachable because of inability to access local port / IP')
+
+  except TimeoutError, e:
+    _abandon_connect(fd, fdentry, localport, reserved)
+    raise SyscallError('connect_syscall','ETIMEDOUT','Connection timed out')
+
+  except DuplicateTupleError, e:
+    _abandon_connect(fd, fdentry, localport, reserved)
+    raise SyscallError('connect_syscall','EADDRINUSE','Network address in use')
 
-    except ConnectionRefusedError, e:
-      _release_localport(localport, filedescriptortable[fd]['protocol'])
-      raise SyscallError('connect_syscall','ECONNREFUSED','Connection refused.')
+  except ConnectionRefusedError, e:
+    _abandon_connect(fd, fdentry, localport, reserved)
+    raise SyscallError('connect_syscall','ECONNREFUSED','Connection refused.')
+
+  except:
+    _abandon_connect(fd, fdentry, localport, reserved)
+    raise
+
+  fdentry['lock'].acquire(True)
+  try:
+    # closed while we were connecting?   Then nobody can use the connection.
+    if filedescriptortable.get(fd) is not fdentry:
+      newsockobj.close()
+      _release_localport(localport, fdentry['protocol'])
+      raise SyscallError("connect_syscall","EBADF","The file descriptor was closed.")
 
     # fill in the file descriptor table...
-    filedescriptortable[fd]['socketobjectid'] = _insert_into_socketobjecttable(newsockobj)
-    filedescriptortable[fd]['localip'] = localip
-    filedescriptortable[fd]['localport'] = localport
-    filedescriptortable[fd]['remoteip'] = remoteip
-    filedescriptortable[fd]['remoteport'] = remoteport
-    filedescriptortable[fd]['state'] = CONNECTED
-    filedescriptortable[fd]['errno'] = 0
+    fdentry['socketobjectid'] = _insert_into_socketobjecttable(newsockobj)
+    fdentry['localip'] = localip
+    fdentry['localport'] = localport
+    fdentry['remoteip'] = remoteip
+    fdentry['remoteport'] = remoteport
+    fdentry['errno'] = 0
     # change the state and return success
+    fdentry['state'] = CONNECTED
     return 0
 
-  else:
-    raise UnimplementedError("Unknown protocol in connect()")
+  finally:
+    fdentry['lock'].release()
 
     
 
@@ -501,11 +684,7 @@ def sendto_syscall(fd,message, remoteip,remoteport,flags):
     http://linux.die.net/man/2/sendto
   """
 
-  if fd not in filedescriptortable:
-    raise SyscallError("sendto_syscall","EBADF","The file descriptor is invalid.")
-
-  if not IS_SOCK(filedescriptortable[fd]['mode']):
-    raise SyscallError("sendto_syscall","ENOTSOCK","The descriptor is not a socket.")
+  fdentry = _get_sock_entry(fd, "sendto_syscall")
 
   if flags != 0 and flags != MSG_NOSIGNAL:
     raise UnimplementedError("Flags are not understood by sendto!")
@@ -516,24 +695,24 @@ def sendto_syscall(fd,message, remoteip,remoteport,flags):
     print "Warning: sending back to send."
     return send_syscall(fd,message, flags)
 
-  if filedescriptortable[fd]['state'] == CONNECTED or filedescriptortable[fd]['state'] == LISTEN:
+  if fdentry['state'] == CONNECTED or fdentry['state'] == LISTEN:
     raise SyscallError("sendto_syscall","EISCONN","The descriptor is connected.")
 
 
-  if filedescriptortable[fd]['protocol'] == IPPROTO_TCP:
+  if fdentry['protocol'] == IPPROTO_TCP:
     raise SyscallError("sendto_syscall","EISCONN","The descriptor is connection-oriented.")
     
   # What I do depends on the protocol...
   # If UDP, set the items and return
-  if filedescriptortable[fd]['protocol'] == IPPROTO_UDP:
+  if fdentry['protocol'] == IPPROTO_UDP:
 
     # If unspecified, use a new local port / the local ip
-    if 'localip' not in filedescriptortable[fd]:
+    if 'localip' not in fdentry:
       localip = getmyip()
       localport = _get_available_udp_port()
     else:
-      localip = filedescriptortable[fd]['localip']
-      localport = filedescriptortable[fd]['localport']
+      localip = fdentry['localip']
+      localport = fdentry['localport']
 
     try:
       # BUG: The timeout it configurable, right?
@@ -544,8 +723,8 @@ def sendto_syscall(fd,message, remoteip,remoteport,flags):
       raise SyscallError('connect_syscall','EADDRINUSE','Network address in use')
  
     # fill in the file descriptor table...
-    filedescriptortable[fd]['localip'] = localip
-    filedescriptortable[fd]['localport'] = localport
+    fdentry['localip'] = localip
+    fdentry['localport'] = localport
 
 
     # return the characters sent!
@@ -570,29 +749,27 @@ def send_syscall(fd, message, flags):
   """ 
     http://linux.die.net/man/2/send
   """
-  if fd not in filedescriptortable:
-    raise SyscallError("send_syscall","EBADF","The file descriptor is invalid.")
-
-  if not IS_SOCK(filedescriptortable[fd]['mode']):
-    raise SyscallError("send_syscall","ENOTSOCK","The descriptor is not a socket.")
+  # NOTE: No lock is taken on the way to the data, so sends on different 
+  # sockets never wait on each other.
+  fdentry = _get_sock_entry(fd, "send_syscall")
 
   if flags  != 0 and flags != MSG_NOSIGNAL: 
     raise UnimplementedError("Flagss are not understood by send!")
 
-  # includes NOTCONNECTED and LISTEN
-  if  filedescriptortable[fd]['protocol'] == IPPROTO_TCP and filedescriptortable[fd]['state'] != CONNECTED:
+  # includes NOTCONNECTED, CONNECTING and LISTEN
+  if  fdentry['protocol'] == IPPROTO_TCP and fdentry['state'] != CONNECTED:
     raise SyscallError("send_syscall","ENOTCONN","The descriptor is not connected.")
 
 
-  if filedescriptortable[fd]['protocol'] != IPPROTO_TCP and filedescriptortable[fd]['protocol'] != IPPROTO_UDP:
+  if fdentry['protocol'] != IPPROTO_TCP and fdentry['protocol'] != IPPROTO_UDP:
     raise SyscallError("send_syscall","EOPNOTSUPP","send not supported on this protocol.")
     
   # I'll check this anyways, because I later might have multiple protos 
   # supported
-  if filedescriptortable[fd]['protocol'] == IPPROTO_TCP:
+  if fdentry['protocol'] == IPPROTO_TCP:
 
     # get the socket so I can send...
-    sockobj = socketobjecttable[filedescriptortable[fd]['socketobjectid']]
+    sockobj = _get_sock_object(fdentry, "send_syscall")
     
     # retry until it does not block...
     while True:
@@ -600,7 +777,7 @@ def send_syscall(fd, message, flags):
         bytessent = sockobj.send(message)
       # sleep and retry
       except SocketWouldBlockError, e:
-         sleep(RETRYWAITAMOUNT)
+         _wait_for_retry()
         
       except Exception, e:
         # I think this shouldn't happen.   A closed socket should go to
@@ -609,10 +786,10 @@ def send_syscall(fd, message, flags):
 
       # return the characters sent!
       return bytessent
-  elif filedescriptortable[fd]['protocol'] == IPPROTO_UDP:
+  elif fdentry['protocol'] == IPPROTO_UDP:
 
-    remoteip = filedescriptortable[fd]['remoteip']
-    remoteport = filedescriptortable[fd]['remoteport']
+    remoteip = fdentry['remoteip']
+    remoteport = fdentry['remoteport']
 
     bytessent = sendto_syscall(fd, message, remoteip, remoteport, flags)
     return bytessent
@@ -636,6 +813,18 @@ def send_syscall(fd, message, flags):
 # Wait this long between recv calls...
 RETRYWAITAMOUNT = .00001
 
+# The blocking calls wait in a retry loop.   If set, blockedcallhook['check']
+# is called before every retry and may give up the call by raising an
+# exception.   The call has not done anything yet at that point, so it can be
+# made again later.   The proxy uses this to hand its sockets over to another
+# instance (see smart_shim_proxy.py).
+blockedcallhook = {'check':None}
+
+def _wait_for_retry():
+  if blockedcallhook['check'] is not None:
+    blockedcallhook['check']()
+  sleep(RETRYWAITAMOUNT)
+
 
 # Note that this call may be used by recv_syscall since they are so similar
 def recvfrom_syscall(fd,length,flags):
@@ -643,26 +832,23 @@ def recvfrom_syscall(fd,length,flags):
     http://linux.die.net/man/2/recvfrom
   """
 
-  if fd not in filedescriptortable:
-    raise SyscallError("recvfrom_syscall","EBADF","The file descriptor is invalid.")
-
-  if not IS_SOCK(filedescriptortable[fd]['mode']):
-    raise SyscallError("recvfrom_syscall","ENOTSOCK","The descriptor is not a socket.")
+  # NOTE: As with send, no lock is taken on the way to the data.
+  fdentry = _get_sock_entry(fd, "recvfrom_syscall")
 
 
   # What I do depends on the protocol...
-  if filedescriptortable[fd]['protocol'] == IPPROTO_TCP:
+  if fdentry['protocol'] == IPPROTO_TCP:
 
-    # includes NOTCONNECTED and LISTEN
-    if filedescriptortable[fd]['state'] != CONNECTED:
-      raise SyscallError("recvfrom_syscall","ENOTCONN","The descriptor is not connected."+str(filedescriptortable[fd]['state']))
+    # includes NOTCONNECTED, CONNECTING and LISTEN
+    if fdentry['state'] != CONNECTED:
+      raise SyscallError("recvfrom_syscall","ENOTCONN","The descriptor is not connected."+str(fdentry['state']))
     # is this a non-blocking recv OR a nonblocking socket?
     
     # I'm ready to recv, get the socket object...
-    sockobj = socketobjecttable[filedescriptortable[fd]['socketobjectid']]
-    peek = filedescriptortable[fd]['last_peek']
-    remoteip = filedescriptortable[fd]['remoteip']
-    remoteport = filedescriptortable[fd]['remoteport']
+    sockobj = _get_sock_object(fdentry, "recvfrom_syscall")
+    peek = fdentry['last_peek']
+    remoteip = fdentry['remoteip']
+    remoteport = fdentry['remoteport']
     # keep trying to get something until it works (or EOF)...
     while True:
       # if we have previous data from a peek, use that
@@ -677,28 +863,28 @@ def recvfrom_syscall(fd,length,flags):
       # sleep and retry!
       # If O_NONBLOCK was set, we should re-raise this here...
       except SocketWouldBlockError, e:
-        if IS_NONBLOCKING(filedescriptortable[fd]['flags'], flags):
+        if IS_NONBLOCKING(fdentry['flags'], flags):
           raise e
         if peek == '':
-          sleep(RETRYWAITAMOUNT)
+          _wait_for_retry()
           continue
 
       if peek == '':
         if (flags & MSG_PEEK) != 0:
-          filedescriptortable[fd]['last_peek'] = data
+          fdentry['last_peek'] = data
         return remoteip, remoteport, data
 
       peek = peek + data
       if len(peek) <= length:
         ret_data = peek
-        filedescriptortable[fd]['last_peek'] = ''
+        fdentry['last_peek'] = ''
       else:
         ret_data = peek[:length]
-        filedescriptortable[fd]['last_peek'] = peek[length:]
+        fdentry['last_peek'] = peek[length:]
         # savd this data for later?
       if (flags & MSG_PEEK) != 0:
         # print "@@ peek next time"
-        filedescriptortable[fd]['last_peek'] = peek
+        fdentry['last_peek'] = peek
         
       return remoteip, remoteport, ret_data
 
@@ -708,16 +894,16 @@ def recvfrom_syscall(fd,length,flags):
 
 
   # If UDP, recieve a message and return...
-  elif filedescriptortable[fd]['protocol'] == IPPROTO_UDP:
+  elif fdentry['protocol'] == IPPROTO_UDP:
     # BUG / HELP!!!: Calling this with UDP and without binding does something I
     # don't really understand...   It seems to block but I don't know what is 
     # happening.   The socket isn't bound to a valid inode,etc from what I see.
-    if 'localip' not in filedescriptortable[fd]:
+    if 'localip' not in fdentry:
       raise UnimplementedError("BUG / FIXME: Should bind before using UDP to recv / recvfrom")
     
 
     # get the udpsocket object...
-    udpsockobj = socketobjecttable[filedescriptortable[fd]['socketobjectid']]
+    udpsockobj = _get_sock_object(fdentry, "recvfrom_syscall")
 
 
 
@@ -729,7 +915,7 @@ def recvfrom_syscall(fd,length,flags):
       # sleep and retry!
       # If O_NONBLOCK was set, we should re-raise this here...
       except SocketWouldBlockError, e:
-        sleep(RETRYWAITAMOUNT)
+        _wait_for_retry()
 
 
 
@@ -844,83 +1030,81 @@ def listen_syscall(fd,backlog):
     http://linux.die.net/man/2/listen
   """
 
-  if fd not in filedescriptortable:
-    raise SyscallError("listen_syscall","EBADF","The file descriptor is invalid.")
+  fdentry = _lock_sock_entry(fd, "listen_syscall")
 
-  if not IS_SOCK(filedescriptortable[fd]['mode']):
-    raise SyscallError("listen_syscall","ENOTSOCK","The descriptor is not a socket.")
+  # ... but always release it...
+  try:
+    # BUG: I need to check if someone else is already listening here...
 
-  # BUG: I need to check if someone else is already listening here...
 
+    # If UDP, raise an exception
+    if fdentry['protocol'] == IPPROTO_UDP:
+      raise SyscallError("listen_syscall","EOPNOTSUPP","This protocol does not support listening.")
 
-  # If UDP, raise an exception
-  if filedescriptortable[fd]['protocol'] == IPPROTO_UDP:
-    raise SyscallError("listen_syscall","EOPNOTSUPP","This protocol does not support listening.")
 
+    # it's TCP!
+    elif fdentry['protocol'] == IPPROTO_TCP:
 
-  # it's TCP!
-  elif filedescriptortable[fd]['protocol'] == IPPROTO_TCP:
-
-    if filedescriptortable[fd]['state'] == LISTEN:
-      # already done!
-      return 0
+      if fdentry['state'] == LISTEN:
+        # already done!
+        return 0
 
 
-    if 'localip' not in filedescriptortable[fd]:
-      # the real POSIX impl picks a random port and listens on 0.0.0.0.   
-      # I think this is unnecessary to implement.
-      raise UnimplementedError("listen without bind")
+      if 'localip' not in fdentry:
+        # the real POSIX impl picks a random port and listens on 0.0.0.0.   
+        # I think this is unnecessary to implement.
+        raise UnimplementedError("listen without bind")
 
 
-    # If it's connected, this is still allowed, but I won't implement it...
-    if filedescriptortable[fd]['state'] == CONNECTED:
-      # BUG: I would need to close this (if the last) to handle this right...
-      raise UnimplementedError("Listen should close the existing connected socket")
+      # If it's connected, this is still allowed, but I won't implement it...
+      if fdentry['state'] == CONNECTED or fdentry['state'] == CONNECTING:
+        # BUG: I would need to close this (if the last) to handle this right...
+        raise UnimplementedError("Listen should close the existing connected socket")
 
 
-    # Is someone else already listening on this address?   This may happen
-    # with SO_REUSEPORT
-    for otherfd in filedescriptortable:
-      # skip ours
-      if fd == otherfd:
-        continue
+      # Is someone else already listening on this address?   This may happen
+      # with SO_REUSEPORT
+      for otherfd, otherentry in filedescriptortable.items():
+        # skip ours
+        if fd == otherfd:
+          continue
 
-      # if not a socket, skip it...
-      if 'domain' not in filedescriptortable[otherfd]:
-        continue
+        # if not a socket, skip it...
+        if 'domain' not in otherentry:
+          continue
 
-      # if they are not listening, skip it...
-      if filedescriptortable[otherfd]['state'] != LISTEN:
-        continue
+        # if they are not listening, skip it...
+        if otherentry['state'] != LISTEN:
+          continue
 
-      # if the protocol / domain/ type differ, ignore
-      if filedescriptortable[otherfd]['domain'] != filedescriptortable[fd]['domain'] or filedescriptortable[otherfd]['type'] != filedescriptortable[fd]['type'] or filedescriptortable[otherfd]['protocol'] != filedescriptortable[fd]['protocol']:
-        continue
+        # if the protocol / domain/ type differ, ignore
+        if otherentry['domain'] != fdentry['domain'] or otherentry['type'] != fdentry['type'] or otherentry['protocol'] != fdentry['protocol']:
+          continue
 
-      # if they are already bound to this address / port
-      if filedescriptortable[otherfd]['localip'] == filedescriptortable[fd]['localip'] and filedescriptortable[otherfd]['localport'] == filedescriptortable[fd]['localport']:
-        raise SyscallError('bind_syscall','EADDRINUSE',"Another socket is already bound to this address")
+        # if they are already bound to this address / port
+        if otherentry['localip'] == fdentry['localip'] and otherentry['localport'] == fdentry['localport']:
+          raise SyscallError('bind_syscall','EADDRINUSE',"Another socket is already bound to this address")
 
 
 
-    # otherwise, all is well.   Let's set it up!
-    filedescriptortable[fd]['state'] = LISTEN
+      # BUG: I'll let anything go through for now.   I'm fairly sure there will 
+      # be issues I may need to handle later.
+      # #CM: this is really annoying, so for now we bind to local ip
+      if fdentry['localip'] == "0.0.0.0":
+        newsockobj = CompositeTCPSocket('127.0.0.1', getmyip(), fdentry['localport'])
+      else:
+        newsockobj = listenforconnection(fdentry['localip'], fdentry['localport'])
+      fdentry['socketobjectid'] = _insert_into_socketobjecttable(newsockobj)
 
+      # otherwise, all is well.   Change the state and return success
+      fdentry['state'] = LISTEN
+      return 0
 
-    # BUG: I'll let anything go through for now.   I'm fairly sure there will 
-    # be issues I may need to handle later.
-    # #CM: this is really annoying, so for now we bind to local ip
-    if filedescriptortable[fd]['localip'] == "0.0.0.0":
-      newsockobj = CompositeTCPSocket('127.0.0.1', getmyip(), filedescriptortable[fd]['localport'])
     else:
-      newsockobj = listenforconnection(filedescriptortable[fd]['localip'], filedescriptortable[fd]['localport'])
-    filedescriptortable[fd]['socketobjectid'] = _insert_into_socketobjecttable(newsockobj)
+      raise UnimplementedError("Unknown protocol in listen()")
 
-    # change the state and return success
-    return 0
-
-  else:
-    raise UnimplementedError("Unknown protocol in listen()")
+  finally:
+    fdentry['lock'].release()
 
     
 
@@ -945,52 +1129,59 @@ def accept_syscall(fd, flags=0):
     http://linux.die.net/man/2/accept
   """
 
-  if fd not in filedescriptortable:
-    raise SyscallError("accept_syscall","EBADF","The file descriptor is invalid.")
-
-  if not IS_SOCK(filedescriptortable[fd]['mode']):
-    raise SyscallError("accept_syscall","ENOTSOCK","The descriptor is not a socket.")
+  fdentry = _get_sock_entry(fd, "accept_syscall")
 
   blocking = (flags & SOCK_NONBLOCK) != 0
   cloexec = (flags & SOCK_CLOEXEC) != 0
 
   # If UDP, raise an exception
-  if filedescriptortable[fd]['protocol'] == IPPROTO_UDP:
+  if fdentry['protocol'] == IPPROTO_UDP:
     raise SyscallError("accept_syscall","EOPNOTSUPP","This protocol does not support listening.")
 
   # it's TCP!
-  elif filedescriptortable[fd]['protocol'] == IPPROTO_TCP:
+  elif fdentry['protocol'] == IPPROTO_TCP:
 
     # must be listening
-    if filedescriptortable[fd]['state'] != LISTEN:
+    if fdentry['state'] != LISTEN:
       raise SyscallError("accept_syscall","EINVAL","Must call listen before accept.")
 
-    listeningsocket = socketobjecttable[filedescriptortable[fd]['socketobjectid']]
+    listeningsocket = _get_sock_object(fdentry, "accept_syscall")
     
     # now we should loop (block) until we get an incoming connection
     while True:
       try:
-        if connectedsocket != []:
+        # select may have taken a connection for us already...
+        try:
           remoteip, remoteport, acceptedsocket = connectedsocket.pop(0)
-        else:
+        except IndexError:
           remoteip, remoteport, acceptedsocket = listeningsocket.getconnection() 
 
       # sleep and retry
       except SocketWouldBlockError, e:
-        sleep(RETRYWAITAMOUNT)
+        _wait_for_retry()
       else:
 
-        newfd = _socket_initializer(filedescriptortable[fd]['domain'],filedescriptortable[fd]['type'],filedescriptortable[fd]['protocol'], blocking, cloexec)
-        filedescriptortable[newfd]['state'] = CONNECTED
-        filedescriptortable[newfd]['localip'] = filedescriptortable[fd]['localip']
-        newport = _get_available_tcp_port()
-        (ret, newport) = _reserve_localport(newport, IPPROTO_TCP) 
+        # Fill in the whole entry before it goes in the table, so nobody 
+        # sees half of it.
+        newentry = _new_sock_entry(fdentry['domain'],fdentry['type'],fdentry['protocol'], blocking, cloexec)
+        newentry['state'] = CONNECTED
+        newentry['localip'] = fdentry['localip']
+        (ret, newport) = _reserve_localport(0, IPPROTO_TCP) 
         assert ret
-        filedescriptortable[newfd]['localport'] = newport
-        filedescriptortable[newfd]['remoteip'] = remoteip
-        filedescriptortable[newfd]['remoteport'] = remoteport
-        filedescriptortable[newfd]['socketobjectid'] = _insert_into_socketobjecttable(acceptedsocket)
-        filedescriptortable[newfd]['last_peek'] = ''
+        newentry['localport'] = newport
+        newentry['remoteip'] = remoteip
+        newentry['remoteport'] = remoteport
+        newentry['socketobjectid'] = _insert_into_socketobjecttable(acceptedsocket)
+        newentry['last_peek'] = ''
+
+        try:
+          newfd = _insert_fd(newentry)
+        except SyscallError, e:
+          # no fd left for it...
+          acceptedsocket.close()
+          _remove_from_socketobjecttable(newentry['socketobjectid'])
+          _release_localport(newport, IPPROTO_TCP)
+          raise SyscallError("accept_syscall",e[1],e[2])
 
         return remoteip, remoteport, newfd
 
@@ -1184,7 +1375,7 @@ def _cleanup_socket(fd):
     thesocket.close()
     localport = filedescriptortable[fd]['localport']
     _release_localport(localport, filedescriptortable[fd]['protocol'])
-    del socketobjecttable[filedescriptortable[fd]['socketobjectid']]
+    _remove_from_socketobjecttable(filedescriptortable[fd]['socketobjectid'])
     del filedescriptortable[fd]['socketobjectid']
     
     filedescriptortable[fd]['state'] = NOTCONNECTED
@@ -1201,11 +1392,7 @@ def setshutdown_syscall(fd, how):
     http://linux.die.net/man/2/shutdown
   """
 
-  if fd not in filedescriptortable:
-    raise SyscallError("shutdown_syscall","EBADF","The file descriptor is invalid.")
-
-  if not IS_SOCK(filedescriptortable[fd]['mode']):
-    raise SyscallError("shutdown_syscall","ENOTSOCK","The descriptor is not a socket.")
+  fdentry = _get_sock_entry(fd, "shutdown_syscall")
 
 
   if how == SHUT_RD or how == SHUT_WR:
@@ -1216,7 +1403,11 @@ def setshutdown_syscall(fd, how):
   # let's shut this down...
   elif how == SHUT_RDWR:
     # BUG: need to check for duplicate entries (ala dup / dup2)
-    _cleanup_socket(fd)
+    fdentry = _lock_sock_entry(fd, "shutdown_syscall")
+    try:
+      _cleanup_socket(fd)
+    finally:
+      fdentry['lock'].release()
   else:
     # BUG: I'm not exactly clear as to how to handle this...
     
@@ -0,0 +1,716 @@
+#!/usr/bin/env python
+"""
+<Program Name>
+  link_emulator.py
+
+<Purpose>
+  Emulates a network link between the proxy and a local server, so that
+  shim stacks can be compared on a given link without leaving the host.
+  It listens on a local port and forwards every connection (or UDP
+  flow) to the target, holding the data back the way the link would:
+  every segment waits for the bandwidth, the delay and a random jitter,
+  and may be lost. It needs no root, the link lives in this process.
+
+  Every flow has a link of its own in each direction, with the profile
+  the emulator had when the flow started. With --control the profile of
+  the emulator and of single flows can be changed while it runs (see
+  control_request()).
+
+  A lost TCP segment can not be left out of the stream, so it arrives
+  a retransmission timeout later instead, holding up the segments
+  behind it. Lost UDP datagrams are dropped. TCP segments stay in
+  order, UDP datagrams may be reordered by the jitter.
+
+<Usage>
+  python link_emulator.py LISTEN_PORT TARGET_HOST:TARGET_PORT [--udp]
+      [--profile NAME] [--delay MS] [--jitter MS] [--rate KBIT]
+      [--loss PERCENT] [--queue SEGMENTS] [--seed SEED]
+      [--control PATH]
+
+  The delay and the jitter are one way, in milliseconds. The rate is in
+  kbit/s, 0 leaves it unlimited. The options override the values of
+  the profile (see PROFILES).
+"""
+
+import os
+import sys
+import time
+import errno
+import heapq
+import random
+import socket
+import threading
+
+
+
+# The link profiles that --profile knows. The values are those of the
+# options: delay and jitter in ms (one way), rate in kbit/s, loss in
+# percent.
+PROFILES = {
+  'loopback'  : {'delay' : 0, 'jitter' : 0, 'rate' : 0, 'loss' : 0},
+  'lan'       : {'delay' : 0.5, 'jitter' : 0.1, 'rate' : 1000000, 'loss' : 0},
+  'wan'       : {'delay' : 20, 'jitter' : 2, 'rate' : 100000, 'loss' : 0.1},
+  'dsl'       : {'delay' : 30, 'jitter' : 5, 'rate' : 8000, 'loss' : 0.5},
+  '3g'        : {'delay' : 100, 'jitter' : 30, 'rate' : 2000, 'loss' : 1},
+  'satellite' : {'delay' : 300, 'jitter' : 10, 'rate' : 5000, 'loss' : 0.5},
+}
+
+PROFILE_KEYS = ('delay', 'jitter', 'rate', 'loss', 'queue')
+
+# How much is sent at once, about a TCP segment on an Ethernet link.
+# The bandwidth, the delay and the loss apply to every segment.
+SEGMENT_SIZE = 1448
+UDP_MAX_SIZE = 65535
+
+# How often a UDP link looks for a datagram that the jitter moved ahead
+# of the one it waits for.
+UNORDERED_POLL_INTERVAL = 0.001
+
+# The segments a link holds (netem's default limit). A full TCP link
+# stops reading, a full UDP link drops.
+DEFAULT_QUEUE = 1000
+
+# A lost TCP segment arrives this much later: Linux's minimum
+# retransmission timeout, or twice the round trip and its jitter if
+# that is longer.
+TCP_MIN_RTO = 0.2
+
+CONTROL_REQUEST_SIZE = 256
+
+
+
+class LinkProfile(object):
+  """
+  The delay and jitter (seconds), rate (bytes per second, 0 for
+  unlimited), loss (a probability) and queue length of a link.
+  """
+  def __init__(self):
+    self.delay = 0.0
+    self.jitter = 0.0
+    self.rate = 0.0
+    self.loss = 0.0
+    self.queue = DEFAULT_QUEUE
+
+
+  def copy(self):
+    profile = LinkProfile()
+    profile.__dict__.update(self.__dict__)
+    return profile
+
+
+  def set(self, key, value):
+    """
+    <Purpose>
+      Set a value of the profile in the units of the options.
+
+    <Arguments>
+      key - one of PROFILE_KEYS.
+      value - the value, as a string or a number.
+
+    <Exceptions>
+      ValueError - raised if the key or the value is invalid.
+
+    <Return>
+      None
+    """
+    if key not in PROFILE_KEYS:
+      raise ValueError("unknown key '" + key + "'")
+
+    value = float(value)
+    if value < 0 or (key == 'loss' and value > 100):
+      raise ValueError("invalid " + key + " " + str(value))
+
+    if key == 'delay':
+      self.delay = value / 1000
+    elif key == 'jitter':
+      self.jitter = value / 1000
+    elif key == 'rate':
+      self.rate = value * 1000 / 8
+    elif key == 'loss':
+      self.loss = value / 100
+    else:
+      self.queue = max(1, int(value))
+
+
+  def __str__(self):
+    return "delay=%g jitter=%g rate=%g loss=%g queue=%d" % (
+        self.delay * 1000, self.jitter * 1000, self.rate * 8 / 1000,
+        self.loss * 100, self.queue)
+
+
+
+class Link(object):
+  """
+  One direction of a flow. The reader puts the segments in with put(),
+  which works out when they arrive. The writer takes them out with
+  get() once they have arrived, and hands them to deliver. A None
+  segment ends the link.
+
+  Every link draws its jitter and losses from a generator of its own,
+  seeded from the seed of the emulator, the flow and the direction, so
+  that with --seed a flow sees the same link however the threads of
+  the other links run.
+  """
+  def __init__(self, flow, deliver, ordered, direction):
+    self.flow = flow
+    self.deliver = deliver
+    self.ordered = ordered
+    if flow.emulator.seed is None:
+      self.random = random.Random()
+    else:
+      self.random = random.Random("%s:%d:%s" % (flow.emulator.seed, flow.flow_id, direction))
+    self.cond = threading.Condition()
+    self.segments = []
+    self.sequence = 0
+    self.closed = False
+
+    # when the link is done sending the last segment, and when the last
+    # segment arrives.
+    self.link_free = 0.0
+    self.last_arrival = 0.0
+
+    self.bytes = 0
+    self.sent = 0
+    self.lost = 0
+    self.dropped = 0
+
+
+  def put(self, data):
+    """
+    <Purpose>
+      Send a segment over the link, or end it if data is None. A TCP
+      link waits while it is full, a UDP link drops the segment.
+
+    <Arguments>
+      data - the segment, or None.
+
+    <Return>
+      None
+    """
+    self.cond.acquire()
+    try:
+      profile = self.flow.profile
+
+      while data is not None and len(self.segments) >= profile.queue and not self.closed:
+        if not self.ordered:
+          self.dropped += 1
+          return
+        self.cond.wait()
+
+      if self.closed:
+        return
+
+      now = time.time()
+
+      if data is None:
+        arrival = max(now, self.last_arrival)
+      else:
+        # wait for the link, then for the segment to go over it...
+        self.link_free = max(now, self.link_free)
+        if profile.rate:
+          self.link_free += len(data) / profile.rate
+
+        arrival = self.link_free + profile.delay
+        if profile.jitter:
+          arrival += self.random.uniform(-profile.jitter, profile.jitter)
+
+        if profile.loss and self.random.random() < profile.loss:
+          self.lost += 1
+          if not self.ordered:
+            return
+          arrival += max(TCP_MIN_RTO, 4 * profile.delay + 4 * profile.jitter)
+
+        self.bytes += len(data)
+
+      # ... and a stream can not overtake itself.
+      if self.ordered:
+        arrival = max(arrival, self.last_arrival)
+      arrival = max(arrival, now)
+      self.last_arrival = max(arrival, self.last_arrival)
+
+      heapq.heappush(self.segments, (arrival, self.sequence, data))
+      self.sequence += 1
+      self.cond.notify_all()
+    finally:
+      self.cond.release()
+
+
+  def get(self):
+    """
+    <Purpose>
+      Wait for the next segment to arrive.
+
+    <Return>
+      The segment, or None once the link has ended.
+    """
+    while True:
+      self.cond.acquire()
+      try:
+        if self.closed:
+          return None
+
+        if not self.segments:
+          self.cond.wait()
+          continue
+
+        wait = self.segments[0][0] - time.time()
+        if wait <= 0:
+          data = heapq.heappop(self.segments)[2]
+          if data is not None:
+            self.sent += 1
+          self.cond.notify_all()
+          return data
+      finally:
+        self.cond.release()
+
+      # A wait on a condition with a timeout polls in python 2, too
+      # coarsely for a delay of a few ms, so sleep instead. Only an
+      # unordered link can get a segment ahead of the first one meanwhile.
+      if not self.ordered:
+        wait = min(wait, UNORDERED_POLL_INTERVAL)
+      time.sleep(wait)
+
+
+  def close(self):
+    self.cond.acquire()
+    self.closed = True
+    self.segments = []
+    self.cond.notify_all()
+    self.cond.release()
+
+
+  def writer(self):
+    # The thread that takes the segments off the link. A link that can
+    # not deliver is closed.
+    try:
+      while True:
+        data = self.get()
+        if self.closed:
+          break
+        self.deliver(data)
+        if data is None:
+          break
+    except socket.error:
+      self.close()
+    self.flow.link_done(self)
+
+
+  def stats(self):
+    return "bytes=%d segments=%d lost=%d dropped=%d queued=%d" % (
+        self.bytes, self.sent, self.lost, self.dropped, len(self.segments))
+
+
+
+class Flow(object):
+  """
+  A connection (or the datagrams of one UDP client) and its two links:
+  up from the client to the target, and down.
+  """
+  def __init__(self, emulator, client_address):
+    self.emulator = emulator
+    self.client_address = client_address
+    self.profile = emulator.profile.copy()
+    self.done_links = 0
+    emulator.add_flow(self)
+
+
+  def start_links(self, deliver_up, deliver_down, ordered):
+    self.up = Link(self, deliver_up, ordered, 'up')
+    self.down = Link(self, deliver_down, ordered, 'down')
+    for link in (self.up, self.down):
+      thread = threading.Thread(target=link.writer)
+      thread.daemon = True
+      thread.start()
+
+
+  def link_done(self, link):
+    self.emulator.lock.acquire()
+    self.done_links += 1
+    done = self.done_links == 2
+    self.emulator.lock.release()
+
+    if done:
+      self.close()
+    else:
+      self.link_closed(link)
+
+
+  def link_closed(self, link):
+    pass
+
+
+  def close(self):
+    self.up.close()
+    self.down.close()
+    self.emulator.remove_flow(self)
+
+
+  def describe(self):
+    return "flow %d %s %s:%d %s\n  up %s\n  down %s\n" % (
+        self.flow_id, self.protocol, self.client_address[0],
+        self.client_address[1], self.profile, self.up.stats(),
+        self.down.stats())
+
+
+
+class TCPFlow(Flow):
+
+  protocol = 'tcp'
+
+  def __init__(self, emulator, client_sock, client_address, target_sock):
+    Flow.__init__(self, emulator, client_address)
+    self.client_sock = client_sock
+    self.target_sock = target_sock
+
+    self.start_links(self._deliver(target_sock), self._deliver(client_sock), True)
+
+    for source, link in ((client_sock, self.up), (target_sock, self.down)):
+      thread = threading.Thread(target=self._reader, args=(source, link))
+      thread.daemon = True
+      thread.start()
+
+
+  def _deliver(self, sock):
+    def deliver(data):
+      if data is None:
+        sock.shutdown(socket.SHUT_WR)
+      else:
+        sock.sendall(data)
+    return deliver
+
+
+  def _reader(self, sock, link):
+    # The thread that puts what one end sends on its link.
+    while True:
+      try:
+        data = sock.recv(SEGMENT_SIZE)
+      except socket.error:
+        data = ''
+
+      if not data:
+        link.put(None)
+        return
+
+      link.put(data)
+
+
+  def link_closed(self, link):
+    # A link that could not deliver takes the flow down with it.
+    if link.closed:
+      self.close()
+
+
+  def close(self):
+    Flow.close(self)
+    for sock in (self.client_sock, self.target_sock):
+      try:
+        sock.shutdown(socket.SHUT_RDWR)
+      except socket.error:
+        pass
+      sock.close()
+
+
+
+class UDPFlow(Flow):
+
+  protocol = 'udp'
+
+  def __init__(self, emulator, listen_sock, client_address, target_address):
+    Flow.__init__(self, emulator, client_address)
+    self.target_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    self.target_sock.connect(target_address)
+
+    # A datagram that can not be sent is lost, like on the network.
+    def deliver_up(data):
+      try:
+        if data is not None:
+          self.target_sock.send(data)
+      except socket.error:
+        pass
+
+    def deliver_down(data):
+      try:
+        if data is not None:
+          listen_sock.sendto(data, client_address)
+      except socket.error:
+        pass
+
+    self.start_links(deliver_up, deliver_down, False)
+
+    thread = threading.Thread(target=self._reader)
+    thread.daemon = True
+    thread.start()
+
+
+  def _reader(self):
+    # The thread that puts the replies of the target on the down link.
+    while True:
+      try:
+        data = self.target_sock.recv(UDP_MAX_SIZE)
+      except socket.error, err:
+        # an earlier datagram found nobody listening.
+        if err.errno == errno.ECONNREFUSED:
+          continue
+        return
+      self.down.put(data)
+
+
+
+class LinkEmulator(object):
+
+  def __init__(self, listen_port, target_address, udp, profile, seed):
+    self.listen_port = listen_port
+    self.target_address = target_address
+    self.udp = udp
+    self.profile = profile
+    self.seed = seed
+
+    self.lock = threading.Lock()
+    self.flows = {}
+    self.next_flow_id = 1
+
+
+  def add_flow(self, flow):
+    self.lock.acquire()
+    flow.flow_id = self.next_flow_id
+    self.next_flow_id += 1
+    self.flows[flow.flow_id] = flow
+    self.lock.release()
+
+
+  def remove_flow(self, flow):
+    self.lock.acquire()
+    self.flows.pop(flow.flow_id, None)
+    self.lock.release()
+
+
+  def serve_tcp(self):
+    listen_sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listen_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listen_sock.bind(('127.0.0.1', self.listen_port))
+    listen_sock.listen(128)
+
+    while True:
+      client_sock, client_address = listen_sock.accept()
+
+      try:
+        target_sock = socket.create_connection(self.target_address)
+      except socket.error, err:
+        print "Could not connect to %s:%d: %s" % (self.target_address + (err,))
+        client_sock.close()
+        continue
+
+      for sock in (client_sock, target_sock):
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+      TCPFlow(self, client_sock, client_address, target_sock)
+
+
+  def serve_udp(self):
+    listen_sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    listen_sock.bind(('127.0.0.1', self.listen_port))
+
+    # UDP flows are told apart by the address of the client, and last
+    # as long as the emulator.
+    client_flows = {}
+
+    while True:
+      data, client_address = listen_sock.recvfrom(UDP_MAX_SIZE)
+
+      if client_address not in client_flows:
+        client_flows[client_address] = UDPFlow(self, listen_sock, client_address, self.target_address)
+
+      client_flows[client_address].up.put(data)
+
+
+  def control_request(self, request):
+    """
+    <Purpose>
+      Answer a request on the control socket:
+        show                     the profile, and the flows with the
+                                 profile and counters of their links.
+        set [FLOW] KEY=VALUE...  change the profile of one flow, or that
+                                 of the emulator and of all its flows.
+      The keys are delay, jitter, rate, loss and queue, in the units of
+      the options.
+
+    <Arguments>
+      request - the request, without the newline.
+
+    <Return>
+      The answer.
+    """
+    words = request.split()
+
+    if not words or words[0] == 'show':
+      self.lock.acquire()
+      flows = sorted(self.flows.items())
+      self.lock.release()
+
+      answer = "profile %s\n" % self.profile
+      for flow_id, flow in flows:
+        answer += flow.describe()
+      return answer
+
+    if words[0] != 'set':
+      return "usage: show | set [FLOW] KEY=VALUE...\n"
+
+    words = words[1:]
+    self.lock.acquire()
+    if words and '=' not in words[0]:
+      try:
+        flows = [self.flows[int(words[0])]]
+      except (ValueError, KeyError):
+        self.lock.release()
+        return "error: no flow " + words[0] + "\n"
+      profiles = [flows[0].profile]
+      words = words[1:]
+    else:
+      profiles = [self.profile] + [flow.profile for flow in self.flows.values()]
+    self.lock.release()
+
+    if not words:
+      return "usage: show | set [FLOW] KEY=VALUE...\n"
+
+    # Check all of them before changing anything.
+    try:
+      values = []
+      for word in words:
+        key, value = word.split('=', 1)
+        LinkProfile().set(key, value)
+        values.append((key, value))
+    except ValueError, err:
+      return "error: " + str(err) + "\n"
+
+    # A link reads the profile for every segment, so a change applies to
+    # the next one.
+    for profile in profiles:
+      for key, value in values:
+        profile.set(key, value)
+    return "ok\n"
+
+
+  def serve_control(self, path):
+    if os.path.exists(path):
+      os.unlink(path)
+
+    server_sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    server_sock.bind(path)
+    server_sock.listen(5)
+
+    while True:
+      client_sock, address = server_sock.accept()
+
+      try:
+        client_sock.settimeout(1)
+
+        request = ''
+        while '\n' not in request and len(request) < CONTROL_REQUEST_SIZE:
+          data = client_sock.recv(CONTROL_REQUEST_SIZE)
+          if not data:
+            break
+          request += data
+
+        client_sock.sendall(self.control_request(request.strip()))
+      except socket.error:
+        pass
+
+      client_sock.close()
+
+
+
+def usage():
+  print "Usage:\n$ python link_emulator.py LISTEN_PORT TARGET_HOST:TARGET_PORT [--udp] [--profile NAME] [--delay MS] [--jitter MS] [--rate KBIT] [--loss PERCENT] [--queue SEGMENTS] [--seed SEED] [--control PATH]"
+  print "Profiles: " + ", ".join(sorted(PROFILES))
+  sys.exit(1)
+
+
+
+def parse_args(args):
+  if len(args) < 2 or args[0].startswith('--') or ':' not in args[1]:
+    usage()
+
+  try:
+    listen_port = int(args[0])
+    target_host, target_port = args[1].rsplit(':', 1)
+    target_address = (target_host, int(target_port))
+  except ValueError:
+    usage()
+
+  udp = False
+  profile_name = None
+  seed = None
+  control_path = None
+  values = []
+
+  index = 2
+  while index < len(args):
+    if args[index] == '--udp':
+      udp = True
+      index += 1
+      continue
+
+    if index + 1 == len(args):
+      usage()
+
+    option = args[index][2:]
+    value = args[index + 1]
+
+    if option == 'profile':
+      if value not in PROFILES or profile_name is not None:
+        usage()
+      profile_name = value
+    elif option in PROFILE_KEYS:
+      values.append((option, value))
+    elif option == 'seed':
+      seed = value
+    elif option == 'control':
+      control_path = value
+    else:
+      usage()
+
+    index += 2
+
+  # the options override the profile, wherever they are.
+  if profile_name is not None:
+    values = PROFILES[profile_name].items() + values
+
+  profile = LinkProfile()
+  try:
+    for key, value in values:
+      profile.set(key, value)
+  except ValueError, err:
+    print "Error: " + str(err)
+    usage()
+
+  return listen_port, target_address, udp, profile, seed, control_path
+
+
+
+def main():
+  listen_port, target_address, udp, profile, seed, control_path = parse_args(sys.argv[1:])
+
+  emulator = LinkEmulator(listen_port, target_address, udp, profile, seed)
+
+  if control_path:
+    thread = threading.Thread(target=emulator.serve_control, args=(control_path,))
+    thread.daemon = True
+    thread.start()
+
+  print "Emulating a link from 127.0.0.1:%d to %s:%d (%s): %s" % (
+      listen_port, target_address[0], target_address[1],
+      udp and 'udp' or 'tcp', profile)
+  sys.stdout.flush()
+
+  try:
+    if udp:
+      emulator.serve_udp()
+    else:
+      emulator.serve_tcp()
+  except KeyboardInterrupt:
+    pass
+
+
+
+if __name__ == '__main__':
+  main()
@@ -0,0 +1,49 @@
+#!/bin/bash
+
+# Runs the training workload for a profile-guided build (make pgo): the
+# client and server of sample_application talk through a proxy with the
+# given library preloaded on both ends, LIBNIT_PGO_ROUNDS times (200 by
+# default). Every round opens, binds, accepts, connects, reads, writes
+# and closes, which are the calls the library spends its time in.
+
+shimlib_path=$1
+rounds=${LIBNIT_PGO_ROUNDS:-200}
+first_port=${LIBNIT_PGO_PORT:-41000}
+
+if [ -z "$shimlib_path" ]; then
+    echo -e "Usage:\n$ ./pgo_train.sh LIBNETWORKINTERPOSE_SO"
+    exit 1
+fi
+
+train_dir=`mktemp -d`
+
+./deploy_AFFIX_proxy.sh $train_dir > /dev/null
+gcc -w -o $train_dir/server sample_application/server.c
+gcc -w -o $train_dir/client sample_application/client.c
+
+# Use NoopShim for every connection, so that the streams are relayed
+# like most of them are.
+sed -i 's/^shim_string = .*/shim_string = "(NoopShim)"/' $train_dir/posix_call_definition.py
+
+# Start the proxy and wait until it is up.
+(cd $train_dir && exec python smart_shim_proxy.py > proxy.log 2>&1) &
+proxy_pid=$!
+sleep 3
+
+failed=0
+for ((round = 0; round < rounds; round++)); do
+    port=$((first_port + round % 1000))
+
+    timeout 10 env LD_PRELOAD=$shimlib_path $train_dir/server $port > /dev/null 2>&1 &
+    server_pid=$!
+    sleep 0.05
+
+    echo "training round $round" | timeout 10 env LD_PRELOAD=$shimlib_path $train_dir/client 127.0.0.1 $port > /dev/null 2>&1 || failed=$((failed + 1))
+    wait $server_pid
+done
+
+kill $proxy_pid
+wait $proxy_pid 2> /dev/null
+rm -rf $train_dir
+
+echo "Trained on $rounds rounds ($failed failed)."
@@ -24,13 +24,117 @@ from repyportability import *
 from lind_fs_constants import *
 from lind_net_constants import *
 
-execfile('lind_fs_calls.py')
-execfile('lind_net_calls.py')
+import os
+import imp
+import marshal
+
+
+
+# A proxy bundle (made by build_proxy_bundle.py) holds the lind calls and
+# the repy modules of the configured shim stacks, already preprocessed and
+# compiled, so the proxy starts without reading or compiling any of them.
+PROXY_BUNDLE_MAGIC = 'LIBNITB1'
+PROXY_BUNDLE_FILE = 'proxy_bundle.bin'
+
+
+
+def load_proxy_bundle(bundle_path):
+  """
+  <Purpose>
+    Read a proxy bundle. Modules whose source is next to the bundle and
+    has changed since the bundle was built are left out, so they are
+    loaded from the source as usual.
+
+  <Arguments>
+    bundle_path - the path of the bundle file.
+
+  <Return>
+    A dict with the code objects of the lind files ('lind', by file name)
+    and of the repy modules ('repy', by module name). Both are empty if
+    there is no bundle or it was built by another python version.
+  """
+
+  bundle = {'lind' : {}, 'repy' : {}}
+
+  try:
+    bundle_file = open(bundle_path, 'rb')
+  except IOError:
+    return bundle
+
+  try:
+    if bundle_file.read(len(PROXY_BUNDLE_MAGIC) + len(imp.get_magic())) != PROXY_BUNDLE_MAGIC + imp.get_magic():
+      return bundle
+    entries = marshal.load(bundle_file)
+  finally:
+    bundle_file.close()
+
+  # Every entry is (kind, name, source file, source mtime, source size, code).
+  for kind, name, source, mtime, size, code in entries:
+    try:
+      source_stat = os.stat(source)
+      if (int(source_stat.st_mtime), source_stat.st_size) != (mtime, size):
+        continue
+    except OSError:
+      pass
+
+    bundle[kind][name] = code
+
+  return bundle
+
+
+
+proxy_bundle = load_proxy_bundle(os.environ.get('LIBNIT_PROXY_BUNDLE', PROXY_BUNDLE_FILE))
+
+
+
+def exec_lind_file(filename):
+  # Run one of the lind call files in our namespace.
+  if filename in proxy_bundle['lind']:
+    exec proxy_bundle['lind'][filename] in globals()
+  else:
+    execfile(filename, globals())
+
+
+
+exec_lind_file('lind_fs_calls.py')
+exec_lind_file('lind_net_calls.py')
+
+import time
+import json
+import ctypes
+import threading
+import collections
+import socket as python_socket
 
 
 _context = locals()
 add_dy_support(_context)
 
+
+
+def install_bundled_modules():
+  # Put the bundled repy modules into the module cache of dylink, as if
+  # they had been imported already (but not evaluated yet).
+  import dylink_repy
+  import virtual_namespace
+
+  for module, code in proxy_bundle['repy'].items():
+    if module in dylink_repy.MODULE_CACHE:
+      continue
+
+    virt = virtual_namespace.VirtualNamespace.__new__(virtual_namespace.VirtualNamespace)
+    virt.code = code
+
+    namespace = dylink_repy.DylinkNamespace.__new__(dylink_repy.DylinkNamespace)
+    namespace._virt = virt
+    namespace._eval_context = None
+
+    dylink_repy.MODULE_CACHE[module] = namespace
+
+
+
+install_bundled_modules()
+
 # Import the serialize library.
 dy_import_module_symbols("serialize")
 
@@ -39,6 +143,263 @@ dy_import_module_symbols("shimstackinterface")
 
 
 
+
+# ========================== Shim Layer Stats ==================================================
+
+# The calls into every layer of the shim stacks can be accounted for
+# (see layer_stats in shim_stack.repy): the socket_send() and
+# socket_recv() calls, the bytes each layer was handed or handed back,
+# and the wall and CPU time spent in the layer itself, without the
+# layers below it. LIBNIT_PROXY_LAYER_STATS=1 turns the accounting on
+# from the start, the statistics socket of the proxy turns it on and
+# off while it runs.
+CLOCK_THREAD_CPUTIME_ID = 3
+
+LAYER_SEND = 0
+LAYER_RECV = 1
+
+
+
+class _timespec(ctypes.Structure):
+  _fields_ = [('tv_sec', ctypes.c_long), ('tv_nsec', ctypes.c_long)]
+
+try:
+  _clock_gettime = ctypes.CDLL(None).clock_gettime
+  _clock_gettime.argtypes = [ctypes.c_int, ctypes.POINTER(_timespec)]
+except (OSError, AttributeError):
+  _clock_gettime = None
+
+
+
+def thread_cpu_time():
+  # The CPU seconds the calling thread has used, 0 if unknown.
+  if not _clock_gettime:
+    return 0.0
+
+  now = _timespec()
+  _clock_gettime(CLOCK_THREAD_CPUTIME_ID, ctypes.byref(now))
+  return now.tv_sec + now.tv_nsec * 1e-9
+
+
+
+class ShimLayerStats:
+  """
+  <Purpose>
+    The accounting of the calls into the layers of the shim stacks.
+    A layer is identified by the shim string of its stack, its index in
+    the stack (0 at the top, the last one being the repy network calls)
+    and its own part of the shim string. For every layer and for send
+    and receive there is a record of the calls, the bytes and the wall
+    and CPU seconds.
+
+    Every thread counts into records of its own, so no lock is taken
+    on a call. snapshot() adds them up. When a thread ends, its records
+    are added to retired_records, so the shards do not pile up with the
+    threads of the connections that are gone.
+  """
+
+  def __init__(self, enabled=False):
+    self.enabled = enabled
+    self.local = threading.local()
+    self.shard_dict = {}
+    self.retired_records = {}
+    self.lock = threading.Lock()
+
+  def meter(self, layer, stack_context):
+    key = (stack_context['layer_root'], stack_context['layer_index'], stack_context['layer_str'])
+    return ShimLayerMeter(self, layer, key)
+
+  def enter(self):
+    try:
+      frame_stack = self.local.frame_stack
+    except AttributeError:
+      frame_stack = self.local.frame_stack = []
+      self.local.shard = ShimLayerShard(self)
+      self.local.records = self.local.shard.records
+      self.lock.acquire()
+      self.shard_dict[id(self.local.shard)] = self.local.records
+      self.lock.release()
+
+    # The start, and the wall and CPU seconds of the layers below.
+    frame = [time.time(), thread_cpu_time(), 0.0, 0.0]
+    frame_stack.append(frame)
+    return frame
+
+  def leave(self, key, op, frame, byte_count):
+    now = time.time()
+    wall = now - frame[0]
+    cpu = thread_cpu_time() - frame[1]
+
+    frame_stack = self.local.frame_stack
+    frame_stack.pop()
+    if frame_stack:
+      frame_stack[-1][2] += wall
+      frame_stack[-1][3] += cpu
+
+    record = self.local.records.get(key)
+    if record is None:
+      record = self.local.records[key] = _new_layer_record()
+
+    op_record = record[op]
+    op_record[0] += 1
+    op_record[1] += byte_count
+    op_record[2] += wall - frame[2]
+    op_record[3] += cpu - frame[3]
+
+    trace_id = span_trace()
+    if trace_id:
+      span_record('shim layer ' + (key[2] or '(repy)'), trace_id, frame[0], now,
+                  {'stack' : key[0], 'layer' : key[1], 'bytes' : byte_count})
+
+  def snapshot(self):
+    """
+    <Purpose>
+      Add up the records of all the threads.
+
+    <Return>
+      A sorted list of (stack string, layer index, layer string,
+      'send' or 'recv', calls, bytes in, bytes out, wall seconds, CPU
+      seconds) tuples. The bytes in of a send are what the layer was
+      handed, the bytes out what it handed to the layer below; for a
+      receive it is the other way around.
+    """
+    # A thread that retires after this still has its records in the
+    # shards we copy, and not in the retired ones.
+    total_dict = {}
+    self.lock.acquire()
+    try:
+      _add_layer_records(total_dict, self.retired_records)
+      shard_list = self.shard_dict.values()
+    finally:
+      self.lock.release()
+
+    for records in shard_list:
+      _add_layer_records(total_dict, records)
+
+    # What a layer passes on is what the layer below it was handed.
+    below_dict = {}
+    for (stack_str, layer_index, layer_str), total in total_dict.items():
+      below_dict[(stack_str, layer_index)] = total
+
+    snapshot = []
+    for (stack_str, layer_index, layer_str), total in sorted(total_dict.items()):
+      below = below_dict.get((stack_str, layer_index + 1))
+
+      send_calls, send_bytes, send_wall, send_cpu = total[LAYER_SEND]
+      recv_calls, recv_bytes, recv_wall, recv_cpu = total[LAYER_RECV]
+
+      # The repy network calls at the bottom pass on what they get.
+      send_below = send_bytes
+      recv_below = recv_bytes
+      if below:
+        send_below = below[LAYER_SEND][1]
+        recv_below = below[LAYER_RECV][1]
+
+      snapshot.append((stack_str, layer_index, layer_str, 'send', send_calls, send_bytes, send_below, send_wall, send_cpu))
+      snapshot.append((stack_str, layer_index, layer_str, 'recv', recv_calls, recv_below, recv_bytes, recv_wall, recv_cpu))
+
+    return snapshot
+
+
+
+  def retire(self, shard):
+    """
+    Fold the records of a thread that has ended into retired_records.
+    """
+    self.lock.acquire()
+    try:
+      records = self.shard_dict.pop(id(shard), None)
+      if records:
+        _add_layer_records(self.retired_records, records)
+    finally:
+      self.lock.release()
+
+
+
+def _new_layer_record():
+  # The calls, bytes, wall and CPU seconds of the sends and the receives.
+  return [[0, 0, 0.0, 0.0], [0, 0, 0.0, 0.0]]
+
+
+
+def _add_layer_records(total_dict, records):
+  for key, record in records.items():
+    total = total_dict.get(key)
+    if total is None:
+      total = total_dict[key] = _new_layer_record()
+    for op in (LAYER_SEND, LAYER_RECV):
+      for index in xrange(4):
+        total[op][index] += record[op][index]
+
+
+
+class ShimLayerShard:
+  """
+  The records of one thread. Only the thread-local data of its thread
+  refers to it, so it goes away with the thread and hands its records
+  over to the ShimLayerStats.
+  """
+
+  def __init__(self, stats):
+    self.stats = stats
+    self.records = {}
+
+  def __del__(self):
+    self.stats.retire(self)
+
+
+
+class ShimLayerMeter:
+  """
+  Stands in for a layer of a shim stack and accounts for the calls to
+  its socket_send() and socket_recv(). Everything else goes straight to
+  the layer.
+  """
+
+  def __init__(self, layer_stats, layer, key):
+    self._layer_stats = layer_stats
+    self._layer = layer
+    self._key = key
+
+  def __getattr__(self, name):
+    return getattr(self._layer, name)
+
+  def socket_send(self, socket, msg):
+    if not self._layer_stats.enabled:
+      return self._layer.socket_send(socket, msg)
+
+    frame = self._layer_stats.enter()
+    try:
+      return self._layer.socket_send(socket, msg)
+    finally:
+      self._layer_stats.leave(self._key, LAYER_SEND, frame, len(msg))
+
+  def socket_recv(self, socket, bytes):
+    if not self._layer_stats.enabled:
+      return self._layer.socket_recv(socket, bytes)
+
+    frame = self._layer_stats.enter()
+    data = ''
+    try:
+      data = self._layer.socket_recv(socket, bytes)
+      return data
+    finally:
+      self._layer_stats.leave(self._key, LAYER_RECV, frame, len(data))
+
+  def tcpserversocket_getconnection(self, tcpserversocket):
+    # The accepted sockets call into this layer through us as well.
+    remote_ip, remote_port, sockobj = self._layer.tcpserversocket_getconnection(tcpserversocket)
+    if hasattr(sockobj, '_shim_object'):
+      sockobj._shim_object = self
+    return (remote_ip, remote_port, sockobj)
+
+
+
+shim_layer_stats = ShimLayerStats(os.environ.get('LIBNIT_PROXY_LAYER_STATS') == '1')
+
+
+
+
 # Define some shim/repy related variables.
 DEFAULT_TIMEOUT = 10
 
@@ -46,10 +407,223 @@ DEFAULT_TIMEOUT = 10
 #shim_string = "(LogShim,smart_shim_log.txt)"
 shim_string = "(CompressionShim)"
 
-shim_obj = ShimStackInterface(shim_string)
+shim_obj = ShimStackInterface(shim_string, '', shim_layer_stats)
+
+
+
+def is_identity_shim_string(stack_str):
+  """
+  <Purpose>
+    Check whether a shim string leaves the bytes of a TCP stream
+    untouched, i.e. it is empty or made up of NoopShims only.
+
+  <Arguments>
+    stack_str - the shim string, e.g. "(NoopShim)".
+
+  <Return>
+    True if the shim stack is an identity stack, False otherwise.
+  """
+
+  stack_str = stack_str.strip()
+
+  while stack_str.startswith("(NoopShim)"):
+    stack_str = stack_str[len("(NoopShim)"):]
+
+  return stack_str == ''
+
+
+
+
+
+
+# The per-destination shim policy: a list of (network, netmask,
+# port_lo, port_hi, shim string) tuples, tried in order. Connections
+# that match none of them use shim_string.
+shim_policy = []
+
+# The shim stacks in use, by shim string, and the stack chosen for each
+# (ip, port) seen so far.
+shim_interface_dict = {shim_string : shim_obj}
+shim_choice_cache = {}
+
+
+
+def load_shim_policy(policy_path):
+  """
+  <Purpose>
+    Read the shim policy, which picks the shim stack by the address and
+    port at the other end of a connection (or the local ones for a
+    listening socket). Every line holds an address or CIDR block, a port
+    or range and a shim string, with * matching anything:
+
+      10.0.0.0/8  *     (CompressionShim)
+      *           443   (NoopShim)
+      *           *     (AdaptiveCompressionShim)
+
+    The first line that matches wins; # starts a comment.
+
+  <Arguments>
+    policy_path - the path of the policy file.
+
+  <Exceptions>
+    ValueError if a line can not be parsed, IOError if the file can
+    not be read.
+
+  <Return>
+    The number of rules loaded.
+  """
+
+  rules = []
+  line_no = 0
+
+  for line in open(policy_path):
+    line_no += 1
+    line = line.split('#', 1)[0].strip()
+    if not line:
+      continue
+
+    try:
+      dst_str, port_str, stack_str = line.split(None, 2)
+
+      if dst_str == '*':
+        network, netmask = 0, 0
+      else:
+        if '/' in dst_str:
+          dst_str, prefix_str = dst_str.split('/', 1)
+          prefix_len = int(prefix_str)
+        else:
+          prefix_len = 32
+        if prefix_len < 0 or prefix_len > 32:
+          raise ValueError
+        netmask = (0xffffffff << (32 - prefix_len)) & 0xffffffff
+        network = _ip_to_int(dst_str) & netmask
 
-listenforconnection = shim_obj.listenforconnection
-openconnection = shim_obj.openconnection
+      if port_str == '*':
+        port_lo, port_hi = 0, 65535
+      elif '-' in port_str:
+        port_lo, port_hi = [int(port) for port in port_str.split('-', 1)]
+      else:
+        port_lo = port_hi = int(port_str)
+
+      stack_str = stack_str.strip()
+      get_shim_interface(stack_str)
+
+    except Exception:
+      raise ValueError("%s:%d: not a shim policy rule" % (policy_path, line_no))
+
+    rules.append((network, netmask, port_lo, port_hi, stack_str))
+
+  shim_policy[:] = rules
+  shim_choice_cache.clear()
+
+  return len(rules)
+
+
+
+def get_shim_interface(stack_str):
+  # Return the shim stack for a shim string, creating it on first use.
+  if stack_str not in shim_interface_dict:
+    shim_interface_dict[stack_str] = ShimStackInterface(stack_str, '', shim_layer_stats)
+  return shim_interface_dict[stack_str]
+
+
+
+def _ip_to_int(ip):
+  ip_int = 0
+  for byte in python_socket.inet_aton(ip):
+    ip_int = (ip_int << 8) | ord(byte)
+  return ip_int
+
+
+
+def shim_string_for(ip, port):
+  """
+  <Purpose>
+    Find the shim string the policy picks for a connection.
+
+  <Arguments>
+    ip - the IPv4 address at the other end (or the local one).
+    port - the port that goes with it.
+
+  <Return>
+    The shim string.
+  """
+
+  key = (ip, port)
+
+  try:
+    return shim_choice_cache[key]
+  except KeyError:
+    pass
+
+  stack_str = shim_string
+
+  try:
+    ip_int = _ip_to_int(ip)
+  except Exception:
+    ip_int = None
+
+  for network, netmask, port_lo, port_hi, rule_stack_str in shim_policy:
+    if ip_int is None and netmask:
+      continue
+    if (ip_int or 0) & netmask == network and port_lo <= port <= port_hi:
+      stack_str = rule_stack_str
+      break
+
+  # The cache only holds a bounded number of destinations.
+  if len(shim_choice_cache) > 4096:
+    shim_choice_cache.clear()
+  shim_choice_cache[key] = stack_str
+
+  return stack_str
+
+
+
+def openconnection(destip, destport, localip, localport, timeout):
+  # Connect through the shim stack the policy picks for the destination.
+  stack_str = shim_string_for(destip, destport)
+  sockobj = shim_interface_dict[stack_str].openconnection(destip, destport, localip, localport, timeout)
+
+  try:
+    sockobj.libnit_shim_string = stack_str
+  except AttributeError:
+    pass
+
+  return sockobj
+
+
+
+def listenforconnection(localip, localport):
+  # Listen through the shim stack the policy picks for the local port.
+  return shim_interface_dict[shim_string_for(localip, localport)].listenforconnection(localip, localport)
+
+
+
+def socket_shim_is_identity(sockobj):
+  """
+  <Purpose>
+    Tell whether the data of a connection goes through identity shims
+    only, so the proxy can relay it without the shims. Outbound
+    connections remember their shim string; for the others we can only
+    be sure if every stack in use is an identity one.
+
+  <Arguments>
+    sockobj - the socket object of the connection.
+
+  <Return>
+    True or False.
+  """
+
+  stack_str = getattr(sockobj, 'libnit_shim_string', None)
+
+  if stack_str is not None:
+    return is_identity_shim_string(stack_str)
+
+  for stack_str in shim_interface_dict:
+    if not is_identity_shim_string(stack_str):
+      return False
+
+  return True
 
 
 
@@ -111,6 +685,181 @@ SOCK_DGRAM = 2
 conn_family = [SOCK_STREAM, SOCK_DGRAM]
 
 
+# After a fork() every process that shares a socket attaches its own
+# connection to it, so a socket is only really closed once all of
+# them have closed it. This maps the fd to the number of extra
+# connections that refer to it.
+sock_attach_count = {}
+sock_attach_lock = threading.Lock()
+
+# The processes that accept() on the same listening socket are served
+# first come, first served, so pending connections are spread across
+# the idle workers. This maps the fd to its AcceptQueue.
+accept_queue_dict = {}
+accept_queue_lock = threading.Lock()
+
+
+
+class AcceptQueue:
+  """
+  A ticket lock that lets the accept() calls on one listening socket
+  through in the order they arrived.
+  """
+  def __init__(self):
+    self.cond = threading.Condition()
+    self.next_ticket = 0
+    self.now_serving = 0
+
+  def enter(self):
+    self.cond.acquire()
+    ticket = self.next_ticket
+    self.next_ticket += 1
+    while self.now_serving != ticket:
+      self.cond.wait()
+    self.cond.release()
+
+  def leave(self):
+    self.cond.acquire()
+    self.now_serving += 1
+    self.cond.notify_all()
+    self.cond.release()
+
+
+
+
+
+
+# ========================== Spans =============================================================
+
+# With LIBNIT_PROXY_SPANS set to a file, the proxy adds its spans of the
+# calls the application sampled (see LIBNIT_SPANS) to the file, in the
+# Trace Event format that chrome://tracing and Perfetto open. It may be
+# the file of the application. The spans are queued and written out by
+# a background thread, like the log. span_state.trace is the trace id
+# of the call the thread is handling, if it was sampled.
+SPAN_QUEUE_SIZE = 65536
+SPAN_WRITE_INTERVAL = 0.05
+
+span_file = None
+span_queue = collections.deque()
+span_state = threading.local()
+
+
+
+def span_configure(span_path):
+  """
+  <Purpose>
+    Open the span file and start the thread that writes the spans.
+    The first writer creates the file with the opening bracket of the
+    array of events.
+
+  <Arguments>
+    span_path - the file to append the spans to.
+
+  <Exceptions>
+    IOError, OSError if the file can not be opened.
+
+  <Return>
+    None
+  """
+  global span_file
+
+  tmp_path = "%s.%d.tmp" % (span_path, os.getpid())
+  tmp_file = open(tmp_path, 'w')
+  tmp_file.write('[\n')
+  tmp_file.close()
+
+  try:
+    os.link(tmp_path, span_path)
+  except OSError:
+    pass
+  os.unlink(tmp_path)
+
+  span_file = open(span_path, 'a')
+
+  writer = threading.Thread(target=_span_writer)
+  writer.setDaemon(True)
+  writer.start()
+
+
+
+def span_enabled():
+  # Whether the proxy writes spans (importers only see the first value
+  # of span_file).
+  return span_file is not None
+
+
+
+def span_trace():
+  # The trace of the call this thread handles, None if it has none.
+  if span_file is None:
+    return None
+  return getattr(span_state, 'trace', None)
+
+
+
+def span_set_trace(trace_id):
+  span_state.trace = trace_id
+
+
+
+def span_record(name, trace_id, start, end, args=None):
+  """
+  Queue a span of the call with the given trace. start and end are
+  time.time() values. args is a dict of what to show with the span.
+  """
+  if len(span_queue) < SPAN_QUEUE_SIZE:
+    span_queue.append(('X', name, trace_id, start, end, threading.current_thread().ident, args))
+
+
+
+def span_record_flow(flow_id, start):
+  # The end of the flow from the application's exchange with the proxy.
+  if len(span_queue) < SPAN_QUEUE_SIZE:
+    span_queue.append(('f', 'proxy call', flow_id, start, start, threading.current_thread().ident, None))
+
+
+
+def _span_writer():
+  while True:
+    time.sleep(SPAN_WRITE_INTERVAL)
+    _span_drain()
+
+
+
+def _span_drain():
+  lines = []
+  pid = os.getpid()
+
+  while span_queue:
+    phase, name, span_id, start, end, tid, args = span_queue.popleft()
+    event = {'name' : name, 'cat' : 'proxy', 'ph' : phase, 'ts' : round(start * 1e6, 3),
+             'pid' : pid, 'tid' : tid}
+
+    if phase == 'X':
+      event['dur'] = round((end - start) * 1e6, 3)
+      event['args'] = dict(args or {}, trace_id=span_id)
+    else:
+      event['id'] = span_id
+      event['bp'] = 'e'
+
+    lines.append(json.dumps(event, separators=(',', ':')) + ',\n')
+
+  if lines:
+    span_file.write(''.join(lines))
+    span_file.flush()
+
+
+
+def shim_span(name, fd, trace_id, start, result):
+  # The span of a send or receive through the shim stack of fd.
+  try:
+    sockobj = socketobjecttable[filedescriptortable[fd]['socketobjectid']]
+    stack_str = getattr(sockobj, 'libnit_shim_string', shim_string)
+  except KeyError:
+    stack_str = ''
+
+  span_record(name, trace_id, start, time.time(), {'fd' : fd, 'bytes' : result, 'stack' : stack_str})
 
 
 
@@ -139,37 +888,17 @@ def block_call(call_func, *args):
 
 def get_available_port(conn_type):
   """
-  Find a free port that is available and return it.
+  Find a free port that is available and return it. The free ports are
+  kept by lind, so this does not depend on how many are in use.
   """
   
-  resource_type = ''
-
   if conn_type == 'tcp':
-    resource_type = 'connport'
+    return _get_available_tcp_port()
   elif conn_type == 'udp':
-    resource_type = 'messport'
+    return _get_available_udp_port()
   else:
     raise Exception("Conn type must be udp or tcp")
 
-  # We look up the allowed ports and which ports are already being used.
-  # Then we pick an available port and return it.
-  (resource_list_limit, resource_list_usage, stoptimes) = getresources()
-  available_ports = list(resource_list_limit[resource_type] - resource_list_usage[resource_type])
-
-  # Choose a random port out of the available ports.
-  rand_index = int(randomfloat() * (len(available_ports)-1))
-
-  if rand_index < 0:
-    raise Exception("No localports available")
-
-  try:
-    port = int(available_ports[rand_index])
-  except:
-    log("index is: " + str(rand_index) + " Available_ports: " + str(available_ports))
-    raise
-
-  return port
-
 
 
 # ========================== Define Posix Calls to Their Repy Alternative ======================
@@ -235,13 +964,22 @@ def call_accept(arg_list_str):
     # If we can't split the argument properly.
     return ('', error_dict["EINVAL"])
 
-  # Call the accept call from lind.
+  accept_queue_lock.acquire()
+  if fd not in accept_queue_dict:
+    accept_queue_dict[fd] = AcceptQueue()
+  accept_queue = accept_queue_dict[fd]
+  accept_queue_lock.release()
+
+  # Call the accept call from lind, once it is our turn.
+  accept_queue.enter()
   try:
     remoteip, remoteport, newsock_fd = accept_syscall(fd)
   except UnimplementedError:
     return ('', error_dict["EPROTONOSUPPORT"])
   except SyscallError, (err_call, err_name, err_msg):
     return ('', error_dict[err_name])
+  finally:
+    accept_queue.leave()
 
   # The return value will be in the form: "remoteip,remoteport,newsock_fd"
   return_val = ','.join([remoteip, str(remoteport), str(newsock_fd)])
@@ -345,6 +1083,19 @@ def call_close(arg_list_str):
     return ('', error_dict["EINVAL"])
 
 
+  # Another process still uses the socket.
+  sock_attach_lock.acquire()
+  if sock_attach_count.get(fd, 0) > 0:
+    sock_attach_count[fd] -= 1
+    sock_attach_lock.release()
+    return ('0', -1)
+  sock_attach_count.pop(fd, None)
+  sock_attach_lock.release()
+
+  accept_queue_lock.acquire()
+  accept_queue_dict.pop(fd, None)
+  accept_queue_lock.release()
+
   # Call the listen call from lind.
   try:
     return_val = close_syscall(fd)
@@ -359,6 +1110,27 @@ def call_close(arg_list_str):
 
 
 
+def call_attach(arg_list_str):
+  # The only argument is the fd of the socket a forked process
+  # inherited.
+  try:
+    fd = int(arg_list_str)
+  except:
+    return ('', error_dict["EINVAL"])
+
+  if fd not in filedescriptortable:
+    return ('', error_dict["EBADF"])
+
+  sock_attach_lock.acquire()
+  sock_attach_count[fd] = sock_attach_count.get(fd, 0) + 1
+  sock_attach_lock.release()
+
+  return ('0', -1)
+
+
+
+
+
 
 def call_setsockopt(arg_list_str):
   # Parse the arguments and get the fd and how.
@@ -474,6 +1246,9 @@ def call_send(arg_list_str):
   fd = int(fd_str)
   flags = int(flags_str)
   
+  trace_id = span_trace()
+  start = trace_id and time.time()
+
   # Call the send call from lind.
   try:
     return_val = send_syscall(fd, msg, flags)
@@ -482,6 +1257,9 @@ def call_send(arg_list_str):
   except SyscallError, (err_call, err_name, err_msg):
     return ('', error_dict[err_name])
 
+  if trace_id:
+    shim_span('shim send', fd, trace_id, start, return_val)
+
   return (str(return_val), -1)
   
   
@@ -518,6 +1296,9 @@ def call_write(arg_list_str):
 
   fd = int(fd_str)
   
+  trace_id = span_trace()
+  start = trace_id and time.time()
+
   # Call the write call from lind.
   try:
     return_val = send_syscall(fd, msg,0)
@@ -526,6 +1307,9 @@ def call_write(arg_list_str):
   except SyscallError, (err_call, err_name, err_msg):
     return ('', error_dict[err_name])
 
+  if trace_id:
+    shim_span('shim send', fd, trace_id, start, return_val)
+
   return (str(return_val), -1)
 
 
@@ -539,6 +1323,9 @@ def call_recv(arg_list_str):
   recv_size = int(recv_size_str)
   flags = int(flags_str)
 
+  trace_id = span_trace()
+  start = trace_id and time.time()
+
   # Call the send call from lind.
   try:
     return_msg = recv_syscall(fd, recv_size, flags)
@@ -547,11 +1334,35 @@ def call_recv(arg_list_str):
   except SyscallError, (err_call, err_name, err_msg):
     return ('', error_dict[err_name])
 
+  if trace_id:
+    shim_span('shim recv', fd, trace_id, start, len(return_msg))
+
   return (return_msg, -1)
   
 
 
 
+def call_recv_nowait(arg_list_str):
+  # A recv() of a batch must not hold up the calls behind it, so it
+  # never waits for data: it fails with EAGAIN instead, like a recv()
+  # with MSG_DONTWAIT.
+  fd_str, recv_size_str, flags_str = arg_list_str.split(',')
+
+  try:
+    return_msg = recv_syscall(int(fd_str), int(recv_size_str), int(flags_str) | O_NONBLOCK)
+  except SocketWouldBlockError:
+    return ('', error_dict["EAGAIN"])
+  except UnimplementedError:
+    return ('', error_dict["EPROTONOSUPPORT"])
+  except SyscallError, (err_call, err_name, err_msg):
+    return ('', error_dict[err_name])
+
+  return (return_msg, -1)
+
+
+
+
+
 def call_recvfrom(connection_id, arg_list_str):
   # Get the argument of recv length out.
   fd_str, recv_size_str, flags_str = arg_list_str.split(',')
@@ -584,6 +1395,9 @@ def call_read(arg_list_str):
   fd = int(fd_str)
   recv_size = int(recv_size_str)
 
+  trace_id = span_trace()
+  start = trace_id and time.time()
+
   # Call the read call from lind.
   try:
     return_msg = recv_syscall(fd, recv_size, 0)
@@ -592,12 +1406,195 @@ def call_read(arg_list_str):
   except SyscallError, (err_call, err_name, err_msg):
     return ('', error_dict[err_name])
 
+  if trace_id:
+    shim_span('shim recv', fd, trace_id, start, len(return_msg))
+
   return (return_msg, -1)
 
 
 
 
 
+def get_relay_socket(fd):
+  """
+  <Purpose>
+    Find the kernel socket behind a connected lind TCP socket, so the
+    proxy can relay its data directly.
+
+  <Arguments>
+    fd - the lind socket fd.
+
+  <Exceptions>
+    SyscallError - raised if the socket can not be relayed, either
+        because it is not a connected TCP socket or because some data
+        is already buffered for it in lind.
+
+  <Return>
+    The python socket object of the outbound connection.
+  """
+
+  if fd not in filedescriptortable:
+    raise SyscallError("get_relay_socket", "EBADF", "Invalid file descriptor.")
+
+  fd_entry = filedescriptortable[fd]
+
+  if 'protocol' not in fd_entry or fd_entry['protocol'] != IPPROTO_TCP or fd_entry['state'] != CONNECTED:
+    raise SyscallError("get_relay_socket", "EOPNOTSUPP", "Only connected TCP sockets can be relayed.")
+
+  if fd_entry.get('last_peek', ''):
+    raise SyscallError("get_relay_socket", "EOPNOTSUPP", "The socket has buffered data.")
+
+  sockobj = _repy_socket(socketobjecttable[fd_entry['socketobjectid']])
+
+  if getattr(sockobj, 'socketobj', None) is None:
+    raise SyscallError("get_relay_socket", "EOPNOTSUPP", "The socket has no kernel socket.")
+
+  return sockobj.socketobj
+
+
+
+
+
+def call_relay(arg_list_str):
+  # The only argument is the fd of the socket to relay.
+  try:
+    fd = int(arg_list_str)
+  except:
+    # If we can't split the argument properly.
+    return ('', error_dict["EINVAL"])
+
+  try:
+    get_relay_socket(fd)
+  except SyscallError, (err_call, err_name, err_msg):
+    return ('0', -1)
+
+  # We can only relay if the shims would not have touched the data.
+  if not socket_shim_is_identity(socketobjecttable[filedescriptortable[fd]['socketobjectid']]):
+    return ('0', -1)
+
+  return ('1', -1)
+
+
+
+
+
+def call_lane(arg_list_str):
+  # The only argument is the fd of the socket the lane belongs to.
+  try:
+    fd = int(arg_list_str)
+  except:
+    return ('', error_dict["EINVAL"])
+
+  if fd not in filedescriptortable:
+    return ('', error_dict["EBADF"])
+
+  if not IS_SOCK(filedescriptortable[fd]['mode']):
+    return ('', error_dict["ENOTSOCK"])
+
+  return ('0', -1)
+
+
+
+
+
+# The system resolver does not tell us the TTL of the records, so the
+# answers carry a TTL of 0 and the interposer keeps them for as long as
+# it is configured to (LIBNIT_DNS_TTL).
+DNS_UNKNOWN_TTL = 0
+
+# The errors that mean the name does not exist (rather than that the
+# lookup failed for now).
+dns_not_found_errors = [python_socket.EAI_NONAME, getattr(python_socket, 'EAI_NODATA', -5), 1]
+
+# The top shim of the stack that resolves names, built on first use.
+dns_top_shim = None
+dns_top_shim_lock = threading.Lock()
+
+
+
+def resolve_name(name, reverse=False):
+  """
+  <Purpose>
+    Resolve a host name, or the host name of an address. If the top
+    shim of the stack can do this itself (it has a gethostbyname() or
+    gethostbyaddr() method), it is asked instead of the system.
+
+  <Arguments>
+    name - the host name or the dotted IPv4 address.
+    reverse - True to look up the host name of the address.
+
+  <Exceptions>
+    Whatever the shim or the socket module raises on failure.
+
+  <Return>
+    A list of IPv4 addresses, or the host name for a reverse lookup.
+  """
+  global dns_top_shim
+
+  if dns_top_shim is None:
+    dns_top_shim_lock.acquire()
+    try:
+      if dns_top_shim is None:
+        dns_top_shim = ShimStack(shim_string, shim_obj.getmyip()).peek()
+    finally:
+      dns_top_shim_lock.release()
+
+  top_shim = dns_top_shim
+
+  if reverse:
+    if hasattr(top_shim, 'gethostbyaddr'):
+      return top_shim.gethostbyaddr(name)
+    return python_socket.gethostbyaddr(name)[0]
+
+  if hasattr(top_shim, 'gethostbyname'):
+    return [top_shim.gethostbyname(name)]
+  return python_socket.gethostbyname_ex(name)[2]
+
+
+
+
+
+def call_gethostbyname(arg_list_str):
+  # The only argument is the name. Only the resolver can tell that a
+  # name does not exist; anything else that goes wrong is a temporary
+  # failure, which the interposer does not cache.
+  try:
+    addr_list = resolve_name(arg_list_str)
+  except (python_socket.gaierror, python_socket.herror), err:
+    if err.args[0] in dns_not_found_errors:
+      return ('', error_dict["ENOENT"])
+    return ('', error_dict["EAGAIN"])
+  except Exception, err:
+    return ('', error_dict["EAGAIN"])
+
+  if not addr_list:
+    return ('', error_dict["ENOENT"])
+
+  # The return value will be in the form: "ttl,ip,ip,..."
+  return (','.join([str(DNS_UNKNOWN_TTL)] + addr_list), -1)
+
+
+
+
+
+def call_gethostbyaddr(arg_list_str):
+  # The only argument is the dotted address.
+  try:
+    hostname = resolve_name(arg_list_str, reverse=True)
+  except (python_socket.gaierror, python_socket.herror), err:
+    if err.args[0] in dns_not_found_errors:
+      return ('', error_dict["ENOENT"])
+    return ('', error_dict["EAGAIN"])
+  except Exception, err:
+    return ('', error_dict["EAGAIN"])
+
+  # The return value will be in the form: "ttl,hostname"
+  return (str(DNS_UNKNOWN_TTL) + ',' + hostname, -1)
+
+
+
+
+
 def call_ioctl(connection_id, arg_list_str):
   pass
 
@@ -636,3 +1633,212 @@ def call_fcntl(connection_id, arg_list_str):
 
 
 # ========================== End Posic Calls Definition ========================================
+
+
+
+
+# ========================== Socket Handoff ====================================================
+
+# A proxy can hand its sockets over to a new instance of itself (see
+# LIBNIT_PROXY_HANDOFF in smart_shim_proxy.py). These calls take lind
+# sockets out of the tables of one instance and put them into the
+# tables of the other, under the same fd. The kernel sockets themselves
+# are passed along by the caller.
+
+def _handoff_parts(sockobj):
+  # The repy sockets behind a lind socket object: two for the composite
+  # sockets that listen on both the loopback and the public address.
+  if isinstance(sockobj, (CompositeTCPSocket, CompositeUDPSocket)):
+    return (sockobj.ip1, sockobj.ip2, sockobj.port), [sockobj.c1, sockobj.c2]
+  return None, [sockobj]
+
+
+
+def _repy_socket(sockobj):
+  # Peel off the shim socket wrappers down to the repy socket.
+  while hasattr(sockobj, '_socket'):
+    sockobj = sockobj._socket
+  return sockobj
+
+
+
+def handoff_export_socket(fd):
+  """
+  <Purpose>
+    Describe a lind socket so that another proxy can take it over.
+    Only sockets whose shims leave the stream untouched can be moved
+    in the middle of a stream, since the shims of the other proxy start
+    out without the state of ours.
+
+  <Arguments>
+    fd - the lind socket fd.
+
+  <Exceptions>
+    SyscallError - raised if the socket can not be moved.
+
+  <Return>
+    A tuple (record, kernel_socks). The record holds only plain values
+    (see handoff_import_socket()), kernel_socks the python socket
+    objects to pass along with it.
+  """
+
+  if fd not in filedescriptortable:
+    raise SyscallError("handoff_export_socket", "EBADF", "Invalid file descriptor.")
+
+  fd_entry = filedescriptortable[fd]
+
+  if not IS_SOCK(fd_entry.get('mode', 0)):
+    raise SyscallError("handoff_export_socket", "ENOTSOCK", "The descriptor is not a socket.")
+
+  # connect() has not finished yet, and there is no socket to move.
+  if fd_entry.get('state') == CONNECTING:
+    raise SyscallError("handoff_export_socket", "EOPNOTSUPP", "The socket is connecting.")
+
+  entry = {}
+  for key, value in fd_entry.items():
+    if key not in ('lock', 'socketobjectid'):
+      entry[key] = value
+
+  sock_attach_lock.acquire()
+  attach_count = sock_attach_count.get(fd, 0)
+  sock_attach_lock.release()
+
+  record = {'fd' : fd, 'entry' : entry, 'attach' : attach_count, 'stack' : None,
+            'composite' : None, 'parts' : []}
+
+  # Sockets that were not connected or listened on yet have no socket
+  # object.
+  if 'socketobjectid' not in fd_entry:
+    return record, []
+
+  sockobj = socketobjecttable[fd_entry['socketobjectid']]
+
+  if not socket_shim_is_identity(sockobj):
+    raise SyscallError("handoff_export_socket", "EOPNOTSUPP", "The shims of the socket keep state.")
+
+  record['stack'] = getattr(sockobj, 'libnit_shim_string', None)
+  record['composite'], parts = _handoff_parts(sockobj)
+
+  kernel_socks = []
+  for part in parts:
+    repy_sock = _repy_socket(part)
+
+    if isinstance(repy_sock, EmulatedSocket):
+      kind = 'conn'
+    elif isinstance(repy_sock, TCPServerSocket):
+      kind = 'listen'
+    elif isinstance(repy_sock, UDPServerSocket):
+      kind = 'udp'
+    else:
+      raise SyscallError("handoff_export_socket", "EOPNOTSUPP", "Unknown socket object.")
+
+    if repy_sock.socketobj is None:
+      raise SyscallError("handoff_export_socket", "EOPNOTSUPP", "The socket has no kernel socket.")
+
+    record['parts'].append((kind, repy_sock.on_loopback))
+    kernel_socks.append(repy_sock.socketobj)
+
+  return record, kernel_socks
+
+
+
+def handoff_import_socket(record, kernel_socks):
+  """
+  <Purpose>
+    Take over a lind socket that another proxy described with
+    handoff_export_socket(). It keeps its fd, and the shim stack it was
+    opened with even if our default stack differs.
+
+  <Arguments>
+    record - the record of the socket.
+    kernel_socks - the python socket objects of its kernel sockets.
+
+  <Return>
+    None
+  """
+
+  fd = record['fd']
+  entry = record['entry']
+  entry['lock'] = createlock()
+
+  if record['parts']:
+    stack_str = record['stack'] or "(NoopShim)"
+    shim_interface = get_shim_interface(stack_str)
+
+    parts = []
+    for (kind, on_loopback), kernel_sock in zip(record['parts'], kernel_socks):
+      if kind == 'conn':
+        sockobj = shim_interface.wrapconnection(EmulatedSocket(kernel_sock, on_loopback))
+        sockobj.libnit_shim_string = stack_str
+      elif kind == 'listen':
+        sockobj = shim_interface.wrapserversocket(TCPServerSocket(kernel_sock, on_loopback))
+      else:
+        sockobj = shim_interface.wrapmessagesocket(UDPServerSocket(kernel_sock, on_loopback))
+      parts.append(sockobj)
+
+    if record['composite']:
+      if record['parts'][0][0] == 'listen':
+        sockobj = CompositeTCPSocket.__new__(CompositeTCPSocket)
+      else:
+        sockobj = CompositeUDPSocket.__new__(CompositeUDPSocket)
+      sockobj.ip1, sockobj.ip2, sockobj.port = record['composite']
+      sockobj.c1, sockobj.c2 = parts
+    else:
+      sockobj = parts[0]
+
+    entry['socketobjectid'] = _insert_into_socketobjecttable(sockobj)
+
+  # Sockets bound with SO_REUSEPORT share their port.
+  if 'localport' in entry and not _is_localport_reserved(entry['localport'], entry['protocol']):
+    _reserve_localport(entry['localport'], entry['protocol'])
+
+  _store_fd(fd, entry)
+
+  if record['attach']:
+    sock_attach_lock.acquire()
+    sock_attach_count[fd] = record['attach']
+    sock_attach_lock.release()
+
+
+
+def handoff_release_socket(repy_sock):
+  """
+  <Purpose>
+    Close our copy of the kernel socket of a repy socket that was
+    handed over. The repy socket lets go of it first, so that it does
+    not shut down the connection when it is closed or collected.
+  """
+
+  repy_sock.sock_lock.acquire()
+  kernel_sock = repy_sock.socketobj
+  repy_sock.socketobj = None
+  repy_sock.sock_lock.release()
+
+  if kernel_sock is not None:
+    kernel_sock.close()
+
+
+
+def handoff_forget_socket(fd):
+  """
+  <Purpose>
+    Drop a lind socket that was handed over from our tables, without
+    closing it.
+  """
+
+  fd_entry = filedescriptortable.pop(fd)
+
+  if 'socketobjectid' in fd_entry:
+    sockobj = socketobjecttable[fd_entry['socketobjectid']]
+    _remove_from_socketobjecttable(fd_entry['socketobjectid'])
+
+    for part in _handoff_parts(sockobj)[1]:
+      handoff_release_socket(_repy_socket(part))
+
+  sock_attach_lock.acquire()
+  sock_attach_count.pop(fd, None)
+  sock_attach_lock.release()
+
+  accept_queue_lock.acquire()
+  accept_queue_dict.pop(fd, None)
+  accept_queue_lock.release()
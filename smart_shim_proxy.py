@@ -11,6 +11,19 @@ add_dy_support(_context)
 dy_import_module_symbols("random")
 dy_import_module_symbols("struct")
 
+import os
+import re
+import sys
+import time
+import errno
+import ctypes
+import signal
+import marshal
+import threading
+import collections
+import socket as python_socket
+import struct as python_struct
+
 
 proxy_ip = "127.0.0.1"
 proxy_port = 53678
@@ -38,33 +51,1186 @@ libc_function_dict = { "socket" : call_socket,
                        "recvfrom" : call_recvfrom,
                        "read" : call_read,
                        "ioctl" : call_ioctl,
-                       "fcntl" : call_fcntl
+                       "fcntl" : call_fcntl,
+                       "relay" : call_relay,
+                       "lane" : call_lane,
+                       "attach" : call_attach,
+                       "gethostbyname" : call_gethostbyname,
+                       "gethostbyaddr" : call_gethostbyaddr
                   }
 
 
+# The splice() call is used to relay connections without copying
+# the data into the proxy. If it is not available we fall back to
+# copying in user space.
+SPLICE_F_MOVE = 1
+SPLICE_F_MORE = 4
+RELAY_CHUNK_SIZE = 65536
+
+try:
+  _libc = ctypes.CDLL(None, use_errno=True)
+  _splice = _libc.splice
+  _splice.argtypes = [ctypes.c_int, ctypes.c_void_p, ctypes.c_int,
+                      ctypes.c_void_p, ctypes.c_size_t, ctypes.c_uint]
+  _splice.restype = ctypes.c_ssize_t
+except (OSError, AttributeError):
+  _splice = None
+
+
+
+# =================== Logging ============================================
+
+# The proxy logs through a queue that a background thread writes out,
+# so the handler threads never wait on the terminal. Messages above
+# log_level (LIBNIT_PROXY_LOG_LEVEL: error, warn, info or debug) are
+# dropped before they are formatted, and LIBNIT_PROXY_LOG_SAMPLE
+# ("call=100") keeps only one in every N messages of a category. The
+# messages go to LIBNIT_PROXY_LOG_FILE, or stdout if it is not set.
+# The per-call messages are debug messages, so the default level costs
+# a compare per call.
+LOG_ERROR = 0
+LOG_WARN = 1
+LOG_INFO = 2
+LOG_DEBUG = 3
+
+LOG_LEVEL_NAMES = ['error', 'warn', 'info', 'debug']
+LOG_QUEUE_SIZE = 65536
+LOG_WRITE_INTERVAL = 0.05
+
+log_level = LOG_INFO
+log_sample = {}
+log_sample_count = {}
+log_queue = collections.deque()
+log_dropped = [0]
+log_file = sys.stdout
+
+
+
+def log_configure():
+  """
+  <Purpose>
+    Read the log settings from the environment and start the thread
+    that writes the log.
+
+  <Return>
+    None
+  """
+  global log_level
+  global log_file
+
+  level_str = os.environ.get('LIBNIT_PROXY_LOG_LEVEL', '')
+  if level_str.isdigit():
+    log_level = int(level_str)
+  elif level_str.lower() in LOG_LEVEL_NAMES:
+    log_level = LOG_LEVEL_NAMES.index(level_str.lower())
+
+  for item in os.environ.get('LIBNIT_PROXY_LOG_SAMPLE', '').split(','):
+    if '=' in item:
+      category, rate = item.split('=', 1)
+      if rate.isdigit() and int(rate) > 1:
+        log_sample[category] = int(rate)
+        log_sample_count[category] = 0
+
+  if os.environ.get('LIBNIT_PROXY_LOG_FILE'):
+    log_file = open(os.environ['LIBNIT_PROXY_LOG_FILE'], 'a')
+
+  writer = threading.Thread(target=_log_writer)
+  writer.setDaemon(True)
+  writer.start()
+
+
+
+def log(level, category, fmt, *args):
+  """
+  <Purpose>
+    Queue a log message. The message is only formatted (fmt % args) by
+    the writer thread. Callers on the hot path should check level
+    against log_level first, so a disabled message does not even build
+    its args.
+
+  <Arguments>
+    level - one of LOG_ERROR, LOG_WARN, LOG_INFO and LOG_DEBUG.
+    category - the category the message is sampled by, e.g. 'call'.
+    fmt, args - the message.
+
+  <Return>
+    None
+  """
+  if level > log_level:
+    return
+
+  rate = log_sample.get(category)
+  if rate:
+    # A lost update only shifts which message is sampled.
+    count = log_sample_count[category]
+    log_sample_count[category] = count + 1
+    if count % rate:
+      return
+
+  # deque.append() is atomic, the handler threads do not take a lock.
+  if len(log_queue) >= LOG_QUEUE_SIZE:
+    log_dropped[0] += 1
+    return
+
+  log_queue.append((time.time(), level, category, fmt, args))
+
+
+
+def _log_writer():
+  """
+  The thread that formats and writes out the queued messages.
+  """
+  while True:
+    time.sleep(LOG_WRITE_INTERVAL)
+    _log_drain()
+
+
+
+def _log_drain():
+  lines = []
+
+  while log_queue:
+    timestamp, level, category, fmt, args = log_queue.popleft()
+    try:
+      message = fmt % args
+    except Exception, err:
+      message = "%r %% %r: %s" % (fmt, args, err)
+    lines.append("%.6f [ShimProxy] %s %s: %s\n" % (timestamp, LOG_LEVEL_NAMES[level], category, message))
+
+  if log_dropped[0]:
+    lines.append("[ShimProxy] %d log messages dropped\n" % log_dropped[0])
+    log_dropped[0] = 0
+
+  if lines:
+    log_file.write(''.join(lines))
+    log_file.flush()
+
+
+
+
+# =================== Statistics =========================================
+
+# With LIBNIT_PROXY_STATS set to a path, the proxy keeps counters for
+# every control connection and every socket, and serves a snapshot of
+# them on a Unix socket at that path. Each ConnStats is only updated by
+# the thread that handles its connection (and, for a relay, by the two
+# threads that copy one direction each), so the handlers never take a
+# lock for them. A snapshot may be a call behind. Send "binary\n" for
+# the binary form (see stats_binary()), anything else for the text
+# form:
+#   $ echo | socat - UNIX-CONNECT:/tmp/libnit.stats
+# The snapshot includes the accounting of the shim layers (see
+# ShimLayerStats) while it is on. "layers on\n" and "layers off\n"
+# turn it on and off, "profile [seconds]\n" starts the profiler.
+STATS_MAGIC = 'LIBNITS1'
+STATS_REQUEST_TIMEOUT = 1.0
+
+# A call that takes longer than this blocked.
+STATS_BLOCKED_TIME = 0.01
+
+# The calls that go through the shim stack of their socket.
+STATS_SEND_CALLS = ('send', 'write', 'sendto')
+STATS_RECV_CALLS = ('recv', 'read', 'recvfrom')
+
+stats_enabled = False
+stats_started = time.time()
+stats_conn_dict = {}
+stats_conn_count = [0]
+stats_lock = threading.Lock()
+
+# The totals of the connections that have gone away: bytes in, bytes
+# out, calls, blocked calls and seconds in the shim stack.
+stats_retired = [0, 0, 0, 0, 0.0]
+
+
+
+class ConnStats:
+  """
+  The counters of one control connection, and of the sockets it made
+  calls on: sock_dict maps the fd to its bytes in, bytes out, calls and
+  seconds in the shim stack.
+  """
+  def __init__(self, conn_id, peer):
+    self.conn_id = conn_id
+    self.peer = peer
+    self.sockfd = None
+    self.bytes_in = 0
+    self.bytes_out = 0
+    self.calls = {}
+    self.blocked = 0
+    self.pending = 0
+    self.shim_time = 0.0
+    self.sock_dict = {}
+
+  def sock(self, fd):
+    sock_stats = self.sock_dict.get(fd)
+    if sock_stats is None:
+      sock_stats = self.sock_dict[fd] = [0, 0, 0, 0.0]
+    return sock_stats
+
+  def record(self, call_func, fd, start, end, return_val, err_val):
+    self.calls[call_func] = self.calls.get(call_func, 0) + 1
+
+    if end - start >= STATS_BLOCKED_TIME:
+      self.blocked += 1
+
+    if fd is None:
+      return
+
+    sock_stats = self.sock(fd)
+    sock_stats[2] += 1
+
+    if call_func in STATS_SEND_CALLS:
+      if err_val == -1:
+        sock_stats[1] += int(return_val)
+    elif call_func in STATS_RECV_CALLS:
+      sock_stats[0] += len(return_val)
+    else:
+      return
+
+    self.shim_time += end - start
+    sock_stats[3] += end - start
+
+
+
+def stats_configure(stats_path):
+  """
+  <Purpose>
+    Start serving the statistics on a Unix socket at stats_path. A
+    socket left behind by an earlier proxy is replaced.
+
+  <Arguments>
+    stats_path - the path of the Unix socket.
+
+  <Exceptions>
+    python_socket.error if the socket can not be bound.
+
+  <Return>
+    None
+  """
+  global stats_enabled
+
+  if os.path.exists(stats_path):
+    os.unlink(stats_path)
+
+  server_sock = python_socket.socket(python_socket.AF_UNIX, python_socket.SOCK_STREAM)
+  server_sock.bind(stats_path)
+  server_sock.listen(16)
+
+  stats_enabled = True
+
+  server = threading.Thread(target=_stats_server, args=(server_sock,))
+  server.setDaemon(True)
+  server.start()
+
+
+
+def stats_open(peer):
+  # The stats of a new control connection, None if stats are off.
+  if not stats_enabled:
+    return None
+
+  stats_lock.acquire()
+  stats_conn_count[0] += 1
+  conn_stats = ConnStats(stats_conn_count[0], peer)
+  stats_conn_dict[conn_stats.conn_id] = conn_stats
+  stats_lock.release()
+
+  return conn_stats
+
+
+
+def stats_close(conn_stats):
+  stats_lock.acquire()
+  stats_retired[0] += conn_stats.bytes_in
+  stats_retired[1] += conn_stats.bytes_out
+  stats_retired[2] += sum(conn_stats.calls.values())
+  stats_retired[3] += conn_stats.blocked
+  stats_retired[4] += conn_stats.shim_time
+  del stats_conn_dict[conn_stats.conn_id]
+  stats_lock.release()
+
+
+
+def stats_snapshot():
+  """
+  <Purpose>
+    Take a snapshot of the counters.
+
+  <Return>
+    A tuple of the totals (bytes in, bytes out, calls, blocked calls
+    and shim seconds, of all connections so far), a list of the
+    ConnStats of the open connections with copies of their calls, and
+    a dict that maps every socket to its bytes in, bytes out, calls,
+    shim seconds and the accept() calls waiting on it.
+  """
+  stats_lock.acquire()
+  totals = list(stats_retired)
+  conn_list = stats_conn_dict.values()
+  stats_lock.release()
+
+  snapshot = []
+  sock_dict = {}
+
+  for conn_stats in conn_list:
+    calls = dict(conn_stats.calls)
+    snapshot.append((conn_stats, calls))
+
+    totals[0] += conn_stats.bytes_in
+    totals[1] += conn_stats.bytes_out
+    totals[2] += sum(calls.values())
+    totals[3] += conn_stats.blocked
+    totals[4] += conn_stats.shim_time
+
+    # A socket may have calls on several connections (read lanes,
+    # forked processes).
+    for fd, sock_stats in conn_stats.sock_dict.items():
+      merged = sock_dict.setdefault(fd, [0, 0, 0, 0.0, 0])
+      for index in xrange(4):
+        merged[index] += sock_stats[index]
+
+  for fd in sock_dict:
+    accept_queue = accept_queue_dict.get(int(fd))
+    if accept_queue:
+      sock_dict[fd][4] = accept_queue.next_ticket - accept_queue.now_serving
+
+  return (totals, snapshot, sock_dict)
+
+
+
+def stats_text():
+  """
+  The snapshot in the Prometheus text format.
+  """
+  totals, snapshot, sock_dict = stats_snapshot()
+
+  lines = ["libnit_proxy_uptime_seconds %.3f" % (time.time() - stats_started),
+           "libnit_proxy_connections %d" % len(snapshot),
+           "libnit_proxy_connections_total %d" % stats_conn_count[0],
+           "libnit_proxy_log_queue %d" % len(log_queue),
+           "libnit_proxy_span_queue %d" % len(span_queue),
+           "libnit_proxy_bytes_in_total %d" % totals[0],
+           "libnit_proxy_bytes_out_total %d" % totals[1],
+           "libnit_proxy_calls_total %d" % totals[2],
+           "libnit_proxy_blocked_calls_total %d" % totals[3],
+           "libnit_proxy_shim_seconds_total %.6f" % totals[4]]
+
+  for conn_stats, calls in snapshot:
+    labels = 'conn="%d",peer="%s",fd="%s"' % (conn_stats.conn_id, conn_stats.peer, conn_stats.sockfd or '')
+    lines.append("libnit_conn_bytes_in{%s} %d" % (labels, conn_stats.bytes_in))
+    lines.append("libnit_conn_bytes_out{%s} %d" % (labels, conn_stats.bytes_out))
+    lines.append("libnit_conn_blocked_calls{%s} %d" % (labels, conn_stats.blocked))
+    lines.append("libnit_conn_pending_calls{%s} %d" % (labels, conn_stats.pending))
+    lines.append("libnit_conn_shim_seconds{%s} %.6f" % (labels, conn_stats.shim_time))
+    for call_func, count in sorted(calls.items()):
+      lines.append('libnit_conn_calls{conn="%d",call="%s"} %d' % (conn_stats.conn_id, call_func, count))
+
+  for fd, sock_stats in sorted(sock_dict.items()):
+    labels = 'fd="%s"' % fd
+    lines.append("libnit_sock_bytes_in{%s} %d" % (labels, sock_stats[0]))
+    lines.append("libnit_sock_bytes_out{%s} %d" % (labels, sock_stats[1]))
+    lines.append("libnit_sock_calls{%s} %d" % (labels, sock_stats[2]))
+    lines.append("libnit_sock_shim_seconds{%s} %.6f" % (labels, sock_stats[3]))
+    lines.append("libnit_sock_accept_queue{%s} %d" % (labels, sock_stats[4]))
+
+  lines.append("libnit_layer_stats_enabled %d" % shim_layer_stats.enabled)
+
+  for stack_str, layer_index, layer_str, op, calls, bytes_in, bytes_out, wall, cpu in shim_layer_stats.snapshot():
+    labels = 'stack="%s",layer="%d",shim="%s",op="%s"' % (_stats_label(stack_str), layer_index,
+                                                           _stats_label(layer_str or '(repy)'), op)
+    lines.append("libnit_layer_calls{%s} %d" % (labels, calls))
+    lines.append("libnit_layer_bytes_in{%s} %d" % (labels, bytes_in))
+    lines.append("libnit_layer_bytes_out{%s} %d" % (labels, bytes_out))
+    lines.append("libnit_layer_wall_seconds{%s} %.6f" % (labels, wall))
+    lines.append("libnit_layer_cpu_seconds{%s} %.6f" % (labels, cpu))
+
+  return '\n'.join(lines) + '\n'
+
+
+
+def _stats_label(value):
+  return value.replace('\\', '\\\\').replace('"', '\\"')
+
+
+
+def stats_binary():
+  """
+  <Purpose>
+    The snapshot in binary form. All numbers are little endian:
+
+      header: char magic[8] ("LIBNITS1"), double timestamp,
+              uint32 connections_total, uint32 log_queue,
+              uint32 span_queue, uint64 bytes_in, uint64 bytes_out,
+              uint64 calls, uint64 blocked, double shim_seconds,
+              uint32 connection_count, uint32 socket_count
+      then per connection: uint32 conn_id, int32 fd (-1 if none),
+              uint64 bytes_in, uint64 bytes_out, uint64 blocked,
+              uint32 pending, double shim_seconds, uint8 peer_len,
+              char peer[peer_len], uint16 call_count, and call_count
+              times: uint8 name_len, char name[name_len], uint64 count
+      then per socket: int32 fd, uint64 bytes_in, uint64 bytes_out,
+              uint64 calls, double shim_seconds, uint32 accept_queue
+      then uint32 layer_count, and per layer and operation:
+              uint16 stack_len, char stack[stack_len], uint16 layer,
+              uint16 shim_len, char shim[shim_len], uint8 op (0 for
+              send, 1 for recv), uint64 calls, uint64 bytes_in,
+              uint64 bytes_out, double wall_seconds, double cpu_seconds
+
+  <Return>
+    The snapshot as a string.
+  """
+  totals, snapshot, sock_dict = stats_snapshot()
+
+  parts = [python_struct.pack('<8sdIIIQQQQdII', STATS_MAGIC, time.time(), stats_conn_count[0],
+                              len(log_queue), len(span_queue), totals[0], totals[1], totals[2],
+                              totals[3], totals[4], len(snapshot), len(sock_dict))]
+
+  for conn_stats, calls in snapshot:
+    sockfd = conn_stats.sockfd
+    parts.append(python_struct.pack('<IiQQQIdB', conn_stats.conn_id, int(sockfd or -1), conn_stats.bytes_in,
+                                    conn_stats.bytes_out, conn_stats.blocked, conn_stats.pending,
+                                    conn_stats.shim_time, len(conn_stats.peer)))
+    parts.append(conn_stats.peer)
+    parts.append(python_struct.pack('<H', len(calls)))
+    for call_func, count in calls.items():
+      parts.append(python_struct.pack('<B', len(call_func)) + call_func + python_struct.pack('<Q', count))
+
+  for fd, sock_stats in sock_dict.items():
+    parts.append(python_struct.pack('<iQQQdI', int(fd), sock_stats[0], sock_stats[1], sock_stats[2],
+                                    sock_stats[3], sock_stats[4]))
+
+  layer_snapshot = shim_layer_stats.snapshot()
+  parts.append(python_struct.pack('<I', len(layer_snapshot)))
+
+  for stack_str, layer_index, layer_str, op, calls, bytes_in, bytes_out, wall, cpu in layer_snapshot:
+    parts.append(python_struct.pack('<H', len(stack_str)) + stack_str)
+    parts.append(python_struct.pack('<HH', layer_index, len(layer_str)) + layer_str)
+    parts.append(python_struct.pack('<BQQQdd', op == 'recv', calls, bytes_in, bytes_out, wall, cpu))
+
+  return ''.join(parts)
+
+
+
+def _stats_server(server_sock):
+  """
+  The thread that answers the requests for the statistics, one at a
+  time.
+  """
+  while True:
+    client_sock, address = server_sock.accept()
+
+    try:
+      client_sock.settimeout(STATS_REQUEST_TIMEOUT)
+
+      request = ''
+      while '\n' not in request and len(request) < 64:
+        data = client_sock.recv(64)
+        if not data:
+          break
+        request += data
+
+      request = request.strip()
+
+      if request == 'binary':
+        client_sock.sendall(stats_binary())
+      elif request in ('layers on', 'layers off'):
+        shim_layer_stats.enabled = request == 'layers on'
+        client_sock.sendall(request + '\n')
+      elif request.split(' ')[0] == 'profile':
+        client_sock.sendall(_profile_request(request) + '\n')
+      else:
+        client_sock.sendall(stats_text())
+    except python_socket.error:
+      pass
+
+    client_sock.close()
+
+
+
+
+# =================== Profiler ===========================================
+
+# The proxy profiles itself on demand: on SIGUSR2, or on "profile
+# [seconds]" on the statistics socket. For the window of the profile
+# (LIBNIT_PROXY_PROFILE_SECONDS, 10 by default) a sampler thread looks
+# at the stacks of all the other threads every PROFILE_INTERVAL
+# seconds. At the end it writes how often it saw each stack, as
+# collapsed stacks ("thread;module.function;... count", the input of
+# flamegraph.pl and speedscope), to
+# LIBNIT_PROXY_PROFILE_DIR/proxy.<pid>.<time>.folded. The frames of the
+# repy modules (shims, lind calls) show up like any other. Threads that
+# only wait (see PROFILE_IDLE_FUNCS) are left out unless
+# LIBNIT_PROXY_PROFILE_IDLE=1. Nothing runs while no profile is taken.
+PROFILE_INTERVAL = 0.005
+PROFILE_DEFAULT_SECONDS = 10
+PROFILE_MAX_SECONDS = 600
+
+# A thread in one of these is waiting: block_call sleeps between tries
+# of a blocking call, the others wait for something to write or serve.
+PROFILE_IDLE_FUNCS = ('block_call', '_log_writer', '_span_writer', '_stats_server')
+
+profile_running = [False]
+profile_lock = threading.Lock()
+
+
+
+def profile_start(seconds=None):
+  """
+  <Purpose>
+    Start taking a profile in the background.
+
+  <Arguments>
+    seconds - how long to sample for, LIBNIT_PROXY_PROFILE_SECONDS if
+        not given.
+
+  <Return>
+    The file the profile is written to, or None if a profile is being
+    taken already.
+  """
+  if seconds is None:
+    seconds = float(os.environ.get('LIBNIT_PROXY_PROFILE_SECONDS', PROFILE_DEFAULT_SECONDS))
+  seconds = min(max(seconds, PROFILE_INTERVAL), PROFILE_MAX_SECONDS)
+
+  profile_lock.acquire()
+  if profile_running[0]:
+    profile_lock.release()
+    log(LOG_WARN, 'proxy', "Not profiling, a profile is being taken already")
+    return None
+  profile_running[0] = True
+  profile_lock.release()
+
+  profile_path = os.path.join(os.environ.get('LIBNIT_PROXY_PROFILE_DIR', '.'),
+                              "proxy.%d.%s.folded" % (os.getpid(), time.strftime('%Y%m%d-%H%M%S')))
+
+  sampler = threading.Thread(target=_profile_sampler, args=(seconds, profile_path))
+  sampler.setDaemon(True)
+  sampler.start()
+
+  log(LOG_INFO, 'proxy', "Profiling for %.1f seconds into %s", seconds, profile_path)
+  return profile_path
+
+
+
+def _profile_request(request):
+  # Answer "profile [seconds]" from the statistics socket.
+  try:
+    seconds = None
+    if ' ' in request:
+      seconds = float(request.split(' ', 1)[1])
+  except ValueError:
+    return "usage: profile [seconds]"
+
+  profile_path = profile_start(seconds)
+  if profile_path is None:
+    return "busy"
+  return profile_path
+
+
+
+def _profile_signal(signum, frame):
+  profile_start()
+
+
+
+def _profile_sampler(seconds, profile_path):
+  """
+  The thread that takes the samples and writes out the profile.
+  """
+  keep_idle = os.environ.get('LIBNIT_PROXY_PROFILE_IDLE') == '1'
+  sampler_ident = threading.current_thread().ident
+  stack_counts = {}
+  thread_names = {}
+  samples = 0
+  idle_samples = 0
+
+  end_time = time.time() + seconds
+
+  try:
+    while time.time() < end_time:
+      for ident, frame in sys._current_frames().items():
+        if ident == sampler_ident:
+          continue
+
+        # The threads of a kind are put together: Thread-12 is Thread.
+        if ident not in thread_names:
+          for thread in threading.enumerate():
+            thread_names[thread.ident] = re.sub(r'[-_]?\d+$', '', thread.name)
+
+        stack = []
+        idle = False
+        while frame:
+          code = frame.f_code
+          idle = idle or code.co_name in PROFILE_IDLE_FUNCS
+          stack.append(os.path.splitext(os.path.basename(code.co_filename))[0] + '.' + code.co_name)
+          frame = frame.f_back
+
+        if idle and not keep_idle:
+          idle_samples += 1
+          continue
+
+        stack.append(thread_names.get(ident, 'Thread'))
+        stack.reverse()
+
+        stack_str = ';'.join(stack)
+        stack_counts[stack_str] = stack_counts.get(stack_str, 0) + 1
+        samples += 1
+
+      time.sleep(PROFILE_INTERVAL)
+
+    profile_file = open(profile_path, 'w')
+    for stack_str, count in sorted(stack_counts.items()):
+      profile_file.write("%s %d\n" % (stack_str, count))
+    profile_file.close()
+
+    log(LOG_INFO, 'proxy', "Wrote the profile to %s: %d samples, %d idle samples left out", profile_path, samples, idle_samples)
+  except (IOError, OSError), err:
+    log(LOG_ERROR, 'proxy', "Unable to write the profile %s: %s", profile_path, err)
+
+  profile_lock.acquire()
+  profile_running[0] = False
+  profile_lock.release()
+
+
+
+
+# =================== Handoff ============================================
+
+# With LIBNIT_PROXY_HANDOFF set to a path, a new proxy can take over
+# from a running one without the applications noticing. Every proxy
+# listens on a Unix socket at the path. A new proxy started with the
+# same path connects to it and the old one hands over, with SCM_RIGHTS:
+#
+#   - the listening socket of the control connections, so new
+#     connections queue up in the kernel and go to the new proxy,
+#   - the control connections of the applications, along with the
+#     lind fds they serve and the call they were blocked in, if any,
+#   - the lind sockets, under the same fds, with their table entries.
+#
+# The handler threads hand over their connection between calls, or
+# when their call blocks (see blockedcallhook in lind_net_calls.py),
+# within LIBNIT_PROXY_HANDOFF_TIMEOUT seconds. A socket only moves if
+# its shims leave the stream untouched, since the new shims start out
+# without the state of the old ones. What can not move, and the relayed
+# connections, stay with the old proxy, which serves them until they
+# are closed and then exits.
+HANDOFF_MAGIC = 'LIBNITH1'
+HANDOFF_DEFAULT_TIMEOUT = 5
+
+# The kernel takes at most 253 fds per message (SCM_MAX_FD).
+HANDOFF_FD_BATCH = 250
+
+SOL_SOCKET = 1
+SCM_RIGHTS = 1
+MSG_CTRUNC = 0x08
+MSG_CMSG_CLOEXEC = 0x40000000
+
+handoff_state = {'peer' : None, 'requested' : False}
+handoff_cond = threading.Condition()
+handoff_conns = set()
+
+# Whether the call the thread is in may be given up for a handoff.
+handoff_local = threading.local()
+
+
+
+class HandoffInterrupted(Exception):
+  """
+  Raised in a blocked call when the proxy is handing over, before the
+  call has done anything. The call is made again afterwards, by this
+  proxy or the new one.
+  """
+  pass
+
+
+
+class HandoffConn:
+  """
+  What a handler thread has to hand over with its control connection.
+  """
+  def __init__(self, mastersock):
+    self.mastersock = mastersock
+    self.sockfd = None
+    self.lanesockfd = None
+    self.relayfd = None
+    self.pending_msg = None
+    self.parked = False
+    self.decision = None
+
+  def fds(self):
+    # The lind fds the connection serves.
+    return [int(fd) for fd in (self.sockfd, self.lanesockfd, self.relayfd) if fd not in (None, '')]
+
+
+
+class _iovec(ctypes.Structure):
+  _fields_ = [('iov_base', ctypes.c_void_p), ('iov_len', ctypes.c_size_t)]
+
+
+
+class _msghdr(ctypes.Structure):
+  _fields_ = [('msg_name', ctypes.c_void_p), ('msg_namelen', ctypes.c_uint32),
+              ('msg_iov', ctypes.POINTER(_iovec)), ('msg_iovlen', ctypes.c_size_t),
+              ('msg_control', ctypes.c_void_p), ('msg_controllen', ctypes.c_size_t),
+              ('msg_flags', ctypes.c_int)]
+
+
+
+class _cmsghdr(ctypes.Structure):
+  _fields_ = [('cmsg_len', ctypes.c_size_t), ('cmsg_level', ctypes.c_int),
+              ('cmsg_type', ctypes.c_int)]
+
+
+
+def _cmsg_align(length):
+  align = ctypes.sizeof(ctypes.c_size_t)
+  return (length + align - 1) & ~(align - 1)
+
+
+
+CMSG_HEADER_SIZE = _cmsg_align(ctypes.sizeof(_cmsghdr))
+
+# Python 2 has no sendmsg(), so the fds go through libc.
+try:
+  _sendmsg = _libc.sendmsg
+  _sendmsg.argtypes = [ctypes.c_int, ctypes.POINTER(_msghdr), ctypes.c_int]
+  _sendmsg.restype = ctypes.c_ssize_t
+  _recvmsg = _libc.recvmsg
+  _recvmsg.argtypes = [ctypes.c_int, ctypes.POINTER(_msghdr), ctypes.c_int]
+  _recvmsg.restype = ctypes.c_ssize_t
+except (NameError, AttributeError):
+  _sendmsg = None
+  _recvmsg = None
+
+
+
+def _send_fds(unix_sock, fds):
+  """
+  Send the fds over a Unix socket, one byte per batch of them.
+  """
+  for start in xrange(0, len(fds), HANDOFF_FD_BATCH):
+    fd_array = (ctypes.c_int * len(fds[start:start + HANDOFF_FD_BATCH]))(*fds[start:start + HANDOFF_FD_BATCH])
+    control_size = CMSG_HEADER_SIZE + _cmsg_align(ctypes.sizeof(fd_array))
+    control = ctypes.create_string_buffer(control_size)
+
+    cmsg = _cmsghdr.from_buffer(control)
+    cmsg.cmsg_len = CMSG_HEADER_SIZE + ctypes.sizeof(fd_array)
+    cmsg.cmsg_level = SOL_SOCKET
+    cmsg.cmsg_type = SCM_RIGHTS
+    ctypes.memmove(ctypes.addressof(control) + CMSG_HEADER_SIZE, fd_array, ctypes.sizeof(fd_array))
+
+    data = ctypes.create_string_buffer('F', 1)
+    iov = _iovec(ctypes.cast(data, ctypes.c_void_p), 1)
+    msg = _msghdr(None, 0, ctypes.pointer(iov), 1, ctypes.cast(control, ctypes.c_void_p), control_size, 0)
+
+    if _sendmsg(unix_sock.fileno(), ctypes.byref(msg), 0) != 1:
+      err = ctypes.get_errno()
+      raise OSError(err, os.strerror(err))
+
+
+
+def _recv_fds(unix_sock, count):
+  """
+  Receive count fds sent with _send_fds().
+  """
+  fds = []
+
+  while len(fds) < count:
+    batch = min(count - len(fds), HANDOFF_FD_BATCH)
+    control_size = CMSG_HEADER_SIZE + _cmsg_align(batch * ctypes.sizeof(ctypes.c_int))
+    control = ctypes.create_string_buffer(control_size)
+
+    data = ctypes.create_string_buffer(1)
+    iov = _iovec(ctypes.cast(data, ctypes.c_void_p), 1)
+    msg = _msghdr(None, 0, ctypes.pointer(iov), 1, ctypes.cast(control, ctypes.c_void_p), control_size, 0)
+
+    if _recvmsg(unix_sock.fileno(), ctypes.byref(msg), MSG_CMSG_CLOEXEC) != 1:
+      err = ctypes.get_errno()
+      raise OSError(err, os.strerror(err) if err else "The old proxy went away")
+
+    if msg.msg_flags & MSG_CTRUNC:
+      raise OSError(errno.EMSGSIZE, "Some of the fds were dropped")
+
+    offset = 0
+    while offset + CMSG_HEADER_SIZE <= msg.msg_controllen:
+      cmsg = _cmsghdr.from_buffer(control, offset)
+      if cmsg.cmsg_level == SOL_SOCKET and cmsg.cmsg_type == SCM_RIGHTS:
+        fd_count = (cmsg.cmsg_len - CMSG_HEADER_SIZE) / ctypes.sizeof(ctypes.c_int)
+        fds.extend((ctypes.c_int * fd_count).from_buffer(control, offset + CMSG_HEADER_SIZE))
+      offset += _cmsg_align(cmsg.cmsg_len)
+
+  return fds
+
+
+
+def _recv_all(unix_sock, length):
+  # Receive exactly length bytes from a Unix socket.
+  chunks = []
+  received = 0
+  while received < length:
+    chunk = unix_sock.recv(length - received)
+    if not chunk:
+      raise OSError(errno.ECONNRESET, "The other proxy went away")
+    chunks.append(chunk)
+    received += len(chunk)
+  return ''.join(chunks)
+
+
+
+def handoff_configure(handoff_path):
+  """
+  <Purpose>
+    Listen on a Unix socket at handoff_path for a new proxy that wants
+    to take over. A socket left behind by an earlier proxy is replaced.
+
+  <Exceptions>
+    python_socket.error if the socket can not be bound.
+
+  <Return>
+    None
+  """
+
+  if os.path.exists(handoff_path):
+    os.unlink(handoff_path)
+
+  server_sock = python_socket.socket(python_socket.AF_UNIX, python_socket.SOCK_STREAM)
+  server_sock.bind(handoff_path)
+  server_sock.listen(1)
+
+  blockedcallhook['check'] = _handoff_check
+
+  server = threading.Thread(target=_handoff_server, args=(server_sock,))
+  server.setDaemon(True)
+  server.start()
+
+
+
+def _handoff_server(server_sock):
+  """
+  Take the request of a new proxy and leave it to the master server.
+  """
+  while True:
+    peer_sock, addr = server_sock.accept()
+    try:
+      peer_sock.settimeout(HANDOFF_DEFAULT_TIMEOUT)
+      request = _recv_all(peer_sock, len(HANDOFF_MAGIC) + 1)
+      peer_sock.settimeout(None)
+    except (python_socket.error, OSError), err:
+      peer_sock.close()
+      continue
+
+    if request != HANDOFF_MAGIC + '\n' or handoff_state['peer'] is not None:
+      peer_sock.close()
+      continue
+
+    handoff_state['peer'] = peer_sock
+
+
+
+def _handoff_check():
+  # Give up a blocked call of a handler thread while handing over.
+  if handoff_state['requested'] and getattr(handoff_local, 'interruptible', False):
+    raise HandoffInterrupted()
+
+
+
+def handoff_register(conn):
+  handoff_cond.acquire()
+  handoff_conns.add(conn)
+  handoff_cond.release()
+
+
+
+def handoff_unregister(conn):
+  handoff_cond.acquire()
+  handoff_conns.discard(conn)
+  handoff_cond.notify_all()
+  handoff_cond.release()
+
+
+
+def handoff_park(conn, pending_msg=None):
+  """
+  <Purpose>
+    Wait, between calls or with the call that was given up, until the
+    proxy knows whether the connection goes to the new proxy.
+
+  <Arguments>
+    conn - the HandoffConn of the thread.
+    pending_msg - the call to make again, if any.
+
+  <Return>
+    True if the new proxy took over the connection, False if it stays.
+  """
+
+  handoff_cond.acquire()
+  try:
+    if not handoff_state['requested']:
+      return False
+
+    conn.pending_msg = pending_msg
+    conn.decision = None
+    conn.parked = True
+    handoff_cond.notify_all()
+
+    while conn.decision is None:
+      handoff_cond.wait()
+
+    conn.parked = False
+    return conn.decision == 'moved'
+  finally:
+    handoff_cond.release()
+
+
+
+def handoff_recv_call(mastersock, conn):
+  """
+  <Purpose>
+    Wait for the next call on a control connection, or for the
+    connection to be handed over.
+
+  <Return>
+    The message of the call, or None if the new proxy took over.
+  """
+
+  while True:
+    try:
+      return mastersock.recv(4096)
+    except SocketWouldBlockError:
+      if handoff_state['requested'] and handoff_park(conn):
+        return None
+      sleep(0.01)
+
+
+
+def handoff_give(tcpserversock):
+  """
+  <Purpose>
+    Hand over to the new proxy that asked for it: the listening socket,
+    the control connections and the lind sockets that can move.
+
+  <Arguments>
+    tcpserversock - the listening socket of the master server, which
+        no longer accepts connections.
+
+  <Return>
+    True if the new proxy took over, False if we carry on.
+  """
+
+  peer_sock = handoff_state['peer']
+  timeout = float(os.environ.get('LIBNIT_PROXY_HANDOFF_TIMEOUT', HANDOFF_DEFAULT_TIMEOUT))
+
+  log(LOG_INFO, 'proxy', "Handing over to a new proxy")
+
+  # Wait for the handler threads to get to a call they can hand over.
+  handoff_cond.acquire()
+  handoff_state['requested'] = True
+  deadline = time.time() + timeout
+  while time.time() < deadline:
+    busy_count = len([conn for conn in handoff_conns if not conn.parked and conn.relayfd is None])
+    if busy_count == 0:
+      break
+    handoff_cond.wait(deadline - time.time())
+  conns = list(handoff_conns)
+  handoff_cond.release()
+
+  # The fds of the threads that are still in a call, or relaying, stay.
+  kept_fds = set()
+  for conn in conns:
+    if not conn.parked:
+      kept_fds.update(conn.fds())
+
+  records = []
+  kernel_socks = []
+  for fd in filedescriptortable.keys():
+    if fd in kept_fds:
+      continue
+    try:
+      record, socks = handoff_export_socket(fd)
+    except SyscallError, (err_call, err_name, err_msg):
+      if err_name != 'ENOTSOCK':
+        kept_fds.add(fd)
+      continue
+    record['kernel_index'] = len(kernel_socks)
+    records.append(record)
+    kernel_socks.extend(socks)
+
+  moved_conns = []
+  for conn in conns:
+    if conn.parked and not kept_fds.intersection(conn.fds()):
+      moved_conns.append(conn)
+
+  state = {'master_loopback' : tcpserversock.on_loopback,
+           'conns' : [],
+           'sockets' : records}
+
+  fds = [tcpserversock.socketobj.fileno()]
+  for conn in moved_conns:
+    app_sock = conn.mastersock.socketobj
+    state['conns'].append(("%s:%d" % app_sock.getpeername(), conn.sockfd, conn.lanesockfd,
+                           conn.pending_msg, conn.mastersock.on_loopback))
+    fds.append(app_sock.fileno())
+  for kernel_sock in kernel_socks:
+    fds.append(kernel_sock.fileno())
+
+  try:
+    blob = marshal.dumps(state)
+    peer_sock.sendall(HANDOFF_MAGIC + python_struct.pack('<II', len(blob), len(fds)) + blob)
+    _send_fds(peer_sock, fds)
+    peer_sock.settimeout(timeout)
+    taken = _recv_all(peer_sock, 3) == 'ok\n'
+  except (python_socket.error, OSError, ValueError), err:
+    log(LOG_ERROR, 'proxy', "Handing over failed: %s", err)
+    taken = False
+
+  peer_sock.close()
+  handoff_state['peer'] = None
+
+  # What was handed over is closed here without shutting it down.
+  if taken:
+    for record in records:
+      handoff_forget_socket(record['fd'])
+    for conn in moved_conns:
+      handoff_release_socket(conn.mastersock)
+    handoff_release_socket(tcpserversock)
+
+  handoff_cond.acquire()
+  handoff_state['requested'] = False
+  for conn in conns:
+    if conn.parked:
+      conn.decision = taken and conn in moved_conns and 'moved' or 'stay'
+  handoff_cond.notify_all()
+  handoff_cond.release()
+
+  if taken:
+    log(LOG_INFO, 'proxy', "Handed over %d connections and %d sockets, %d connections stay",
+        len(moved_conns), len(records), len(conns) - len(moved_conns))
+  else:
+    log(LOG_WARN, 'proxy', "The new proxy did not take over, carrying on")
+
+  return taken
+
+
+
+def handoff_take(handoff_path):
+  """
+  <Purpose>
+    Take over from the proxy listening at handoff_path, if there is one.
+
+  <Arguments>
+    handoff_path - the path of its Unix socket.
+
+  <Exceptions>
+    OSError, python_socket.error if the handoff failed after the old
+    proxy agreed to it. The old proxy then carries on.
+
+  <Return>
+    The listening socket of the master server, or None if there is no
+    proxy to take over from.
+  """
+
+  peer_sock = python_socket.socket(python_socket.AF_UNIX, python_socket.SOCK_STREAM)
+  try:
+    peer_sock.connect(handoff_path)
+  except python_socket.error, err:
+    peer_sock.close()
+    if err.errno in (errno.ENOENT, errno.ECONNREFUSED):
+      return None
+    raise
+
+  peer_sock.sendall(HANDOFF_MAGIC + '\n')
+
+  header = _recv_all(peer_sock, len(HANDOFF_MAGIC) + 8)
+  if header[:len(HANDOFF_MAGIC)] != HANDOFF_MAGIC:
+    raise OSError(errno.EPROTO, "Not a proxy handing over")
+  blob_len, fd_count = python_struct.unpack('<II', header[len(HANDOFF_MAGIC):])
+  state = marshal.loads(_recv_all(peer_sock, blob_len))
+  fds = _recv_fds(peer_sock, fd_count)
+
+  # The fds are wrapped in python sockets of their own.
+  def _kernel_sock(fd, sock_type=python_socket.SOCK_STREAM):
+    kernel_sock = python_socket.fromfd(fd, python_socket.AF_INET, sock_type)
+    os.close(fd)
+    return kernel_sock
+
+  tcpserversock = TCPServerSocket(_kernel_sock(fds[0]), state['master_loopback'])
+
+  conn_fds = fds[1:1 + len(state['conns'])]
+  sock_fds = fds[1 + len(state['conns']):]
+
+  for record in state['sockets']:
+    socks = []
+    for index, (kind, on_loopback) in enumerate(record['parts']):
+      sock_type = kind == 'udp' and python_socket.SOCK_DGRAM or python_socket.SOCK_STREAM
+      socks.append(_kernel_sock(sock_fds[record['kernel_index'] + index], sock_type))
+    handoff_import_socket(record, socks)
+
+  peer_sock.sendall('ok\n')
+  peer_sock.close()
+
+  for (peer, sockfd, lanesockfd, pending_msg, on_loopback), fd in zip(state['conns'], conn_fds):
+    mastersock = EmulatedSocket(_kernel_sock(fd), on_loopback)
+    createthread(handle_new_sock_connection(mastersock, stats_open(peer), (sockfd, lanesockfd, pending_msg)))
+
+  log(LOG_INFO, 'proxy', "Took over %d connections and %d sockets from the old proxy",
+      len(state['conns']), len(state['sockets']))
+
+  return tcpserversock
+
+
+
+def handoff_drain():
+  """
+  Serve the connections that stayed until they are closed, then exit.
+  """
+  handoff_cond.acquire()
+  while handoff_conns:
+    handoff_cond.wait(1)
+  handoff_cond.release()
+
+  log(LOG_INFO, 'proxy', "All connections are closed, exiting")
+  _log_drain()
+
+  # The timer threads of the shims do not end on their own.
+  os._exit(0)
+
+
+
 
 # =================== Server Functionalities ============================
 
 
-def master_server():
+def master_server(tcpserversock=None):
   """
   <Purpose>
     The master server is the main entry point for all initial
     network activity.
+
+  <Arguments>
+    tcpserversock - the listening socket, if it was handed over by
+        another proxy.
   """
 
-  tcpserversock = listenforconnection(proxy_ip, proxy_port)
-  print "[ShimProxy] Starting Master Server on %s:%d" % (proxy_ip, proxy_port)
-  print "[ShimProxy] Using AFFIX string: %s" % shim_string
+  if tcpserversock is None:
+    tcpserversock = listenforconnection(proxy_ip, proxy_port)
+  log(LOG_INFO, 'proxy', "Starting Master Server on %s:%d", proxy_ip, proxy_port)
+  log(LOG_INFO, 'proxy', "Using AFFIX string: %s", shim_string)
 
   while True:
-    # Receive a new connection.
-    remote_ip, remote_port, mastersock = block_call(tcpserversock.getconnection)  
+    # Receive a new connection, unless a new proxy wants to take over.
+    try:
+      remote_ip, remote_port, mastersock = tcpserversock.getconnection()
+    except SocketWouldBlockError:
+      if handoff_state['peer'] is not None and handoff_give(tcpserversock):
+        break
+      sleep(0.01)
+      continue
 
     # Once a new connection is made, launch a new thread to handle the connection.
-    print "[ShimProxy] Received connection from %s:%d" % (remote_ip, remote_port)
-    print ''
-    createthread(handle_new_sock_connection(mastersock))
+    log(LOG_INFO, 'conn', "Received connection from %s:%d", remote_ip, remote_port)
+    conn_stats = stats_open("%s:%d" % (remote_ip, remote_port))
+    createthread(handle_new_sock_connection(mastersock, conn_stats))
+
+  handoff_drain()
 
 
 
@@ -80,7 +1246,7 @@ def generate_new_id():
 
 
 
-def handle_new_sock_connection(mastersock):
+def handle_new_sock_connection(mastersock, conn_stats=None, handoff=None):
   """
   <Purpose>
     Once a connection is made, this thread is responsible
@@ -90,6 +1256,10 @@ def handle_new_sock_connection(mastersock):
   <Arguments>
     mastersock - the socket connection for an open socket to
       the application.
+    conn_stats - the ConnStats of the connection, None if the proxy
+      keeps no statistics.
+    handoff - (sockfd, lanesockfd, pending call) of a connection that
+      another proxy handed over (see handoff_take()), None otherwise.
 
   <Exceptions>
     None
@@ -106,12 +1276,45 @@ def handle_new_sock_connection(mastersock):
     # Generate a new connection id for this connection.
     # connection_id = int(generate_new_id())
 
-    # We will keep track of what socket this is.
-    thissockfd = None
+    # We will keep track of what socket this is. A read lane only
+    # serves the receive calls of a socket that is owned by another
+    # connection, so it must not close the socket when it goes away.
+    thissockfd, lanesockfd, pending_msg = handoff or (None, None, None)
+
+    handoff_conn = HandoffConn(mastersock)
+    handoff_conn.sockfd = thissockfd
+    handoff_conn.lanesockfd = lanesockfd
+    handoff_register(handoff_conn)
 
     while True:
       try:
-        msg_recv = block_call(mastersock.recv, 4096)
+        # A call that was given up for a handoff is made again first.
+        if pending_msg:
+          msg_recv = pending_msg
+          pending_msg = None
+        else:
+          msg_recv = handoff_recv_call(mastersock, handoff_conn)
+          if msg_recv is None:
+            log(LOG_INFO, 'conn', "Handed over the connection of sock '%s'.", thissockfd or lanesockfd)
+            break
+
+        # A sampled call comes after its trace.
+        trace_id = None
+        if msg_recv.startswith('trace\0'):
+          trace_id, msg_recv = handle_trace(mastersock, msg_recv)
+          if conn_stats:
+            conn_stats.bytes_in += CALL_HEADER_SIZE
+
+        if trace_id or conn_stats:
+          call_start = time.time()
+
+        # A batch carries its calls after the call header.
+        if msg_recv.startswith('batch\0'):
+          handle_batch(mastersock, msg_recv, conn_stats)
+          if trace_id:
+            span_record('proxy batch', trace_id, call_start, time.time(), {'fd' : thissockfd})
+            span_set_trace(None)
+          continue
 
         arg_len = len(msg_recv) - 21
         # Unpack the received message into the function call and arg list.
@@ -123,35 +1326,88 @@ def handle_new_sock_connection(mastersock):
         call_func = list_recv[0].strip('\0')
         call_args = list_recv[1].strip('\0')
       
-        print "[NetRecv] Call '%s' for sock '%s' with args '%s'" % (call_func, str(thissockfd), call_args)
+        if log_level >= LOG_DEBUG:
+          log(LOG_DEBUG, 'call', "[NetRecv] Call '%s' for sock '%s' with args '%s'", call_func, thissockfd or lanesockfd, call_args)
 
         # Check that if it is a legal Posix call. If it is then we call the 
         # appropriate function to handle it.
         if call_func not in libc_function_dict.keys():
           raise PosixCallNotFound("The call '%s' could not be recognized." % call_func)
         
+        if conn_stats:
+          conn_stats.bytes_in += len(msg_recv)
+          conn_stats.pending = 1
+
         # Call the libc function with the unique connection id and arguments
-        # provided for this call.
-        (return_val, err_val) = libc_function_dict[call_func](call_args)
-        print "Return Val for %s is '%s' and err: '%s'" % (call_func, str(return_val), str(err_val))
+        # provided for this call. A call that blocks is given up if the
+        # proxy is handing over, and made again afterwards.
+        handoff_local.interruptible = True
+        try:
+          (return_val, err_val) = libc_function_dict[call_func](call_args)
+        except HandoffInterrupted:
+          pending_msg = msg_recv
+        finally:
+          handoff_local.interruptible = False
+
+        if pending_msg:
+          if handoff_park(handoff_conn, pending_msg):
+            log(LOG_INFO, 'conn', "Handed over the connection of sock '%s' in a call.", thissockfd or lanesockfd)
+            break
+          continue
+
+        if log_level >= LOG_DEBUG:
+          log(LOG_DEBUG, 'call', "Return Val for %s is '%s' and err: '%s'", call_func, return_val, err_val)
 
         # If this is creating a new socket, then we keep track of the
         # socket fd.
         if call_func == 'socket':
           thissockfd = return_val
+        elif call_func == 'attach' and err_val == -1:
+          thissockfd = call_args
+        elif call_func == 'lane' and err_val == -1:
+          lanesockfd = call_args
+        elif call_func == 'close' and call_args == thissockfd:
+          # Closing it again when the connection goes away would
+          # drop the reference of another process.
+          thissockfd = None
+
+        handoff_conn.sockfd = thissockfd
+        handoff_conn.lanesockfd = lanesockfd
+
+        if conn_stats:
+          conn_stats.pending = 0
+          conn_stats.sockfd = thissockfd or lanesockfd
+          conn_stats.record(call_func, thissockfd or lanesockfd or None, call_start, time.time(), return_val, err_val)
+
+        # Once the relay is accepted, this connection carries the raw
+        # stream and we are done handling calls for it.
+        if call_func == 'relay' and return_val == '1':
+          handoff_conn.relayfd = call_args
+          block_call(mastersock.send, struct_pack("<i%ds" % len(return_val), err_val, return_val))
+          if trace_id:
+            span_set_trace(None)
+          relay_connection(mastersock, int(call_args), conn_stats)
+          break
 
         # Pack up the message and send it back to the C server.
         call_return_tuple = (err_val, return_val)
         struct_format = "<i%ds" % len(return_val)
         packed_msg = struct_pack(struct_format, err_val, return_val)        
 
-        print "[NetSend] Return result for call '%s' for sock '%s': '%s':%d" % (call_func, str(thissockfd), return_val, err_val)
-        print ''
+        if log_level >= LOG_DEBUG:
+          log(LOG_DEBUG, 'call', "[NetSend] Return result for call '%s' for sock '%s': '%s':%d", call_func, thissockfd, return_val, err_val)
 
         block_call(mastersock.send, packed_msg)
+
+        if conn_stats:
+          conn_stats.bytes_out += len(packed_msg)
+
+        if trace_id:
+          span_record('proxy ' + call_func, trace_id, call_start, time.time(),
+                      {'fd' : thissockfd or lanesockfd, 'result' : return_val[:32], 'err' : err_val})
+          span_set_trace(None)
       except (SocketClosedRemote, SocketClosedLocal), err:
-        print "[ShimProxy] Socket closed detected for sock '%s'." % str(thissockfd)
-        print ''
+        log(LOG_INFO, 'conn', "Socket closed detected for sock '%s'.", thissockfd)
 
         # Check to see if we know the fd of this socket.
         if thissockfd:
@@ -163,14 +1419,318 @@ def handle_new_sock_connection(mastersock):
             pass
         break
       except Exception, err:
+        if conn_stats:
+          stats_close(conn_stats)
+        handoff_unregister(handoff_conn)
         raise
-        print "[ShimProxy] Error handling call: '%s'" % str(err)
+        log(LOG_ERROR, 'call', "Error handling call: '%s'", err)
+
+    if conn_stats:
+      stats_close(conn_stats)
+    handoff_unregister(handoff_conn)
 
   return _handle_new_connection_helper
 
 
 
 
+# ========================== Traced Calls ======================================================
+
+def handle_trace(mastersock, msg_recv):
+  """
+  <Purpose>
+    Take the trace a sampled call comes with (see LIBNIT_SPANS in
+    libnetworkinterpose.c) off the front of the message. Its arg list is
+    "<trace id>,<flow id>,<ns the call was sent at>". The time from then
+    until now is the span of the call waiting for the proxy.
+
+  <Arguments>
+    mastersock - the connection the call came in on.
+    msg_recv - what was received so far.
+
+  <Exceptions>
+    SocketClosedRemote, SocketClosedLocal if the connection goes away.
+
+  <Return>
+    A tuple of the trace id (None if the proxy writes no spans) and the
+    call that follows: a complete call header, or the start of a batch.
+  """
+
+  msg_recv = _recv_exactly(mastersock, msg_recv, CALL_HEADER_SIZE + 20)
+  trace_id, flow_id, sent_ns = msg_recv[20:CALL_HEADER_SIZE].strip('\0').split(',')
+  msg_recv = msg_recv[CALL_HEADER_SIZE:]
+
+  if not msg_recv.startswith('batch\0'):
+    msg_recv = _recv_exactly(mastersock, msg_recv, CALL_HEADER_SIZE)
+
+  if not span_enabled():
+    return (None, msg_recv)
+
+  now = time.time()
+  span_set_trace(trace_id)
+  span_record('proxy queue', trace_id, int(sent_ns) / 1e9, now)
+  span_record_flow(flow_id, now)
+
+  return (trace_id, msg_recv)
+
+
+
+
+# ========================== Batched Calls =====================================================
+
+# The size of the FUNCSTRUCT that starts every call, and the calls a
+# batch may contain. A batched recv never waits for data (see
+# call_recv_nowait()), so one idle socket does not stall the batch.
+CALL_HEADER_SIZE = 20 + 2048
+BATCH_CALLS = { "send" : call_send,
+                "recv" : call_recv_nowait,
+                "connect" : call_connect,
+                "shutdown" : call_shutdown
+              }
+
+
+def _recv_exactly(mastersock, data, length):
+  """
+  Receive from mastersock until data is length bytes long.
+  """
+  chunks = [data]
+  received = len(data)
+
+  while received < length:
+    chunk = block_call(mastersock.recv, min(length - received, RELAY_CHUNK_SIZE))
+    chunks.append(chunk)
+    received += len(chunk)
+
+  return ''.join(chunks)
+
+
+
+def handle_batch(mastersock, msg_recv, conn_stats=None):
+  """
+  <Purpose>
+    Run a batch of calls sent by libnit_submit() and send back all
+    their results at once. The arg list of the call header is
+    "<count>,<length>", and length bytes of "<call>,<args length>\n<args>"
+    records follow the header. The calls run in order, each one like
+    it would have run on its own, except that a recv fails with EAGAIN
+    rather than wait for data.
+
+  <Arguments>
+    mastersock - the connection the batch came in on.
+    msg_recv - what was received of the batch so far.
+    conn_stats - the ConnStats of the connection, or None.
+
+  <Exceptions>
+    SocketClosedRemote, SocketClosedLocal if the connection goes away.
+
+  <Return>
+    None
+  """
+
+  msg_recv = _recv_exactly(mastersock, msg_recv, CALL_HEADER_SIZE)
+  count_str, payload_len_str = msg_recv[20:CALL_HEADER_SIZE].strip('\0').split(',')
+  payload = _recv_exactly(mastersock, msg_recv[CALL_HEADER_SIZE:], int(payload_len_str))
+
+  if log_level >= LOG_DEBUG:
+    log(LOG_DEBUG, 'call', "[NetRecv] Batch of %s calls, %s bytes", count_str, payload_len_str)
+
+  if conn_stats:
+    conn_stats.bytes_in += CALL_HEADER_SIZE + len(payload)
+    conn_stats.pending = int(count_str)
+
+  results = []
+  pos = 0
+
+  for index in xrange(int(count_str)):
+    newline = payload.index('\n', pos)
+    call_func, args_len_str = payload[pos:newline].split(',')
+    pos = newline + 1 + int(args_len_str)
+    call_args = payload[newline + 1:pos]
+
+    if conn_stats:
+      call_start = time.time()
+
+    if call_func in BATCH_CALLS:
+      (return_val, err_val) = BATCH_CALLS[call_func](call_args)
+    else:
+      (return_val, err_val) = ('', error_dict["EINVAL"])
+
+    if conn_stats:
+      conn_stats.pending -= 1
+      # The batched calls all start with the fd of their socket.
+      conn_stats.record(call_func, call_args.split(',', 1)[0], call_start, time.time(), return_val, err_val)
+
+    results.append("%d,%d\n%s" % (err_val, len(return_val), return_val))
+
+  reply = ''.join(results)
+  packed_msg = struct_pack("<i", -1) + struct_pack("<i", len(reply)) + reply
+
+  if conn_stats:
+    conn_stats.bytes_out += len(packed_msg)
+
+  while packed_msg:
+    sent = block_call(mastersock.send, packed_msg)
+    packed_msg = packed_msg[sent:]
+
+
+
+
+# ========================== Zero-copy Relay ===================================================
+
+def _splice_stream(src_fd, dst_fd, progress=None):
+  """
+  <Purpose>
+    Move all the data from src_fd to dst_fd through a pipe with
+    splice(), until src_fd reaches the end of the stream. If given,
+    progress is called with the number of bytes of every chunk.
+
+  <Exceptions>
+    OSError - raised if either of the sockets fails.
+
+  <Return>
+    The number of bytes relayed.
+  """
+
+  pipe_read, pipe_write = os.pipe()
+  total_bytes = 0
+
+  try:
+    while True:
+      bytes_in = _splice(src_fd, None, pipe_write, None, RELAY_CHUNK_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE)
+
+      if bytes_in < 0:
+        err = ctypes.get_errno()
+        if err == errno.EINTR:
+          continue
+        raise OSError(err, os.strerror(err))
+
+      if bytes_in == 0:
+        break
+
+      bytes_left = bytes_in
+      while bytes_left > 0:
+        bytes_out = _splice(pipe_read, None, dst_fd, None, bytes_left, SPLICE_F_MOVE | SPLICE_F_MORE)
+
+        if bytes_out < 0:
+          err = ctypes.get_errno()
+          if err == errno.EINTR:
+            continue
+          raise OSError(err, os.strerror(err))
+
+        bytes_left -= bytes_out
+
+      total_bytes += bytes_in
+      if progress:
+        progress(bytes_in)
+  finally:
+    os.close(pipe_read)
+    os.close(pipe_write)
+
+  return total_bytes
+
+
+
+def _copy_stream(src_sock, dst_sock, progress=None):
+  """
+  The user space equivalent of _splice_stream().
+  """
+
+  total_bytes = 0
+
+  while True:
+    data = src_sock.recv(RELAY_CHUNK_SIZE)
+    if not data:
+      break
+    dst_sock.sendall(data)
+    total_bytes += len(data)
+    if progress:
+      progress(len(data))
+
+  return total_bytes
+
+
+
+def relay_connection(mastersock, relayfd, conn_stats=None):
+  """
+  <Purpose>
+    Relay the raw stream between the application's connection to the
+    proxy and the outbound socket of relayfd, in both directions. The
+    proxy only keeps the bookkeeping for the connection.
+
+  <Arguments>
+    mastersock - the connection to the application.
+    relayfd - the lind fd of the outbound socket.
+    conn_stats - the ConnStats of the connection, or None.
+
+  <Side Effects>
+    The lind socket is closed once both directions are done.
+
+  <Return>
+    None
+  """
+
+  app_sock = mastersock.socketobj
+  remote_sock = get_relay_socket(relayfd)
+
+  # Repy keeps its sockets non-blocking, the relay wants them blocking.
+  app_sock.setblocking(1)
+  remote_sock.setblocking(1)
+
+  relayed_bytes = {}
+
+  # Each direction only counts its own side of the stats.
+  progress_dict = {'out' : None, 'in' : None}
+
+  if conn_stats:
+    sock_stats = conn_stats.sock(str(relayfd))
+
+    def _progress_out(byte_count):
+      conn_stats.bytes_in += byte_count
+      sock_stats[1] += byte_count
+
+    def _progress_in(byte_count):
+      conn_stats.bytes_out += byte_count
+      sock_stats[0] += byte_count
+
+    progress_dict = {'out' : _progress_out, 'in' : _progress_in}
+
+  def _relay_direction(name, src_sock, dst_sock):
+    relayed_bytes[name] = 0
+    try:
+      if _splice:
+        relayed_bytes[name] = _splice_stream(src_sock.fileno(), dst_sock.fileno(), progress_dict[name])
+      else:
+        relayed_bytes[name] = _copy_stream(src_sock, dst_sock, progress_dict[name])
+    except (OSError, IOError), err:
+      pass
+
+    # Pass the end of the stream on to the other side.
+    try:
+      dst_sock.shutdown(1)
+    except Exception:
+      pass
+
+  upstream = threading.Thread(target=_relay_direction, args=('out', app_sock, remote_sock))
+  upstream.start()
+  _relay_direction('in', remote_sock, app_sock)
+  upstream.join()
+
+  log(LOG_INFO, 'conn', "Relay for sock '%d' done: %d bytes out, %d bytes in.", relayfd, relayed_bytes['out'], relayed_bytes['in'])
+
+  try:
+    call_close(str(relayfd))
+  except:
+    pass
+
+  try:
+    mastersock.close()
+  except:
+    pass
+
+
+
+
+
 # ========================== Assorted Functions ================================================
 
 
@@ -198,8 +1758,73 @@ def main():
     This is the main launching point for the smart server.
     We launch the master server that handles all socket 
     network activity.
+
+    An optional "[ip:]port" argument lets several proxies run on the
+    same host, e.g. one per entry in LIBNIT_PROXY_ENDPOINTS:
+
+      $ python smart_shim_proxy.py 53679
   """
-  master_server()
+  global proxy_ip
+  global proxy_port
+
+  if len(sys.argv) > 1:
+    endpoint = sys.argv[1]
+    if ':' in endpoint:
+      proxy_ip, port_str = endpoint.rsplit(':', 1)
+    else:
+      port_str = endpoint
+    proxy_port = int(port_str)
+
+  log_configure()
+
+  # LIBNIT_PROXY_SPANS adds the proxy's spans of sampled calls to a file.
+  span_path = os.environ.get('LIBNIT_PROXY_SPANS')
+  if span_path:
+    try:
+      span_configure(span_path)
+    except (IOError, OSError), err:
+      log(LOG_ERROR, 'proxy', "Unable to open the span file: %s", err)
+      _log_drain()
+      sys.exit(1)
+
+  # SIGUSR2 takes a profile of the proxy (see profile_start()).
+  signal.signal(signal.SIGUSR2, _profile_signal)
+
+  # LIBNIT_PROXY_STATS serves the counters on a Unix socket.
+  stats_path = os.environ.get('LIBNIT_PROXY_STATS')
+  if stats_path:
+    try:
+      stats_configure(stats_path)
+    except (python_socket.error, OSError), err:
+      log(LOG_ERROR, 'proxy', "Unable to serve the stats on %s: %s", stats_path, err)
+      _log_drain()
+      sys.exit(1)
+
+  # LIBNIT_PROXY_SHIM_POLICY picks the shim stack per destination.
+  policy_path = os.environ.get('LIBNIT_PROXY_SHIM_POLICY')
+  if policy_path:
+    try:
+      rule_count = load_shim_policy(policy_path)
+    except (IOError, ValueError), err:
+      log(LOG_ERROR, 'proxy', "Unable to load the shim policy: %s", err)
+      _log_drain()
+      sys.exit(1)
+    log(LOG_INFO, 'proxy', "Loaded %d shim policy rules from %s", rule_count, policy_path)
+
+  # LIBNIT_PROXY_HANDOFF takes over from a running proxy, if there is
+  # one, and lets the next one take over from us.
+  tcpserversock = None
+  handoff_path = os.environ.get('LIBNIT_PROXY_HANDOFF')
+  if handoff_path:
+    try:
+      tcpserversock = handoff_take(handoff_path)
+      handoff_configure(handoff_path)
+    except (python_socket.error, OSError, ValueError), err:
+      log(LOG_ERROR, 'proxy', "Unable to take over from the running proxy: %s", err)
+      _log_drain()
+      sys.exit(1)
+
+  master_server(tcpserversock)
 
 
 if __name__ == '__main__':
@@ -0,0 +1,18 @@
+#include <assert.h>
+#include <netdb.h>
+#include <stddef.h>
+
+int main( int argc, char **argv ) {
+    struct addrinfo *res;
+    int i;
+
+    /* The name is looked up twice, so that the second lookup takes the
+     * cache path when the interposer is loaded. Only the answers are
+     * checked here, not where they came from. */
+    for ( i = 0; i < 2; i++ ) {
+        assert( getaddrinfo( argv[ 1 ], "80", NULL, &res ) == 0 );
+        assert( res && res->ai_addr );
+        freeaddrinfo( res );
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../libnit.h"
+
+/* Sends a message in small pieces, coalesced by libnit if it is
+ * preloaded, and prints the statistics of the socket.
+ */
+int main( int argc, char **argv ) {
+    int sock;
+    struct sockaddr_in server;
+    struct libnit_stats stats;
+    char* message = "Hello, world!";
+    int message_length = strlen( message );
+    int sent_length = 0;
+    int i;
+
+    inet_pton( AF_INET, argv[ 1 ], &server.sin_addr );
+    server.sin_family = AF_INET;
+    server.sin_port = htons( atoi( argv[ 2 ] ) );
+
+    sock = socket( AF_INET, SOCK_STREAM, 0 );
+
+    if ( !libnit_present() )
+        printf( "libnit is not loaded.\n" );
+    else
+        assert( libnit_set_mode( sock, LIBNIT_MODE_COALESCE, 1024 ) == 0 );
+
+    connect(
+        sock,
+        (struct sockaddr*) &server,
+        sizeof( server )
+    );
+
+    for ( i = 0; i < message_length; i++ )
+        sent_length += send( sock, message + i, 1, 0 );
+
+    if ( libnit_present() ) {
+        assert( libnit_get_stats( sock, &stats ) == 0 );
+        assert( stats.send_pending == (uint64_t) message_length );
+        assert( libnit_flush( sock ) == 0 );
+        assert( libnit_get_stats( sock, &stats ) == 0 );
+
+        printf( "%llu bytes in %llu sends, %llu ns on average.\n",
+                (unsigned long long) stats.bytes_sent,
+                (unsigned long long) stats.send_calls,
+                (unsigned long long) ( stats.send_ns / stats.send_calls ) );
+    }
+
+    close( sock );
+
+    assert( sent_length == message_length );
+    return 0;
+}